@@ -9,7 +9,7 @@ mkdir -p eval
 run_tool() {
     mkdir -p eval/$2
     file='run.out'
-    rm -f eval/$2/$file
+    rm -f eval/$2/$file eval/$2/stats.*.json
 
     for (( i = 0; i < iterations; i++))
     do
@@ -18,7 +18,7 @@ run_tool() {
             ./hashtable >> eval/$2/$file
         elif [ $1 -eq 1 ]; then
             # instrumentation
-            LD_PRELOAD=$tool_path/scope-advice.so ./hashtable >> eval/$2/$file
+            STATS_FILE=eval/$2/stats.$i.json LD_PRELOAD=$tool_path/scope-advice.so ./hashtable >> eval/$2/$file
         fi
         echo '------- END '$i' ITERATION ----------' >> eval/$2/$file
     done
@@ -26,39 +26,26 @@ run_tool() {
 
 run_tool 0 'baseline'
 
+# every variant lives in the same build, SA_MODE selects it
 cd $tool_path
-git checkout helper.h common.h *.cu
-git apply patch/naive.patch
-make -B
+make
 cd $current
+
+export SA_MODE=naive
 run_tool 1 '1t1b'
 
-cd $tool_path
-git checkout helper.h common.h *.cu
-git apply patch/para.patch
-make -B
-cd $current
+# parallel bars ran 12 workers and 768 buffers in the paper, whatever the host offers
+export NUM_THREADS=12 NUM_BUFFERS=768
+export SA_MODE=para
 run_tool 1 '12tnb'
 
-cd $tool_path
-git checkout helper.h common.h *.cu
-git apply patch/para+sampling.patch
-make -B
-cd $current
+export SA_MODE=para+sampling
 run_tool 1 'sampling'
 
-cd $tool_path
-git checkout helper.h common.h *.cu
-git apply patch/scope-advice.patch
-make -B
-cd $current
+export SA_MODE=scope-advice
 run_tool 1 'scopeadvice'
 
-cd $tool_path
-git checkout helper.h common.h *.cu
-git apply patch/nvbit.patch
-make -B
-cd $current
+export SA_MODE=nvbit
 run_tool 1 'blank'
 
 ./get_time.sh
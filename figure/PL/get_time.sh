@@ -10,9 +10,19 @@ sam='sampling'
 sa='scopeadvice'
 blank='blank'
 
+# E2E time of each iteration, from the stats file the tool wrote for it
+e2e() {
+    for (( i = 0; ; i++ ))
+    do
+        stats=$folder/$1/stats.$i.json
+        [ -f $stats ] || break
+        python3 -c 'import json, sys; print(json.load(open(sys.argv[1]))["timing"]["e2e_ms"])' $stats
+    done
+}
+
 cat $folder/$base/$out | grep 'runtime' | awk '{ print $10 }' > $folder/$base".out"
-cat $folder/$onet1b/$out | grep 'E2E' | awk '{ print $3 }' > $folder/$onet1b".out"
-cat $folder/$one2tnb/$out | grep 'E2E' | awk '{ print $3 }' > $folder/$one2tnb".out"
-cat $folder/$sam/$out | grep 'E2E' | awk '{ print $3 }' > $folder/$sam".out"
-cat $folder/$sa/$out | grep 'E2E' | awk '{ print $3 }' > $folder/$sa".out"
-cat $folder/$blank/$out | grep 'E2E' | awk '{ print $3 }' > $folder/$blank".out"
+e2e $onet1b > $folder/$onet1b".out"
+e2e $one2tnb > $folder/$one2tnb".out"
+e2e $sam > $folder/$sam".out"
+e2e $sa > $folder/$sa".out"
+e2e $blank > $folder/$blank".out"
@@ -0,0 +1,95 @@
+#ifndef ACCESS_MAP_H
+#define ACCESS_MAP_H
+
+#include <atomic>
+#include <stdint.h>
+#include <stdlib.h>
+#include "cpu_topology.h"
+
+/* Sparse host map from granule index to a granule_summary_t pointer (or LOCKED).
+ * The granule space (shadow granules of a launch) is split in fixed-size pages, and
+ * only pages that receive a packet are materialized. The directory comes from
+ * huge_alloc, so the OS backs it lazily as well. Pages are first touched by
+ * the worker inserting into them, hence live on its node. Pages are installed with a CAS, hence
+ * workers never take a lock to grow the map, and fresh pages come zeroed,
+ * so no zeroing pass is needed before a kernel. */
+
+/* 4096 granules (16KB of device memory) per page */
+#define AMAP_PAGE_BITS 12
+#define AMAP_PAGE_SIZE (ONE << AMAP_PAGE_BITS)
+
+typedef std::atomic<uint64_t> amap_entry_t;
+
+typedef struct _access_map_t {
+    std::atomic<amap_entry_t*> *dir;
+    uint64_t pages;
+    /* pages materialized so far, and most ever held at once, for memory accounting */
+    std::atomic<uint64_t> materialized;
+    uint64_t peak;
+} access_map_t;
+
+static void amap_init(access_map_t *map, uint64_t len) {
+    map->pages = (len + AMAP_PAGE_SIZE - 1) >> AMAP_PAGE_BITS;
+    map->dir = (std::atomic<amap_entry_t*> *)huge_alloc(map->pages * sizeof(std::atomic<amap_entry_t*>));
+    map->materialized.store(0);
+    map->peak = 0;
+}
+
+/* Make room for granules below 'len'. The map must be empty, and no one may use it meanwhile */
+static void amap_grow(access_map_t *map, uint64_t len) {
+    uint64_t pages = (len + AMAP_PAGE_SIZE - 1) >> AMAP_PAGE_BITS;
+    if (pages <= map->pages)
+        return;
+    huge_free(map->dir, map->pages * sizeof(std::atomic<amap_entry_t*>));
+    map->dir = (std::atomic<amap_entry_t*> *)huge_alloc(pages * sizeof(std::atomic<amap_entry_t*>));
+    map->pages = pages;
+}
+
+/* Drop every page, leaving an empty map. No one may use the map meanwhile */
+static void amap_reset(access_map_t *map) {
+    for (uint64_t p = 0; p < map->pages; p++) {
+        amap_entry_t *page = map->dir[p].exchange(NULL);
+        if (page != NULL)
+            free(page);
+    }
+    uint64_t used = map->materialized.exchange(0);
+    if (used > map->peak)
+        map->peak = used;
+}
+
+/* Slot for granule 'idx', materializing its page if needed */
+static amap_entry_t &amap_slot(access_map_t *map, uint64_t idx) {
+    std::atomic<amap_entry_t*> &dir_entry = map->dir[idx >> AMAP_PAGE_BITS];
+    amap_entry_t *page = dir_entry.load(std::memory_order_acquire);
+    if (page == NULL) {
+        amap_entry_t *fresh = (amap_entry_t *)calloc(AMAP_PAGE_SIZE, sizeof(amap_entry_t));
+        if (dir_entry.compare_exchange_strong(page, fresh, std::memory_order_acq_rel)) {
+            page = fresh;
+            map->materialized.fetch_add(1);
+        } else {
+            /* someone else installed the page first, 'page' now holds it */
+            free(fresh);
+        }
+    }
+    return page[idx & (AMAP_PAGE_SIZE - 1)];
+}
+
+/* Value for granule 'idx', 0 if its page was never touched */
+static uint64_t amap_peek(access_map_t *map, uint64_t idx) {
+    amap_entry_t *page = map->dir[idx >> AMAP_PAGE_BITS].load(std::memory_order_acquire);
+    if (page == NULL)
+        return 0;
+    return page[idx & (AMAP_PAGE_SIZE - 1)].load();
+}
+
+static uint64_t amap_pages(access_map_t *map) {
+    uint64_t used = map->materialized.load();
+    return used > map->peak ? used : map->peak;
+}
+
+static double amap_bytes(access_map_t *map) {
+    return (double)map->pages * sizeof(std::atomic<amap_entry_t*>) +
+           (double)amap_pages(map) * AMAP_PAGE_SIZE * sizeof(amap_entry_t);
+}
+
+#endif /* ACCESS_MAP_H */
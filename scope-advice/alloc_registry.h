@@ -0,0 +1,97 @@
+#ifndef ALLOC_REGISTRY_H
+#define ALLOC_REGISTRY_H
+
+#include <map>
+#include <stdint.h>
+#include <vector>
+
+/* Live device allocations, fed by the allocation and free callbacks. It is free
+ * of CUDA calls, so callback sequences can be replayed on plain host code.
+ *
+ * Allocations are kept in an interval index ordered by base address, and are
+ * disjoint at all times. Device memory is never handed out twice, so a new
+ * allocation overlapping live ones means those were released through a path
+ * we did not see: they are dropped (counted as stale). The same base seen
+ * again, e.g. a global looked up twice, updates the existing entry.
+ *
+ * Each allocation may carry an owner tag, e.g. the module of a global, so
+ * that all of them go away together. */
+
+typedef struct _alloc_range_t {
+    uint64_t bound;
+    uint64_t owner;
+} alloc_range_t;
+
+typedef struct _alloc_registry_t {
+    /* base -> range */
+    std::map<uint64_t, alloc_range_t> live;
+    /* bytes currently live, and most ever live at once */
+    uint64_t bytes, peak;
+    uint64_t allocs, frees, stale;
+} alloc_registry_t;
+
+static void registry_init(alloc_registry_t *reg) {
+    reg->live.clear();
+    reg->bytes = reg->peak = 0;
+    reg->allocs = reg->frees = reg->stale = 0;
+}
+
+/* Live allocation containing 'addr', live.end() if none */
+static std::map<uint64_t, alloc_range_t>::iterator registry_find(alloc_registry_t *reg, uint64_t addr) {
+    auto it = reg->live.upper_bound(addr);
+    if (it == reg->live.begin())
+        return reg->live.end();
+    --it;
+    return addr < it->second.bound ? it : reg->live.end();
+}
+
+static void registry_erase(alloc_registry_t *reg, std::map<uint64_t, alloc_range_t>::iterator it) {
+    reg->bytes -= it->second.bound - it->first;
+    reg->live.erase(it);
+}
+
+/* Record [base, bound) */
+static void registry_add(alloc_registry_t *reg, uint64_t base, uint64_t bound, uint64_t owner = 0) {
+    if (bound <= base)
+        return;
+    reg->allocs++;
+    /* drop whatever overlaps, the one starting before 'base' first */
+    auto it = registry_find(reg, base);
+    if (it == reg->live.end())
+        it = reg->live.lower_bound(base);
+    while (it != reg->live.end() && it->first < bound) {
+        if (it->first != base)
+            reg->stale++;
+        auto next = std::next(it);
+        registry_erase(reg, it);
+        it = next;
+    }
+    reg->live[base] = {bound, owner};
+    reg->bytes += bound - base;
+    if (reg->bytes > reg->peak)
+        reg->peak = reg->bytes;
+}
+
+/* Release the allocation starting at 'base', false if there is none */
+static bool registry_remove(alloc_registry_t *reg, uint64_t base) {
+    auto it = reg->live.find(base);
+    if (it == reg->live.end())
+        return false;
+    reg->frees++;
+    registry_erase(reg, it);
+    return true;
+}
+
+/* Release every allocation of 'owner' */
+static void registry_remove_owner(alloc_registry_t *reg, uint64_t owner) {
+    for (auto it = reg->live.begin(); it != reg->live.end();) {
+        auto next = std::next(it);
+        if (it->second.owner == owner) {
+            reg->frees++;
+            registry_erase(reg, it);
+        }
+        it = next;
+    }
+}
+
+#endif /* ALLOC_REGISTRY_H */
@@ -0,0 +1,70 @@
+#ifndef BATCH_DECODE_H
+#define BATCH_DECODE_H
+
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+/* Decoding of a whole channel buffer at once. Memory packets are filtered
+ * out of the buffer and reduced to (granule, info) pairs, which are then
+ * radix sorted by granule. Packets hitting the same granule end up next to
+ * each other, so the granule lock is taken once per run instead of once per
+ * packet. */
+
+typedef struct _packet_ref_t {
+    uint64_t md_offset;
+    uint64_t info;
+} packet_ref_t;
+
+/* 11-bit digits, passes depend on the width of granule indices (see radix_passes) */
+#define RADIX_BITS 11
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+/* Filter TYPE_MEM packets of 'chan' into 'out', returns number of packets.
+   Branch-free: every entry is written and the cursor only advances on a match,
+   so there is no per-packet branch on the type to mispredict. */
+static uint32_t decode_buffer(channel_t *chan, uint32_t num_entries, packet_ref_t *out) {
+    uint32_t n = 0;
+    for (uint32_t e = 0; e < num_entries; e++) {
+        /* memory packets carry their shadow granule */
+        out[n].md_offset = chan[e].addr;
+        out[n].info = channel_trace(chan[e]);
+        n += (channel_type(chan[e]) == TYPE_MEM);
+    }
+    return n;
+}
+
+/* Number of radix passes needed for granule indices below 'len' */
+static int radix_passes(uint64_t len) {
+    int bits = 0;
+    while (bits < 64 && (len >> bits) != 0)
+        bits++;
+    return (bits + RADIX_BITS - 1) / RADIX_BITS;
+}
+
+/* LSD radix sort of 'n' packets by md_offset. 'tmp' must hold 'n' entries.
+   Result ends in 'packets' */
+static void radix_sort_packets(packet_ref_t *packets, packet_ref_t *tmp, uint32_t n, int passes) {
+    uint32_t count[RADIX_BUCKETS];
+    packet_ref_t *src = packets, *dst = tmp;
+    for (int p = 0; p < passes; p++) {
+        int shift = p * RADIX_BITS;
+        memset(count, 0, sizeof(count));
+        for (uint32_t i = 0; i < n; i++)
+            count[(src[i].md_offset >> shift) & (RADIX_BUCKETS - 1)]++;
+        uint32_t sum = 0;
+        for (int b = 0; b < RADIX_BUCKETS; b++) {
+            uint32_t c = count[b];
+            count[b] = sum;
+            sum += c;
+        }
+        for (uint32_t i = 0; i < n; i++)
+            dst[count[(src[i].md_offset >> shift) & (RADIX_BUCKETS - 1)]++] = src[i];
+        std::swap(src, dst);
+    }
+    if (src != packets)
+        memcpy(packets, src, sizeof(packet_ref_t) * n);
+}
+
+#endif /* BATCH_DECODE_H */
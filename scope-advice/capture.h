@@ -0,0 +1,212 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Capture of what the host analysis gets from the GPU, for replay without one
+ * (see sa-replay.cpp). The file is a header followed by records, each one a
+ * record_header_t and a payload padded to CAPTURE_ALIGN, so that the file can
+ * be mapped and channel buffers handed to the workers in place.
+ *
+ * Per launch, in this order for a given launch but interleaved with others:
+ *   CAPTURE_KERNEL  static fence table of its kernel, as of the launch
+ *   CAPTURE_LAUNCH  dimension, settings, and the allocations live at the
+ *                   launch with the shadow layout built from them
+ *   CAPTURE_BUFFER  one per message pass, the raw channel bytes
+ *   CAPTURE_STAGED  device metadata staged at the end of the kernel
+ * Payloads are the structs below followed by their arrays, in field order. */
+
+#define CAPTURE_MAGIC 0x3130544143415341ull /* "ASACAT01" */
+#define CAPTURE_VERSION 1
+#define CAPTURE_ALIGN 16
+
+typedef struct _capture_header_t {
+    uint64_t magic;
+    uint32_t version, wire_version;
+} capture_header_t;
+
+typedef enum : uint32_t {
+    CAPTURE_KERNEL = 1,
+    CAPTURE_LAUNCH = 2,
+    CAPTURE_BUFFER = 3,
+    CAPTURE_STAGED = 4,
+} capture_type_t;
+
+/* launch: id of the launch the record belongs to, bytes: payload without padding */
+typedef struct _record_header_t {
+    uint32_t type;
+    uint32_t launch;
+    uint64_t bytes;
+} record_header_t;
+
+/* CAPTURE_KERNEL: then 'fences' capture_fence_t, the name and the line info of each fence */
+typedef struct _capture_kernel_t {
+    uint32_t kernel, epochs;
+    uint32_t fences, name_len;
+} capture_kernel_t;
+
+/* fence 'id' (-1 to epochs), at 'addr' with 'info_len' bytes of line info if this kernel numbered it */
+typedef struct _capture_fence_t {
+    int32_t id;
+    uint32_t is_redundant;
+    uint64_t addr;
+    uint32_t numbered, info_len;
+} capture_fence_t;
+
+/* CAPTURE_LAUNCH: then 'ranges' shadow_range_t and 'allocations' capture_alloc_t */
+typedef struct _capture_launch_t {
+    uint32_t kernel, epochs;
+    int32_t tool_mode, stream_depth;
+    int32_t warpsInGrid, warpsPerBlock, blockDim, ranges;
+    int64_t gridDim;
+    uint64_t shadow_len, allocations;
+    /* allocation_records counters */
+    uint64_t allocs, frees, stale, peak;
+} capture_launch_t;
+
+typedef struct _capture_alloc_t {
+    uint64_t base, bound, owner;
+} capture_alloc_t;
+
+/* CAPTURE_STAGED: nothing more unless 'analyzed'. Then fence_words words of fence_meta. With a
+   worklist, 'candidates' granules and their compacted records (see candidate_words), otherwise
+   for each shadow range of the launch its memory_meta and, with 'stream', its stream_meta */
+typedef struct _capture_staged_t {
+    uint32_t analyzed, worklist, stream, pad;
+    uint64_t fence_words, candidates;
+    /* instrumented kernel time */
+    double kernel_ms;
+} capture_staged_t;
+
+/* Piece of a payload, records are written from several of them at once */
+typedef struct _capture_part_t {
+    const void *data;
+    uint64_t bytes;
+} capture_part_t;
+
+typedef struct _capture_t {
+    FILE *file;
+    /* records come from the application thread and from the distributor */
+    pthread_mutex_t lock;
+    uint64_t records, bytes;
+} capture_t;
+
+static bool capture_open(capture_t *cap, const char *path, uint32_t wire_version) {
+    cap->file = fopen(path, "wb");
+    cap->records = cap->bytes = 0;
+    if (cap->file == NULL)
+        return false;
+    pthread_mutex_init(&cap->lock, NULL);
+    capture_header_t header = {CAPTURE_MAGIC, CAPTURE_VERSION, wire_version};
+    fwrite(&header, sizeof(header), 1, cap->file);
+    cap->bytes = sizeof(header);
+    return true;
+}
+
+static uint64_t capture_pad(uint64_t bytes) {
+    return (bytes + CAPTURE_ALIGN - 1) & ~(uint64_t)(CAPTURE_ALIGN - 1);
+}
+
+/* Append a record made of 'n' parts, in one piece */
+static void capture_write(capture_t *cap, capture_type_t type, uint32_t launch, const capture_part_t *parts, int n) {
+    static const char zeros[CAPTURE_ALIGN] = {0};
+    record_header_t header = {type, launch, 0};
+    for (int p = 0; p < n; p++)
+        header.bytes += parts[p].bytes;
+    pthread_mutex_lock(&cap->lock);
+    fwrite(&header, sizeof(header), 1, cap->file);
+    for (int p = 0; p < n; p++) {
+        if (parts[p].bytes > 0)
+            fwrite(parts[p].data, 1, parts[p].bytes, cap->file);
+    }
+    fwrite(zeros, 1, capture_pad(header.bytes) - header.bytes, cap->file);
+    cap->records++;
+    cap->bytes += sizeof(header) + capture_pad(header.bytes);
+    pthread_mutex_unlock(&cap->lock);
+}
+
+static void capture_close(capture_t *cap) {
+    if (cap->file == NULL)
+        return;
+    fclose(cap->file);
+    cap->file = NULL;
+}
+
+/* Capture file mapped for reading, and the next record in it */
+typedef struct _capture_reader_t {
+    const char *base;
+    uint64_t size, at;
+} capture_reader_t;
+
+static bool capture_map(capture_reader_t *reader, const char *path, uint32_t wire_version) {
+    reader->base = NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(capture_header_t)) {
+        close(fd);
+        return false;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return false;
+    const capture_header_t *header = (const capture_header_t *)base;
+    if (header->magic != CAPTURE_MAGIC || header->version != CAPTURE_VERSION || header->wire_version != wire_version) {
+        munmap(base, st.st_size);
+        return false;
+    }
+    /* read once front to back */
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+    reader->base = (const char *)base;
+    reader->size = st.st_size;
+    reader->at = sizeof(capture_header_t);
+    return true;
+}
+
+/* Next record, false at the end of the file or on a truncated record */
+static bool capture_next(capture_reader_t *reader, const record_header_t *&header, const char *&payload) {
+    if (reader->at + sizeof(record_header_t) > reader->size)
+        return false;
+    header = (const record_header_t *)(reader->base + reader->at);
+    if (header->bytes > reader->size - reader->at - sizeof(record_header_t))
+        return false;
+    payload = reader->base + reader->at + sizeof(record_header_t);
+    reader->at += sizeof(record_header_t) + capture_pad(header->bytes);
+    return true;
+}
+
+static void capture_unmap(capture_reader_t *reader) {
+    if (reader->base != NULL)
+        munmap((void *)reader->base, reader->size);
+    reader->base = NULL;
+}
+
+/* Walks the arrays of a payload */
+typedef struct _capture_cursor_t {
+    const char *at, *end;
+} capture_cursor_t;
+
+static capture_cursor_t capture_cursor(const record_header_t *header, const char *payload) {
+    capture_cursor_t c = {payload, payload + header->bytes};
+    return c;
+}
+
+/* Next 'bytes' of the payload, NULL past its end */
+static const void *cursor_take(capture_cursor_t *c, uint64_t bytes) {
+    if (bytes > (uint64_t)(c->end - c->at))
+        return NULL;
+    const void *p = c->at;
+    c->at += bytes;
+    return p;
+}
+
+#endif /* CAPTURE_H */
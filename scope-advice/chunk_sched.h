@@ -0,0 +1,155 @@
+#ifndef CHUNK_SCHED_H
+#define CHUNK_SCHED_H
+
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+
+/* Scheduling of the detection scan. The work of a launch is cut in chunks of
+ * units (granules of a staged range, or queued candidates) whatever the
+ * allocation they come from. Chunks whose estimated cost is too high are
+ * split further, down to parts of the traces of a single granule.
+ *
+ * Every worker starts with a contiguous share of the chunks, of about equal
+ * cost, in its own deque. It takes chunks from the head of its deque, and once
+ * it runs dry steals from the tail of the others. Head and tail of a deque
+ * share one word, so both ends are taken with a single CAS. Free of CUDA
+ * calls, so it can be driven by synthetic workloads as well. */
+
+/* whole trace list of the unit */
+#define TRACES_ALL UINT64_MAX
+
+typedef struct _detect_chunk_t {
+    /* staged range the units belong to, -1 for the candidate worklist */
+    int32_t range;
+    uint64_t first, count;
+    /* part of the traces of a single unit, [0, TRACES_ALL) for all of them */
+    uint64_t trace_begin, trace_end;
+    uint64_t cost;
+} detect_chunk_t;
+
+static detect_chunk_t make_chunk(int32_t range, uint64_t first, uint64_t count) {
+    detect_chunk_t c;
+    c.range = range;
+    c.first = first;
+    c.count = count;
+    c.trace_begin = 0;
+    c.trace_end = TRACES_ALL;
+    c.cost = 0;
+    return c;
+}
+
+/* chunk indices [head, tail), head in the upper half. Padded to a cache line, deques of
+   a launch sit next to each other */
+typedef struct _chunk_deque_t {
+    std::atomic<uint64_t> span;
+    char pad[64 - sizeof(std::atomic<uint64_t>)];
+} chunk_deque_t;
+
+static void deque_set(chunk_deque_t *deque, uint32_t head, uint32_t tail) {
+    deque->span.store(((uint64_t)head << 32) | tail);
+}
+
+/* Owner end */
+static bool deque_pop(chunk_deque_t *deque, uint32_t &chunk) {
+    uint64_t span = deque->span.load();
+    while (1) {
+        uint32_t head = span >> 32, tail = (uint32_t)span;
+        if (head >= tail)
+            return false;
+        if (deque->span.compare_exchange_weak(span, ((uint64_t)(head + 1) << 32) | tail)) {
+            chunk = head;
+            return true;
+        }
+    }
+}
+
+/* Thief end */
+static bool deque_steal(chunk_deque_t *deque, uint32_t &chunk) {
+    uint64_t span = deque->span.load();
+    while (1) {
+        uint32_t head = span >> 32, tail = (uint32_t)span;
+        if (head >= tail)
+            return false;
+        if (deque->span.compare_exchange_weak(span, ((uint64_t)head << 32) | (tail - 1))) {
+            chunk = tail - 1;
+            return true;
+        }
+    }
+}
+
+/* Next chunk for worker 'self' of 'workers', false once every deque is empty */
+static bool sched_next(chunk_deque_t *deques, int workers, int self, uint32_t &chunk) {
+    if (deque_pop(&deques[self], chunk))
+        return true;
+    for (int k = 1; k < workers; k++) {
+        if (deque_steal(&deques[(self + k) % workers], chunk))
+            return true;
+    }
+    return false;
+}
+
+/* Replace the chunks costing more than 'target' by pieces of about 'target'. Runs
+ * of units first, then parts of the traces of a unit that is too heavy on its own.
+ * unit_cost(chunk, unit) is the cost of one unit, traces(chunk, unit) its traces */
+template <typename C, typename T>
+static void sched_split(std::vector<detect_chunk_t> &chunks, uint64_t target, C unit_cost, T traces) {
+    if (target == 0)
+        target = 1;
+    std::vector<detect_chunk_t> out;
+    out.reserve(chunks.size());
+    for (auto &each: chunks) {
+        if (each.cost <= target || (each.count == 1 && each.trace_end != TRACES_ALL)) {
+            out.push_back(each);
+            continue;
+        }
+        detect_chunk_t piece = make_chunk(each.range, each.first, 0);
+        for (uint64_t u = each.first; u < each.first + each.count; u++) {
+            uint64_t cost = unit_cost(each, u);
+            if (cost > target) {
+                if (piece.count != 0)
+                    out.push_back(piece);
+                uint64_t n = traces(each, u);
+                for (uint64_t begin = 0; begin < n || begin == 0; begin += target) {
+                    detect_chunk_t part = make_chunk(each.range, u, 1);
+                    part.trace_begin = begin;
+                    part.trace_end = begin + target >= n ? TRACES_ALL : begin + target;
+                    part.cost = (part.trace_end == TRACES_ALL ? n : part.trace_end) - begin;
+                    out.push_back(part);
+                }
+                piece = make_chunk(each.range, u + 1, 0);
+                continue;
+            }
+            if (piece.count != 0 && piece.cost + cost > target) {
+                out.push_back(piece);
+                piece = make_chunk(each.range, u, 0);
+            }
+            piece.count++;
+            piece.cost += cost;
+        }
+        if (piece.count != 0)
+            out.push_back(piece);
+    }
+    chunks.swap(out);
+}
+
+/* Hand contiguous shares of the chunks, of about equal cost, to the deques */
+static void sched_assign(chunk_deque_t *deques, int workers, const std::vector<detect_chunk_t> &chunks) {
+    uint64_t total = 0;
+    for (auto &each: chunks)
+        total += each.cost + 1;
+    uint32_t begin = 0, c = 0;
+    uint64_t sum = 0;
+    for (int w = 0; w < workers; w++) {
+        /* this share ends once the cost so far reaches (w + 1) / workers of the total */
+        uint64_t until = total * (w + 1) / workers;
+        while (c < chunks.size() && (sum < until || w == workers - 1)) {
+            sum += chunks[c].cost + 1;
+            c++;
+        }
+        deque_set(&deques[w], begin, c);
+        begin = c;
+    }
+}
+
+#endif /* CHUNK_SCHED_H */
@@ -26,15 +26,34 @@
  */
 
 
+#ifndef COMMON_H
+#define COMMON_H
+
 #include <stdint.h>
 #include <string>
 
+#ifdef __CUDACC__
 /* Added for dev_metadata struct */
 #include "utils/utils.h"
 #include "utils/channel.hpp"
-
-#ifndef COMMON_H
-#define COMMON_H
+#else
+/* Host-only builds (sa-replay) see the formats and the host helpers below, without CUDA */
+#include <stdio.h>
+#include <type_traits>
+#define __host__
+#define __device__
+#define CEILING(x, y) (((x) + (y)-1) / (y))
+class ChannelDev;
+/* mixed-type min/max, as provided by the CUDA headers */
+template <typename A, typename B>
+static inline typename std::common_type<A, B>::type min(A a, B b) {
+    return a < b ? a : b;
+}
+template <typename A, typename B>
+static inline typename std::common_type<A, B>::type max(A a, B b) {
+    return a > b ? a : b;
+}
+#endif
 
 #define WARP_SIZE 32
 
@@ -45,13 +64,13 @@
 #define ULL   unsigned long long int
 
 #define LOCKED (uint64_t)-2
-#define D_LOCKED (uint32_t)-2
 #define GRAN 4
 #define BASE_DELAY 100
 #define MAX_DELAY 6400
-#define SAMP_BASE 1
-#define PER_THREAD_PER_INSTR 15
-#define NUM_STREAM_TRACES 2
+/* default SAMPLE_PERIOD, 1 in SAMPLE_PERIOD accesses (or blocks) is traced */
+#define SAMPLE_PERIOD 15
+/* in-GPU traces kept per granule, STREAM_DEPTH picks 0 to MAX_STREAM_DEPTH at startup */
+#define MAX_STREAM_DEPTH 16
 
 // Needed to avoid typecasting issues
 #define ONE ((uint64_t)1)
@@ -64,13 +83,23 @@
 #define debug_printf(...) 
 #endif
 
-// optimization switches
-#define DO_FILTER 1
-#define DO_PARALLEL 1
-#define DO_SAMPLING 1
-#define DO_STREAM 1
+// optimization switches, a pipeline variant (mode) is a combination of them.
+// Every combination is built, SA_MODE picks one at startup.
+#define MODE_FILTER 1
+#define MODE_SAMPLING 2
+#define MODE_STREAM 4
 // evaluation flag to measure NVBit overhead
-#define DO_ANALYZE 1
+#define MODE_ANALYZE 8
+// host only, instrumented functions are the same with and without it
+#define MODE_PARALLEL 16
+#define MODE_COUNT 32
+#define DEVICE_MODE_COUNT 16
+
+#define DO_FILTER(m) (((m) & MODE_FILTER) != 0)
+#define DO_SAMPLING(m) (((m) & MODE_SAMPLING) != 0)
+#define DO_STREAM(m) (((m) & MODE_STREAM) != 0)
+#define DO_ANALYZE(m) (((m) & MODE_ANALYZE) != 0)
+#define DO_PARALLEL(m) (((m) & MODE_PARALLEL) != 0)
 
 /* Below enums are used for the creation of 'info' member in mem_access_t struct.
  * It maintains information necessary for host processing, in a bitwise manner.
@@ -83,6 +112,9 @@ typedef enum : uint32_t {
     HPOS_SCP = 2,
     HPOS_ID = 4,
     HPOS_EP = 27,
+    /* fields below are only used on the channel, see channel_t */
+    HPOS_VER = 48,
+    HPOS_TYPE = 56,
 } h_position_t;
 
 
@@ -90,13 +122,17 @@ typedef enum : uint32_t {
     HSZ_SCP = 2,
     HSZ_ID = 23,
     HSZ_EP = 5,
+    HSZ_TRACE = 32,
+    HSZ_VER = 8,
+    HSZ_TYPE = 8,
 } h_sizes_t;
 
 /* @brief: Information collected in the instrumentation function and passed
  * on the channel from the GPU to the CPU
 
  * @args
- * addr: Global address where the operation took place
+ * addr: Global address where the operation took place. On the channel, the shadow
+ *       granule of the access instead (see shadow_range_t)
  * info: Metadata maintained for minimizing transmission size
  */
 typedef struct {
@@ -124,19 +160,15 @@ typedef enum : uint8_t {
     TYPE_SYN = 2
 } type_t;
 
-/* @brief: Information received in the channel, it can be of barrier_t or mem_access_t
+/* @brief: Record received in the channel (compact wire format, WIRE_VERSION)
 
- * The channel can pass different types of information. Encode them as struct and keep
- * them as part of the union struct. This minimizes the size of the struct that the channel
- * needs.
+ * Only memory packets and the end-of-kernel marker are ever pushed, so the record is a
+ * mem_access_t with no separate tag. The trace in 'info' occupies its low HSZ_TRACE bits,
+ * the format version and the type_t are folded into its spare upper bits. This keeps a
+ * record at 16B instead of the 24B of a tagged union.
  */
-typedef struct {
-    type_t type;
-    union {
-        fence_t st;
-        mem_access_t ma;
-    };
-} channel_t;
+#define WIRE_VERSION 2
+typedef mem_access_t channel_t;
 
 // WARN: These definitions are used in the post-processing script as well. Change wisely
 typedef enum : uint32_t { 
@@ -169,9 +201,31 @@ typedef enum : uint32_t {
 
 typedef enum : uint32_t {
     SZ_ID = 20,
-    SZ_CNT = 2,
+    SZ_CNT = 5,
 } sizes_t;
 
+/* Execution sampling policies, selected by SAMPLE_POLICY (see skip_instrumentation) */
+typedef enum : uint32_t {
+    SAMPLE_HASH = 0,
+    SAMPLE_CTA = 1,
+} sample_policy_t;
+
+/* all of them are published by a single 32 bit CAS, see device_meta.h */
+static_assert(POS_CNT + SZ_CNT <= 32, "granule metadata must fit in a word");
+static_assert(MAX_STREAM_DEPTH < (1 << SZ_CNT), "count of stream traces too narrow");
+
+/* Tracked allocation as seen by the instrumented functions: granules [base, bound) of the
+ * application are shadowed by granules [shadow, shadow + bound - base) of memory_meta.
+ * Ranges are sorted and disjoint, and the shadow region is densely packed, so metadata
+ * only exists for tracked bytes and two allocations never share a granule.
+ */
+typedef struct {
+    uint64_t base, bound;
+    uint64_t shadow;
+} shadow_range_t;
+/* granule outside of every tracked allocation */
+#define NO_SHADOW ((uint64_t)-1)
+
 /* Maintain a single struct that needs to be sent to instrumented function,
  * rather than adding each parameter to the function, add it to struct
  */
@@ -180,17 +234,28 @@ typedef struct _device_arguments {
     uint32_t threads_per_block;
     /* communication channel between GPU-CPU */
     ChannelDev *channel_dev;
-    /* in-GPU metadata for tracing access per GRAN memory */
+    /* in-GPU metadata for tracing access per GRAN memory, 'length' shadow granules */
     uint32_t *memory_meta;
     uint64_t length;
-    /* metadata for execution sampling */
-    char *sampling_meta;
-    char *random_meta;
+    shadow_range_t *ranges;
+    uint32_t num_ranges;
+    /* shadow granules that became multi-block and stored, in the order they did, and their
+       metadata compacted after the kernel (memory_meta word, then stream_depth traces) */
+    uint64_t *worklist;
+    unsigned long long *worklist_len;
+    uint64_t worklist_cap;
+    uint32_t *candidates;
+    /* execution sampling, per-thread count of instrumented accesses */
+    uint32_t *exec_count;
+    uint64_t sample_seed;
+    uint32_t sample_period;
+    uint32_t sample_policy;
     /* in-GPU fence metadata maintained */
     uint32_t *fence_meta;
     uint32_t warps_per_grid;
-    /* in-GPU metadata for maintaining trace */
+    /* in-GPU metadata for maintaining trace, stream_depth consecutive traces per shadow granule */
     uint32_t *stream_meta;
+    uint32_t stream_depth;
 } dev_args;
 
 static __inline__ __device__ const char *scopeToStr(scope_t scope) {
@@ -203,6 +268,19 @@ static __inline__ __device__ const char *scopeToStr(scope_t scope) {
     }
 }
 
+/* Seeded hash of the sampling inputs (splitmix64 finalizer), same on host and device */
+static __inline__ __device__ __host__ uint64_t sampleHash(uint64_t seed, uint64_t a, uint64_t b) {
+    uint64_t x = seed ^ (a * 0x9e3779b97f4a7c15ull) ^ (b + 0x632be59bd9b4e019ull + (a << 6) + (a >> 2));
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+/* Blocks traced by SAMPLE_CTA, block 0 is always one of them */
+static __inline__ __device__ __host__ bool ctaSampled(uint64_t seed, uint64_t bid, uint32_t period) {
+    return bid == 0 || sampleHash(seed, bid, 0) % period == 0;
+}
+
 #define hasMask(val, mask) (((val) & (mask)) == (mask))
 #define roundUp(divisor, dividend) CEILING(divisor, dividend)
 
@@ -234,6 +312,35 @@ static __inline__ __device__ __host__ void setBits(uint64_t &loc, uint64_t start
     loc |= ((val & ((ONE << depth) - ONE)) << start);
 }
 
+static __inline__ __device__ __host__ void make_channel(channel_t &c, uint64_t addr, uint64_t trace, type_t type) {
+    c.addr = addr;
+    c.info = trace;
+    setBits(c.info, HPOS_VER, HSZ_VER, WIRE_VERSION);
+    setBits(c.info, HPOS_TYPE, HSZ_TYPE, type);
+}
+
+static __inline__ __device__ __host__ type_t channel_type(const channel_t &c) {
+    return (type_t)getBits(c.info, HPOS_TYPE, HSZ_TYPE);
+}
+
+static __inline__ __device__ __host__ uint32_t channel_version(const channel_t &c) {
+    return (uint32_t)getBits(c.info, HPOS_VER, HSZ_VER);
+}
+
+/* A message pass holds whole records of this wire format: checked on its first and last
+   record, which the decoder then trusts for the ones in between */
+static __inline__ __host__ bool channel_pass_valid(const char *buffer, uint64_t bytes) {
+    if (bytes == 0 || bytes % sizeof(channel_t) != 0)
+        return false;
+    const channel_t *first = (const channel_t *)buffer;
+    const channel_t *last = (const channel_t *)(buffer + bytes - sizeof(channel_t));
+    return channel_version(*first) == WIRE_VERSION && channel_version(*last) == WIRE_VERSION;
+}
+
+static __inline__ __device__ __host__ uint64_t channel_trace(const channel_t &c) {
+    return getBits(c.info, 0, HSZ_TRACE);
+}
+
 static __inline__ __device__ __host__ void print_md(uint64_t md, uint64_t addr) {
     printf("Addr(%lx) Multi-Block (%lu), ST(%lu), CurId(%lu)\n", addr, getBit(md, POS_MB),
                        getBit(md, POS_ST), getBits(md, POS_ID, SZ_ID));
@@ -34,102 +34,149 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include "utils.h"
+#include "segment_ring.hpp"
 
 #define ULL unsigned long long int
 #define USE_ASYNC_STREAM
 
+/* Default number of buffer segments. Warps keep filling segment k+1 while
+ * the host drains segment k, and only stall when all segments are waiting for
+ * the host.
+ *
+ * Protocol: 'head' is a byte position that is never reset. Position P lives
+ * in generation P / seg_size, which uses segment generation % segments
+ * at offset P % seg_size. A segment may be written for generation g only once
+ * the host has set seg_gen[segment] to g. The warp whose record ends the
+ * segment closes it: it waits until every claimed byte is committed and rings
+ * the segment's doorbell with the byte count. The host receives segments in
+ * order, clears the doorbell and hands the segment over to generation
+ * g + segments (see SegmentRing). The first warp of a generation to see the
+ * hand-over records it in device memory (open_gen), so that the other pushes
+ * of the generation do not poll the host word over the bus.
+ *
+ * In zero-copy mode segments live in mapped pinned host memory. The host then
+ * hands out pointers to received segments and releases them once processed,
+ * instead of copying them out of device memory. */
+#define CHANNEL_SEGMENTS 4
+
 class ChannelDev {
   private:
     int id;
-    volatile int* doorbell;
+    /* per-segment byte count ready for the host (mapped host memory) */
+    volatile int* doorbells;
+    /* per-segment generation allowed to write (mapped host memory) */
+    volatile uint64_t* seg_gen;
 
     uint8_t* buff;
-    uint8_t* buff_end;
+    uint32_t seg_size;
+    int segments;
 
-    /* head/tail pointers */
-    uint8_t* volatile buff_write_head_ptr;
-    uint8_t* volatile buff_write_tail_ptr;
+    /* byte position of the next record, see protocol above */
+    ULL head;
+    /* per-segment bytes written by warps of the current generation */
+    ULL* committed;
+    /* per-segment generation known to be handed over, plus one (0: none yet).
+       A generation keeps its segment until it closes it, so this stays valid */
+    ULL* open_gen;
 
   public:
     ChannelDev() {}
 
     __device__ __forceinline__ void push(void* packet, uint32_t nbytes) {
-        assert(nbytes != 0);
-
-        uint8_t* curr_ptr = NULL;
-
-        while (curr_ptr == NULL) {
-            curr_ptr =
-                (uint8_t*)atomicAdd((ULL*)&buff_write_head_ptr, (ULL)nbytes);
-
-            /* if the current position plus nbytes is after buff_end, the
-             * buffer is full.
-             * Many warps could find condition true, but only the first warp
-             * will find true the condition after. */
-            if (curr_ptr + nbytes > buff_end) {
-                /* I am the first warp that found the buffer full and
-                 * I am the one responsible for flushing the buffer out */
-                if (curr_ptr <= buff_end) {
-                    /* wait until everyone completed to write */
-                    while (buff_write_tail_ptr != curr_ptr) {
-                    }
-
-                    /* flush buffer */
-                    flush();
-                } else {
-                    /* waiting for buffer to flush */
-                    while (buff_write_head_ptr > buff_end) {
-                    }
-                }
-                curr_ptr = NULL;
+        /* records never straddle two segments */
+        assert(nbytes != 0 && seg_size % nbytes == 0);
+
+        ULL pos = atomicAdd(&head, (ULL)nbytes);
+        ULL gen = pos / seg_size;
+        uint32_t off = pos % seg_size;
+        int seg = gen % segments;
+
+        /* wait for the host to hand the segment over to this generation,
+           only until some warp of the generation has seen it */
+        if (*(volatile ULL*)&open_gen[seg] != gen + 1) {
+            while (seg_gen[seg] != gen) {
             }
+            atomicMax(&open_gen[seg], gen + 1);
         }
 
-        memcpy(curr_ptr, packet, nbytes);
-        atomicAdd((ULL*)&buff_write_tail_ptr, (ULL)nbytes);
+        memcpy(buff + (uint64_t)seg * seg_size + off, packet, nbytes);
+        __threadfence();
+        atomicAdd(&committed[seg], (ULL)nbytes);
+
+        if (off + nbytes == seg_size) {
+            /* I filled the segment, send it out */
+            close(seg, gen, seg_size);
+        }
     }
 
+    /* Send out the partially filled segment and wait until the host has
+     * drained everything. Meant for the end of a kernel, when no one else
+     * pushes. */
     __device__ __forceinline__ void flush() {
-        uint32_t nbytes = (uint32_t)(buff_write_tail_ptr - buff);
-        // printf("FLUSH CHANNEL#%d: buffer bytes %d\n", id, nbytes);
-        if (nbytes == 0) {
+        ULL pos = atomicAdd(&head, 0);
+        if (pos == 0) {
             return;
         }
+        ULL gen = pos / seg_size;
+        uint32_t off = pos % seg_size;
+        if (off != 0) {
+            /* move head to the next generation and close this one */
+            atomicAdd(&head, (ULL)(seg_size - off));
+            close(gen % segments, gen, off);
+        } else {
+            /* last segment was filled, and closed, by a push */
+            gen -= 1;
+        }
 
-        /* make sure everything is visible in memory */
-        __threadfence_system();
-
-        assert(*doorbell == 0);
-        /* notify current buffer has something*/
-        *doorbell = nbytes;
-
-        /* wait for host to release the doorbell */
-        while (*doorbell != 0)
+        /* wait for host to release the last segment */
+        while (seg_gen[gen % segments] == gen)
             ;
+    }
 
-        /* reset head/tail */
-        buff_write_tail_ptr = buff;
-        __threadfence();
-        buff_write_head_ptr = buff;
+  private:
+    __device__ __forceinline__ void close(int seg, ULL gen, uint32_t nbytes) {
+        /* doorbell may still belong to the previous generation */
+        while (seg_gen[seg] != gen) {
+        }
+        /* wait until everyone completed to write */
+        while (*(volatile ULL*)&committed[seg] != nbytes) {
+        }
+        committed[seg] = 0;
 
-        // printf("FLUSH CHANNEL#%d: DONE\n", id);
+        /* make sure everything is visible in memory */
+        __threadfence_system();
+
+        assert(doorbells[seg] == 0);
+        /* notify segment has something */
+        doorbells[seg] = nbytes;
     }
 
-  private:
-    /* called by the ChannelHost init */
-    void init(int id, int* h_doorbell, int buff_size) {
+    /* called by the ChannelHost init, d_buff is set when segments are
+     * provided by the host (zero-copy) */
+    void init(int id, int* h_doorbells, uint64_t* h_seg_gen, int buff_size,
+              int segments, uint8_t* d_buff) {
         CUDA_SAFECALL(
-            cudaHostGetDevicePointer((void**)&doorbell, (void*)h_doorbell, 0));
+            cudaHostGetDevicePointer((void**)&doorbells, (void*)h_doorbells, 0));
+        CUDA_SAFECALL(
+            cudaHostGetDevicePointer((void**)&seg_gen, (void*)h_seg_gen, 0));
 
-/* allocate large buffer */
+/* allocate large buffer, one segment after the other */
+        if (d_buff != NULL) {
+            buff = d_buff;
+        } else {
 #ifdef USE_ASYNC_STREAM
-        CUDA_SAFECALL(cudaMalloc((void**)&buff, buff_size));
+            CUDA_SAFECALL(cudaMalloc((void**)&buff, (size_t)buff_size * segments));
 #else
-        CUDA_SAFECALL(cudaMallocManaged((void**)&buff, buff_size));
+            CUDA_SAFECALL(cudaMallocManaged((void**)&buff, (size_t)buff_size * segments));
 #endif
-        buff_write_head_ptr = buff;
-        buff_write_tail_ptr = buff;
-        buff_end = buff + buff_size;
+        }
+        CUDA_SAFECALL(cudaMalloc((void**)&committed, sizeof(ULL) * segments));
+        CUDA_SAFECALL(cudaMemset(committed, 0, sizeof(ULL) * segments));
+        CUDA_SAFECALL(cudaMalloc((void**)&open_gen, sizeof(ULL) * segments));
+        CUDA_SAFECALL(cudaMemset(open_gen, 0, sizeof(ULL) * segments));
+        head = 0;
+        seg_size = buff_size;
+        this->segments = segments;
         this->id = id;
     }
 
@@ -138,14 +185,17 @@ class ChannelDev {
 
 class ChannelHost {
   private:
-    volatile int* doorbell;
+    volatile int* doorbells;
+    volatile uint64_t* seg_gen;
 
     cudaStream_t stream;
     ChannelDev* ch_dev;
 
-    /* pointers to device buffer */
-    uint8_t* dev_buff_read_head;
+    /* pointers to device buffer, and its host mapping in zero-copy mode */
     uint8_t* dev_buff;
+    uint8_t* host_buff;
+    SegmentRing ring;
+    bool zero_copy;
 
     /* receiving thread */
     pthread_t thread;
@@ -154,14 +204,18 @@ class ChannelHost {
   public:
     int id;
     int buff_size;
+    int segments;
 
   public:
     ChannelHost() {}
 
     void init(int id, int buff_size, ChannelDev* ch_dev,
-              void* (*thread_fun)(void*), void* args = NULL) {
+              void* (*thread_fun)(void*), void* args = NULL,
+              int segments = CHANNEL_SEGMENTS, bool zero_copy = false) {
         this->buff_size = buff_size;
         this->id = id;
+        this->segments = segments;
+        this->zero_copy = zero_copy;
         /* get device properties */
         cudaDeviceProp prop;
         int device = 0;
@@ -179,18 +233,32 @@ class ChannelHost {
             &stream, cudaStreamNonBlocking, priority_high));
 #endif
 
-        /* create doorbell */
-        CUDA_SAFECALL(
-            cudaHostAlloc((void**)&doorbell, sizeof(int), cudaHostAllocMapped));
-        /* set doorbell to zero */
-        *doorbell = 0;
+        /* create doorbells and segment generations */
+        CUDA_SAFECALL(cudaHostAlloc((void**)&doorbells,
+                                    sizeof(int) * segments,
+                                    cudaHostAllocMapped));
+        CUDA_SAFECALL(cudaHostAlloc((void**)&seg_gen,
+                                    sizeof(uint64_t) * segments,
+                                    cudaHostAllocMapped));
+        ring.init((int*)doorbells, (uint64_t*)seg_gen, segments);
+
+        /* segments written by the GPU straight into host memory */
+        uint8_t* d_buff = NULL;
+        host_buff = NULL;
+        if (zero_copy) {
+            CUDA_SAFECALL(cudaHostAlloc((void**)&host_buff,
+                                        (size_t)buff_size * segments,
+                                        cudaHostAllocMapped));
+            CUDA_SAFECALL(cudaHostGetDevicePointer((void**)&d_buff,
+                                                   (void*)host_buff, 0));
+        }
 
         /* initialize device channel */
         this->ch_dev = ch_dev;
-        ch_dev->init(id, (int*)doorbell, buff_size);
+        ch_dev->init(id, (int*)doorbells, (uint64_t*)seg_gen, buff_size,
+                     segments, d_buff);
 
         dev_buff = ch_dev->buff;
-        dev_buff_read_head = dev_buff;
         if (thread_fun != NULL) {
             thread_started = true;
             pthread_create(&thread, NULL, (void* (*)(void*))thread_fun, args);
@@ -212,25 +280,36 @@ class ChannelHost {
 #ifdef USE_ASYNC_STREAM
             CUDA_SAFECALL(cudaStreamDestroy(stream));
 #endif
-            CUDA_SAFECALL(cudaFree((int*)doorbell));
-            CUDA_SAFECALL(cudaFree(ch_dev->buff));
+            CUDA_SAFECALL(cudaFreeHost((int*)doorbells));
+            CUDA_SAFECALL(cudaFreeHost((uint64_t*)seg_gen));
+            if (zero_copy) {
+                CUDA_SAFECALL(cudaFreeHost(host_buff));
+            } else {
+                CUDA_SAFECALL(cudaFree(ch_dev->buff));
+            }
+            CUDA_SAFECALL(cudaFree(ch_dev->committed));
+            CUDA_SAFECALL(cudaFree(ch_dev->open_gen));
         }
     }
 
     bool is_active() { return thread_started; }
 
+    /* Receive (part of) the next segment in order, 0 if it is not ready */
     uint32_t recv(void* buff, uint32_t max_buff_size) {
         assert(max_buff_size > 0);
-        assert(doorbell != NULL);
-        uint32_t buff_nbytes = *doorbell;
-        if (buff_nbytes == 0) {
+        assert(!zero_copy);
+        int seg;
+        uint32_t left = ring.pending(seg);
+        if (left == 0) {
             return 0;
         }
-        int nbytes = buff_nbytes;
+        uint32_t nbytes = left;
 
-        if (buff_nbytes > max_buff_size) {
+        if (nbytes > max_buff_size) {
             nbytes = max_buff_size;
         }
+        uint8_t* dev_buff_read_head =
+            dev_buff + (uint64_t)seg * buff_size + (doorbells[seg] - left);
 #ifdef USE_ASYNC_STREAM
         CUDA_SAFECALL(cudaMemcpyAsync(buff, dev_buff_read_head, nbytes,
                                       cudaMemcpyDeviceToHost, stream));
@@ -238,20 +317,28 @@ class ChannelHost {
 #else
         memcpy(buff, dev_buff_read_head, nbytes);
 #endif
-        int bytes_left = buff_nbytes - nbytes;
-        assert(bytes_left >= 0);
-        if (bytes_left > 0) {
-            dev_buff_read_head += nbytes;
-        } else {
-            dev_buff_read_head = dev_buff;
-        }
-
-        *doorbell = bytes_left;
+        ring.consume(nbytes);
         // printf("HOST RECEIVED nbytes %d - bytes left %d\n", nbytes,
-        // bytes_left);
+        // left - nbytes);
         return nbytes;
     }
 
+    /* Zero-copy: next segment in order, NULL if it is not ready. The segment
+     * belongs to the caller until release(seg) */
+    uint8_t* recv_segment(uint32_t& nbytes, int& seg) {
+        assert(zero_copy);
+        nbytes = ring.pending(seg);
+        if (nbytes == 0) {
+            return NULL;
+        }
+        ring.hold();
+        return host_buff + (uint64_t)seg * buff_size;
+    }
+
+    void release(int seg) { ring.release(seg); }
+
+    bool is_zero_copy() { return zero_copy; }
+
     pthread_t get_thread() { return thread; }
 
     friend class MultiChannelHost;
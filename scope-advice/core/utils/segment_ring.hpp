@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+/* Host side bookkeeping of the channel segments (see ChannelDev). It only
+ * touches the doorbell and generation words, so it is free of CUDA calls and
+ * can be driven from plain threads.
+ *
+ * Segments are received in order. A segment is either drained by copies
+ * (consume) and released as soon as it is empty, or handed out as a whole
+ * (hold) and released later by whoever processed it, possibly out of order.
+ * A held segment is never received again before its release. */
+class SegmentRing {
+  private:
+    volatile int* doorbells;
+    volatile uint64_t* seg_gen;
+    std::atomic<bool>* held;
+    int segments;
+
+    /* segment being received and bytes of it already copied out */
+    int read_seg;
+    uint32_t read_off;
+
+    void advance() {
+        read_seg = (read_seg + 1) % segments;
+        read_off = 0;
+    }
+
+  public:
+    SegmentRing() {}
+
+    void init(int* h_doorbells, uint64_t* h_seg_gen, int segments) {
+        this->doorbells = h_doorbells;
+        this->seg_gen = h_seg_gen;
+        this->segments = segments;
+        held = new std::atomic<bool>[segments];
+        /* set doorbells to zero, segment k starts at generation k */
+        for (int s = 0; s < segments; s++) {
+            doorbells[s] = 0;
+            seg_gen[s] = s;
+            held[s].store(false);
+        }
+        read_seg = 0;
+        read_off = 0;
+    }
+
+    /* Bytes not yet received from the next segment, 0 if it is not ready */
+    uint32_t pending(int& seg) {
+        seg = read_seg;
+        if (held[seg].load()) {
+            return 0;
+        }
+        uint32_t nbytes = doorbells[seg];
+        return nbytes == 0 ? 0 : nbytes - read_off;
+    }
+
+    /* 'nbytes' of the current segment were copied out */
+    void consume(uint32_t nbytes) {
+        read_off += nbytes;
+        if (read_off == (uint32_t)doorbells[read_seg]) {
+            release(read_seg);
+            advance();
+        }
+    }
+
+    /* Current segment is handed out as is, until release(seg) */
+    void hold() {
+        held[read_seg].store(true);
+        advance();
+    }
+
+    /* Hand segment over to its next generation. Doorbell is cleared before
+     * the segment stops being held, so it is not seen twice. */
+    void release(int seg) {
+        doorbells[seg] = 0;
+        held[seg].store(false);
+        __sync_synchronize();
+        seg_gen[seg] += segments;
+    }
+};
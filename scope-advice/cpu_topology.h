@@ -0,0 +1,232 @@
+#ifndef CPU_TOPOLOGY_H
+#define CPU_TOPOLOGY_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+/* Placement of the analysis pool on the host. The pool is sized from the CPUs
+ * the process may run on (affinity mask) and from the CPU quota of its cgroup.
+ * Workers are spread over the NUMA nodes in proportion to the CPUs we hold on
+ * each, and bound to the CPUs of their node. Memory a worker allocates and
+ * touches first lands on its node; buffers filled by another thread are given
+ * a preferred node with mbind, called directly so that no libnuma is needed.
+ *
+ * Large tables come from anonymous mappings aligned to a huge page, advised
+ * for transparent huge pages. Without NUMA information in sysfs everything
+ * falls back to a single node. */
+
+#define MAX_NODES 8
+#define HUGE_PAGE_SIZE (2l << 20)
+
+typedef struct _topology_t {
+    /* nodes with CPUs we may run on, and their sysfs ids */
+    int nodes;
+    int id[MAX_NODES];
+    std::vector<int> cpus[MAX_NODES];
+    /* CPUs granted by the cgroup quota, 0 if unlimited */
+    int quota;
+} topology_t;
+
+/* Back large tables with huge pages, see huge_alloc */
+static bool huge_pages = true;
+
+/* Add the CPUs of a sysfs list such as "0-15,32-47" to 'set' */
+static void parse_cpulist(const char *list, cpu_set_t *set) {
+    const char *s = list;
+    while (*s != '\0' && *s != '\n') {
+        char *end;
+        long first = strtol(s, &end, 10), last = first;
+        if (end == s)
+            return;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        for (long c = first; c <= last && c < CPU_SETSIZE; c++)
+            CPU_SET(c, set);
+        s = *end == ',' ? end + 1 : end;
+    }
+}
+
+/* CPUs granted by the CPU quota of the cgroup (v2 or v1), 0 if unlimited */
+static int cgroup_quota() {
+    long quota = -1, period = 0;
+    FILE *f = fopen("/sys/fs/cgroup/cpu.max", "r");
+    if (f != NULL) {
+        char max[32];
+        if (fscanf(f, "%31s %ld", max, &period) == 2 && max[0] != 'm')
+            quota = atol(max);
+        fclose(f);
+    } else if ((f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) != NULL) {
+        if (fscanf(f, "%ld", &quota) != 1)
+            quota = -1;
+        fclose(f);
+        if ((f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")) != NULL) {
+            if (fscanf(f, "%ld", &period) != 1)
+                period = 0;
+            fclose(f);
+        }
+    }
+    if (quota <= 0 || period <= 0)
+        return 0;
+    return (int)((quota + period - 1) / period);
+}
+
+static void topo_init(topology_t *topo) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        for (long c = 0; c < online && c < CPU_SETSIZE; c++)
+            CPU_SET(c, &allowed);
+    }
+    topo->nodes = 0;
+    cpu_set_t seen;
+    CPU_ZERO(&seen);
+    /* node ids may have holes */
+    for (int n = 0; n < 64 && topo->nodes < MAX_NODES; n++) {
+        char path[64], list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+        FILE *f = fopen(path, "r");
+        if (f == NULL)
+            continue;
+        cpu_set_t node;
+        CPU_ZERO(&node);
+        if (fgets(list, sizeof(list), f) != NULL)
+            parse_cpulist(list, &node);
+        fclose(f);
+        std::vector<int> &cpus = topo->cpus[topo->nodes];
+        cpus.clear();
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &node) && CPU_ISSET(c, &allowed) && !CPU_ISSET(c, &seen)) {
+                cpus.push_back(c);
+                CPU_SET(c, &seen);
+            }
+        }
+        if (!cpus.empty())
+            topo->id[topo->nodes++] = n;
+    }
+    /* no NUMA information (or more nodes than MAX_NODES): the rest is one more node */
+    std::vector<int> rest;
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (CPU_ISSET(c, &allowed) && !CPU_ISSET(c, &seen))
+            rest.push_back(c);
+    }
+    if (!rest.empty()) {
+        if (topo->nodes < MAX_NODES) {
+            topo->id[topo->nodes] = topo->nodes == 0 ? 0 : -1;
+            topo->cpus[topo->nodes++].clear();
+        }
+        std::vector<int> &cpus = topo->cpus[topo->nodes - 1];
+        cpus.insert(cpus.end(), rest.begin(), rest.end());
+    }
+    topo->quota = cgroup_quota();
+}
+
+static int topo_cpus(topology_t *topo) {
+    int total = 0;
+    for (int n = 0; n < topo->nodes; n++)
+        total += topo->cpus[n].size();
+    return total;
+}
+
+/* Workers for the CPUs we may use, one of them left to the distributor which polls the channel */
+static int topo_pool_size(topology_t *topo, int max_workers) {
+    int cpus = topo_cpus(topo);
+    if (topo->quota > 0 && topo->quota < cpus)
+        cpus = topo->quota;
+    int workers = cpus - 1;
+    if (workers < 1)
+        workers = 1;
+    return workers < max_workers ? workers : max_workers;
+}
+
+/* Node of each of the 'workers' workers, nodes taking turns so that a pool
+   smaller than the host is spread over all of them in proportion to their CPUs */
+static void topo_assign(topology_t *topo, int workers, int *node_of) {
+    if (topo->nodes == 0) {
+        for (int w = 0; w < workers; w++)
+            node_of[w] = 0;
+        return;
+    }
+    int w = 0;
+    for (size_t i = 0; w < workers; i++) {
+        bool any = false;
+        for (int n = 0; n < topo->nodes && w < workers; n++) {
+            if (i < topo->cpus[n].size()) {
+                node_of[w++] = n;
+                any = true;
+            }
+        }
+        /* more workers than CPUs, start over */
+        if (!any)
+            i = (size_t)-1;
+    }
+}
+
+static void topo_node_set(topology_t *topo, int node, cpu_set_t *set) {
+    CPU_ZERO(set);
+    for (int c: topo->cpus[node])
+        CPU_SET(c, set);
+}
+
+/* Bind 'thread' to the CPUs of 'node' */
+static bool topo_bind(topology_t *topo, int node, pthread_t thread) {
+    cpu_set_t set;
+    topo_node_set(topo, node, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+/* Prefer 'node' for the pages of [ptr, ptr + bytes) not touched yet. 'ptr' must
+   come from huge_alloc with at least HUGE_PAGE_SIZE bytes */
+static bool topo_place(topology_t *topo, int node, void *ptr, size_t bytes) {
+#ifdef SYS_mbind
+    if (topo->nodes < 2 || topo->id[node] < 0 || topo->id[node] >= 64)
+        return false;
+    /* MPOL_PREFERRED, falls back to other nodes when this one is full */
+    unsigned long mask = 1ul << topo->id[node];
+    return syscall(SYS_mbind, ptr, bytes, 1, &mask, 8 * sizeof(mask) + 1, 0) == 0;
+#else
+    return false;
+#endif
+}
+
+/* Zeroed memory. From 'HUGE_PAGE_SIZE' on it is a mapping aligned to a huge page,
+   advised for them unless huge_pages is off, to be released with huge_free and the same size */
+static void *huge_alloc(size_t bytes) {
+    if (bytes < HUGE_PAGE_SIZE)
+        return calloc(1, bytes);
+    size_t len = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    /* map one huge page more, and trim to an aligned range */
+    char *raw = (char *)mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        return NULL;
+    char *aligned = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    if (aligned > raw)
+        munmap(raw, aligned - raw);
+    if (aligned + len < raw + len + HUGE_PAGE_SIZE)
+        munmap(aligned + len, raw + len + HUGE_PAGE_SIZE - (aligned + len));
+#ifdef MADV_HUGEPAGE
+    if (huge_pages)
+        madvise(aligned, len, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+
+static void huge_free(void *ptr, size_t bytes) {
+    if (ptr == NULL)
+        return;
+    if (bytes < HUGE_PAGE_SIZE) {
+        free(ptr);
+        return;
+    }
+    munmap(ptr, (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+}
+
+#endif /* CPU_TOPOLOGY_H */
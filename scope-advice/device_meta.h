@@ -0,0 +1,175 @@
+#ifndef DEVICE_META_H
+#define DEVICE_META_H
+
+#include <stdint.h>
+
+/* Updates of the in-GPU metadata of a granule. They only touch the values
+ * handed to them, and are host-callable, so the warp-cooperative update done
+ * by instrument_mem can be emulated on the CPU (see emulate_match_any).
+ *
+ * Warp-cooperative update: lanes of a warp that access the same granule form a
+ * group (match-any on the granule). Lanes of one call share the instruction's
+ * op_mask and epoch, belong to the same block, and have consecutive thread ids.
+ * Hence the lowest lane of a group replays the update of every lane of the
+ * group in lane order (merge_group), which is what the lanes would have done
+ * one after the other. Lanes whose trace did not fit in stream_meta get their
+ * bit in the returned mask, and send it themselves.
+ *
+ * Lock-free update: F/ST/MB/ID/CNT share one 32 bit word. The leader computes
+ * the new word from the one it read and publishes it with a single CAS,
+ * starting over from the value seen when the CAS fails. Raising CNT in the
+ * same CAS claims the stream_meta slots, which are written after the CAS
+ * succeeded; they are only read by the host once the kernel is over. */
+
+__host__ __device__ __inline__
+void set_device_metadata(uint64_t &metadata, uint32_t op_mask, uint64_t bid) {
+    uint64_t old_id = getBits(metadata, POS_ID, SZ_ID);
+    uint64_t first = getBit(metadata, POS_F);
+    /* This is the important information */
+    if (bid != old_id && first != 0) {
+        setBit(metadata, POS_MB);
+    }
+    setBit(metadata, POS_F);
+
+    uint64_t old_st = getBit(metadata, POS_ST);
+    setBit(metadata, POS_ST, old_st | (op_mask & MASK_STORE));
+
+    setBits(metadata, POS_ID, SZ_ID, bid);
+    // This metadata also houses 'count' of traces present in stream_meta.
+    // The field is updated in claim_trace method.
+}
+
+
+__host__ __device__ __inline__
+uint64_t set_host_metadata(long id, int epoch, uint32_t op_mask) {
+    uint64_t info = 0;
+    setBit(info, HPOS_LD, MASK_LOAD & op_mask);
+    setBit(info, HPOS_ST, MASK_STORE & op_mask);
+    setBits(info, HPOS_SCP, HSZ_SCP, (op_mask & SCOPE_CTA) | (op_mask & SCOPE_GPU) | (op_mask & SCOPE_SYS));
+    setBits(info, HPOS_ID, HSZ_ID, id);
+    setBits(info, HPOS_EP, HSZ_EP, epoch);
+    return info;
+}
+
+
+template <int M>
+__host__ __device__ __inline__
+bool skip_trace(uint32_t op_mask) {
+    bool skip = false;
+    if (DO_FILTER(M)) {
+        // First two bits in mask is the scope of the operation, get it!
+        int scp = (op_mask & 3);
+        /* A Load and with scope greater than equal to device is enough
+           for a volatile load and atomics with device_scope or larger */
+        if ((MASK_LOAD & op_mask) && (scp >= SCOPE_GPU))
+            skip = true;
+    }
+    return skip;
+}
+
+/*
+ * This method performs a number of operations and runs optimizations
+ * 1. Update the in-GPU metadata maintained per address (md_up)
+ * 2. Filters trace based on the type of operation (skip_trace)
+ * 3. Claims a slot of stream_meta {a.k.a. streaming access-type content}
+ * Only the value md_up is changed, so it can be retried. Returns TRACE_STREAM
+ * when the trace goes to stream_meta, TRACE_HOST when it has to be sent to host.
+ */
+typedef enum {
+    TRACE_NONE = 0,
+    TRACE_STREAM = 1,
+    TRACE_HOST = 2,
+} trace_dest_t;
+
+template <int M>
+__host__ __device__ __inline__
+trace_dest_t claim_trace(uint32_t op_mask, uint64_t &md_up, uint64_t bid, uint32_t depth) {
+    /* first set up content inside GPU aggregate metadata */
+    set_device_metadata(md_up, op_mask, bid);
+    // Do not maintain trace in stream_meta (version 1) if it does not help in detection
+    if (skip_trace<M>(op_mask))
+        return TRACE_NONE;
+    uint64_t count = getBits(md_up, POS_CNT, SZ_CNT);
+    if (DO_STREAM(M) && count < depth) {
+        /* slot 'count' is ours once md_up is published */
+        setBits(md_up, POS_CNT, SZ_CNT, count + 1);
+        return TRACE_STREAM;
+    }
+    // no place in stream_meta, send it to host!
+    return TRACE_HOST;
+}
+
+/* Update of a granule by every lane of 'peers', in lane order. Lanes that
+   claimed a stream_meta slot are set in 'stored', their slots are consecutive
+   from the count of the old md_up. The granule keeps up to 'depth' traces.
+   Returns the lanes whose trace has to be sent to the host */
+template <int M>
+__host__ __device__ __inline__
+unsigned merge_group(unsigned peers, uint32_t op_mask, uint64_t &md_up, uint64_t bid, uint32_t depth,
+                     unsigned &stored) {
+    unsigned overflow = 0;
+    stored = 0;
+    for (int lane = 0; lane < WARP_SIZE; lane++) {
+        if (!(peers & (1u << lane)))
+            continue;
+        trace_dest_t dest = claim_trace<M>(op_mask, md_up, bid, depth);
+        if (dest == TRACE_STREAM)
+            stored |= 1u << lane;
+        else if (dest == TRACE_HOST)
+            overflow |= 1u << lane;
+    }
+    return overflow;
+}
+
+/* Write the traces of the 'stored' lanes, from slot 'first' on. Lane 'leader'
+   has thread id 'tid'. Slots were claimed by publishing the metadata, so no
+   one else writes them */
+__host__ __device__ __inline__
+void store_traces(dev_args *dev, uint64_t offset, unsigned stored, uint64_t first, int leader, uint64_t tid,
+                  int epoch, uint32_t op_mask) {
+    uint32_t *stream_meta = dev->stream_meta + offset * dev->stream_depth;
+    uint64_t slot = first;
+    for (int lane = 0; lane < WARP_SIZE; lane++) {
+        if (!(stored & (1u << lane)))
+            continue;
+        // prepare the trace that needs recording
+        stream_meta[slot] = set_host_metadata(tid + lane - leader, epoch, op_mask);
+        slot++;
+    }
+}
+
+/* The update from old_md to new_md made the granule both multi-block and stored. Updates of
+   a granule are totally ordered by the CAS, so exactly one of them does */
+__host__ __device__ __inline__
+bool became_candidate(uint64_t old_md, uint64_t new_md) {
+    return !(getBit(old_md, POS_MB) && getBit(old_md, POS_ST)) && getBit(new_md, POS_MB) && getBit(new_md, POS_ST);
+}
+
+/* Shadow granule of application granule 'granule', NO_SHADOW if it is not tracked.
+   Binary search over the 'count' sorted ranges */
+__host__ __device__ __inline__
+uint64_t shadow_lookup(const shadow_range_t *ranges, uint32_t count, uint64_t granule) {
+    uint32_t lo = 0, hi = count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (ranges[mid].bound <= granule)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == count || granule < ranges[lo].base)
+        return NO_SHADOW;
+    return ranges[lo].shadow + (granule - ranges[lo].base);
+}
+
+/* CPU stand-in for __match_any_sync: lanes of 'active' whose key equals the one of 'lane' */
+static inline unsigned emulate_match_any(unsigned active, const uint64_t *keys, int lane) {
+    unsigned peers = 0;
+    for (int other = 0; other < WARP_SIZE; other++) {
+        if ((active & (1u << other)) && keys[other] == keys[lane])
+            peers |= 1u << other;
+    }
+    return peers;
+}
+
+#endif /* DEVICE_META_H */
@@ -1,16 +1,8 @@
-#include "common.h"
+#include "host_pipeline.h"
+#include "capture.h"
 #include "opcode_sm70.h"
 #include <sstream>
 
-/* Used to keep track of 
-   blockDim: Number of threads within a threadblock
-   gridDim: Number of threads within a grid, i.e., all threadblocks */
-typedef struct {
-    int warpsInGrid;
-    int warpsPerBlock;
-    int blockDim;
-    long gridDim;
-} dimension_t;
 
 uint32_t isRed(Instr *inst) {
     return (strstr(inst->getOpcode(), OP_RED) != NULL);
@@ -77,56 +69,24 @@ void print_fence(fence_t *st) {
     std::cout << st->id << "," << st->fence_id << "," << std::hex << st->mask << std::endl;
 }
 
-/* Structures and includes used in main program */
-#include <atomic>
-#include <thread>
-#include <time.h>
-#include <unordered_map>
-#include <unordered_set>
-/* channel size for maintaining cpu-gpu communication */
-#define CHANNEL_SIZE (2l << 20)
-#define JOB_NONE -1
-#define JOB_BEGIN 1
+/* Structures used by the tool, around the host analysis of host_pipeline.h */
 
-/* Parallel processing of incoming data by multiple processes and buffers */
-#if DO_PARALLEL
-#define NUM_BUFFERS 768
-#define NUM_THREADS 12
-#else
-#define NUM_BUFFERS 1
-#define NUM_THREADS 1
-#endif
+/* Execution sampling, see skip_instrumentation */
+int sample_policy = SAMPLE_HASH;
+int sample_period = SAMPLE_PERIOD;
+long sample_seed = 0;
 
-/* Job structure for distributing among workers */
-typedef struct _job_info_t {
-    uint32_t job_amount;
-    char *buffer;
-} job_info_t;
-/* creating list of buffers to maintain information */
-volatile job_info_t jobs[NUM_BUFFERS];
-char dummy_buffer[CHANNEL_SIZE];
-
-/* Spinlocks for job processing */
-pthread_mutex_t job_lock, free_lock, async_lock;
-/* two queue for maintaining free and occupied buffers */
-std::vector<int> job_queue, free_queue;
+/* Segments of the channel in zero-copy mode, each one can be held by a worker */
+#define ZERO_COPY_SEGMENTS (2 * num_threads)
 
-/* create thread argument struct for thr_func() */
-typedef struct _thread_data_t {
-  int tid;
-} thread_data_t;
-/* Global information of threads */
-pthread_t thr[NUM_THREADS];
-thread_data_t thr_data[NUM_THREADS];
-
-/* synchronization among worker threads and async_task for jobs */
-pthread_barrier_t barrier;
-std::atomic<int> last_job(0);
+/* receives the messages of launches that are not traced */
+char dummy_buffer[CHANNEL_SIZE];
+/* slots of registered launches, in launch order, for the distributor */
+job_ring_t launch_ring;
 
 /* receiving thread and its control variables */
-pthread_t recv_thread, async_task;
+pthread_t recv_thread;
 volatile bool recv_thread_started = false;
-volatile bool recv_thread_receiving = false;
 static __managed__ ChannelDev channel_dev;
 static ChannelHost channel_host;
 cudaStream_t stream;
@@ -136,130 +96,101 @@ uint32_t static_counter = 0;
 /* global control variables for this tool */
 uint32_t instr_begin_interval = 0;
 uint32_t instr_end_interval = UINT32_MAX;
-int verbose = 0;
 int timeout = 0;
 int check_its = 0;
 int debug_out = 1;
+int zero_copy = 0;
 std::string kernel_id = "";
+/* JSON file the stats are written to at exit, see writeStats */
+std::string stats_path = "";
 /* skip flag used to avoid re-entry on the nvbit_callback when issuing flush_channel kernel call */
 bool skip_flag = false;
 
-/* when a single kernel is invoked multiple times trace only 1 instance */
+/* when a single kernel is invoked multiple times trace only 1 instance (0 = all) */
 int kernel_instances = 0;
 int instance = 1;
 
 /* Things for scope-recommender trace gen */
-int epoch = 0, message_passes = 0;
-
-/* Cleaner task data and related defines */
-#define UNIQ_THRESHOLD 20000
-std::unordered_set<uint64_t> cleaner_queue;
-
-uint64_t host_metadata_len;
-/* Keeping track of memory accesses and fences by threads, information maintained per address */
-std::atomic<uint64_t> *access_map;
-
-/* Keeping track of fence-related information */
-std::unordered_map<int, uint64_t> id_to_fence_map;
-std::unordered_map<uint64_t, std::string> fence_to_lineinfo_map;
-
-/* For measurement purposes, keeping track of number of transferred packets */
-std::atomic<uint64_t> m_packets;
-
-/* Kernel dimension information */
-dimension_t kernel_dimension;
+int message_passes = 0;
+/* bytes received over the channel, across all message passes */
+uint64_t channel_bytes = 0;
+
+/* Device buffers of the shadow layout (see shadow_range_t), sized for the largest launch so far */
+uint64_t shadow_capacity = 0;
+uint32_t ranges_capacity = 0;
+/* Candidate worklist holds 1 in WORKLIST_RATIO shadow granules, at least WORKLIST_MIN of them.
+   Launches queueing more are detected by scanning every granule */
+#define WORKLIST_RATIO 16
+#define WORKLIST_MIN (1l << 16)
+uint64_t worklist_capacity = 0;
 
 /* common structure for passing arguments to instrumented function */
 __managed__ dev_args device_arguments;
 
-/* Exponential backoff for accessing locks --- should improve performance? */
-#define HOST_BASE_DELAY 16
-#define HOST_MAX_DELAY 32768
-#define DO_BACKOFF 1
-void backoff(unsigned &us) {
-    if (DO_BACKOFF && us > 0) {
-        // unsigned entropy = rand() % us;
-        std::this_thread::sleep_for(std::chrono::microseconds(us));
-        us = us << 1;
-        us = max(us, HOST_MAX_DELAY);
-    }
-}
-
-uint64_t getIdx(int fence_id, uint64_t tid) {
-    /* local thread id */
-    uint64_t ltid = tid % kernel_dimension.blockDim;
-    /* local warp id */
-    uint64_t wid = ltid / WARP_SIZE;
-    /* block ID */
-    uint64_t bid = tid / kernel_dimension.blockDim;
-    /* global warp ID */
-    uint64_t idx = wid + bid * kernel_dimension.warpsPerBlock;
-    /* roundUp does a ceiling, indexing is 0-based, do a - 1 */
-    return fence_id * kernel_dimension.warpsInGrid + idx;
-}
-
-int getPrevSync(int fence_id, uint64_t tid) {
-    fence_id--;
-    uint64_t idx;
-    uint32_t bit = 1 << ((tid % kernel_dimension.blockDim) % WARP_SIZE);
-    while (fence_id >= 0) {
-        idx = getIdx(fence_id, tid);
-        if (bit & device_arguments.fence_meta[idx])
-            break;
-        else
-            fence_id--;
-    }
-    return fence_id;
-}
+/* copies are issued in chunks of this many bytes */
+#define STAGE_CHUNK (64l << 20)
 
-int getNextSync(int fence_id, uint64_t tid) {
-    /* epoch is the last epoch */
-    uint64_t idx;
-    uint32_t bit = 1 << ((tid % kernel_dimension.blockDim) % WARP_SIZE);
-    while (fence_id < epoch) {
-        idx = getIdx(fence_id, tid);
-        if (bit & device_arguments.fence_meta[idx])
-            break;
-        else
-            fence_id++;
-    }
-    // printf("[GNS] %lu for %d got %d with bit %x\n", tid, lf, fence_id, bit);
-    return fence_id;
-}
+/* traced launches are recorded here when CAPTURE names a file, see capture.h */
+capture_t capture;
 
-#include "trackers.h"
-/* a common function to process trace entries, present for each
-   address accessed on the GPU */
-void process_trace(uint64_t trace) {
-    int a_epoch = getBits(trace, HPOS_EP, HSZ_EP);
-    /* atomics are treated specially */
-    if (getBit(trace, HPOS_LD) && getBit(trace, HPOS_ST)) {
-        fence_map[a_epoch]->operations.fetch_or(ATOMIC);
-        return;
-    }
+/* kernels by function, see instrument_function_if_needed */
+std::unordered_map<CUfunction, kernel_info_t*> kernel_infos;
 
-    int tid = getBits(trace, HPOS_ID, HSZ_ID);
-    /* applying load rules */
-    if (getBit(trace, HPOS_LD)) {
-        uint64_t scp = getBits(trace, HPOS_SCP, HSZ_SCP);
-        if (!(scp == SCOPE_GPU) && !(scp == SCOPE_SYS)) {
-            a_epoch = getPrevSync(a_epoch, tid);
-            fence_map[a_epoch]->not_oversynchronized.exchange(1);
-        } else {
-            fence_map[a_epoch]->operations.fetch_or(VOLATILE_LD);
-        }
-    }
-    /* applying store rules */
-    if (getBit(trace, HPOS_ST)) {
-        a_epoch = getNextSync(a_epoch, tid);
-        fence_map[a_epoch]->operations.fetch_or(VOLATILE_ST);
-        fence_map[a_epoch]->not_oversynchronized.exchange(1);
-    }
-}
+/* launch of the kernel running, NULL if it is not traced */
+launch_t *running_launch = NULL;
 
 void printCounters() {
     printf("========== COUNTERS =============\n");
     printf("Static Instrumented Instructions: %d\n", static_counter);
+    if (DO_SAMPLING(tool_mode))
+        printf("Sampling: %s, period %d, seed %ld\n", sample_policy == SAMPLE_CTA ? "cta" : "hash", sample_period, sample_seed);
     printf("Memory packets: %lu\n", m_packets.load());
     printf("GPU-CPU message passes: %d\n", message_passes);
+    printf("Analysis pool: %d workers on %d nodes, %d buffers%s\n", num_threads, topology.nodes, num_buffers,
+        huge_pages ? ", huge pages" : "");
+    printf("Channel bytes per packet: %lf (wire format v%d)\n",
+        m_packets.load() ? (double)channel_bytes / m_packets.load() : 0.0, WIRE_VERSION);
+    printf("Traced launches: %d (%lu kernels)\n", launches_traced, kernels.size());
+    double map_bytes = 0;
+    uint64_t map_pages = 0;
+    for (int s = 0; s < LAUNCH_SLOTS; s++) {
+        map_bytes += amap_bytes(&access_maps[s]);
+        map_pages += amap_pages(&access_maps[s]);
+    }
+    printf("Host access map: %lf MB peak (%lu pages)\n", map_bytes / (1024 * 1024), map_pages);
+    if (DO_ANALYZE(tool_mode))
+        printf("Candidate granules: %lu (%d launches scanned every granule)\n", candidates_total, worklist_fallbacks);
+    if (capture.records > 0)
+        printf("Capture: %lu records, %lf MB\n", capture.records, (double)capture.bytes / (1024 * 1024));
+    printf("Allocations: %lu recorded, %lu released, %lu stale (%lu live)\n", allocation_records.allocs,
+        allocation_records.frees, allocation_records.stale, allocation_records.live.size());
+}
+
+/* Everything printed at exit, with the hot-path stats of the pool, in one JSON object.
+   The evaluation scripts read this rather than the printed output */
+void writeStats(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot write STATS_FILE %s\n", path);
+        return;
+    }
+    json_key(f, "{", "mode");
+    fprintf(f, "%d", tool_mode);
+    jsonTrackers(f, ",");
+    json_key(f, ",", "counters");
+    json_u64(f, "{", "static_instrumented", static_counter);
+    json_u64(f, ",", "memory_packets", m_packets.load());
+    json_u64(f, ",", "message_passes", message_passes);
+    json_u64(f, ",", "channel_bytes", channel_bytes);
+    json_u64(f, ",", "traced_launches", launches_traced);
+    json_u64(f, ",", "candidate_granules", candidates_total);
+    json_u64(f, ",", "worklist_fallbacks", worklist_fallbacks);
+    json_u64(f, ",", "workers", num_threads);
+    json_u64(f, ",", "buffers", num_buffers);
+    fprintf(f, "}");
+    if (DO_ANALYZE(tool_mode))
+        json_suggestions(f, ",");
+    json_pool_stats(f, ",");
+    fprintf(f, "\n}\n");
+    fclose(f);
 }
@@ -0,0 +1,1008 @@
+#ifndef HOST_PIPELINE_H
+#define HOST_PIPELINE_H
+
+/* Host side of the analysis, free of CUDA and NVBit: traced launches, ingest of
+ * the channel buffers, detection and the worker pool running both. The tool
+ * feeds it from the channel (see distributor), sa-replay from a capture file
+ * (see capture.h). Built by nvcc within the tool, and by a plain C++ compiler
+ * for the host-only binaries. */
+
+#include <atomic>
+#include <iostream>
+#include <pthread.h>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "common.h"
+#include "trace_store.h"
+#include "job_ring.h"
+#include "access_map.h"
+#include "chunk_sched.h"
+#include "cpu_topology.h"
+#include "batch_decode.h"
+#include "tool_stats.h"
+
+/* Used to keep track of 
+   blockDim: Number of threads within a threadblock
+   gridDim: Number of threads within a grid, i.e., all threadblocks */
+typedef struct {
+    int warpsInGrid;
+    int warpsPerBlock;
+    int blockDim;
+    long gridDim;
+} dimension_t;
+
+/* channel size for maintaining cpu-gpu communication */
+#define CHANNEL_SIZE (2l << 20)
+#define JOB_NONE -1
+
+/* Pipeline variant in use, a combination of MODE_* switches */
+int tool_mode = MODE_SAMPLING | MODE_STREAM | MODE_ANALYZE | MODE_PARALLEL;
+
+/* Variants used in the evaluation, SA_MODE takes one of these names or a mask of MODE_* switches */
+typedef struct {
+    const char *name;
+    int mode;
+} mode_name_t;
+const mode_name_t mode_names[] = {
+    {"naive", MODE_ANALYZE},
+    {"para", MODE_ANALYZE | MODE_PARALLEL},
+    {"para+sampling", MODE_ANALYZE | MODE_PARALLEL | MODE_SAMPLING},
+    {"scope-advice", MODE_SAMPLING | MODE_STREAM | MODE_ANALYZE | MODE_PARALLEL},
+    /* not in the evaluation: filters traces on the device, reports lose the variant */
+    {"scope-advice+filter", MODE_FILTER | MODE_SAMPLING | MODE_STREAM | MODE_ANALYZE | MODE_PARALLEL},
+    {"nvbit", 0},
+};
+
+/* Mode for an SA_MODE value, -1 if unknown */
+int parse_mode(const std::string &value) {
+    for (auto &each: mode_names) {
+        if (value == each.name)
+            return each.mode;
+    }
+    char *end;
+    long mask = strtol(value.c_str(), &end, 0);
+    if (value.empty() || *end != '\0' || mask < 0 || mask >= MODE_COUNT)
+        return -1;
+    return (int)mask;
+}
+
+/* Parallel processing of incoming data by multiple processes and buffers */
+#define MAX_BUFFERS 768
+#define MAX_THREADS 64
+/* buffers per worker when sized automatically */
+#define BUFFERS_PER_WORKER 64
+/* set at startup from the mode and the CPUs available, see topo_pool_size */
+int num_buffers = MAX_BUFFERS, num_threads = MAX_THREADS;
+
+/* NUMA nodes the workers are spread over, and node of each worker */
+topology_t topology;
+int worker_node[MAX_THREADS];
+/* hot-path counters and histograms of each worker and of the thread feeding them */
+thread_stats_t worker_stats[MAX_THREADS];
+pipeline_stats_t pipeline_stats;
+
+/* Launches in flight: one is analyzed while the next one runs */
+#define LAUNCH_SLOTS 2
+
+/* Job structure for distributing among workers
+   segment: channel segment 'buffer' points to in zero-copy mode
+   node: node 'buffer' lives on, the job goes to the workers there
+   launch: launch the packets belong to */
+typedef struct _job_info_t {
+    uint32_t job_amount;
+    char *buffer;
+    int segment;
+    int node;
+    struct _launch_t *launch;
+} job_info_t;
+/* creating list of buffers to maintain information */
+volatile job_info_t jobs[MAX_BUFFERS];
+
+/* two lock-free rings per node for maintaining free and occupied buffers. Detection
+   tasks share the job rings, values from TASK_BASE on are (slot * MAX_THREADS + part) */
+#define TASK_BASE MAX_BUFFERS
+static_assert(MAX_BUFFERS + LAUNCH_SLOTS * MAX_THREADS <= JOB_RING_SIZE, "job ring cannot hold all buffers");
+job_ring_t job_rings[MAX_NODES], free_rings[MAX_NODES];
+
+/* Next job for a worker of 'node': its own node first, then the others */
+bool pop_job(int node, int &i) {
+    if (ring_pop(&job_rings[node], i))
+        return true;
+    for (int k = 1; k < topology.nodes; k++) {
+        if (ring_pop(&job_rings[(node + k) % topology.nodes], i))
+            return true;
+    }
+    return false;
+}
+
+bool jobs_empty() {
+    for (int n = 0; n < topology.nodes; n++) {
+        if (!ring_empty(&job_rings[n]))
+            return false;
+    }
+    return true;
+}
+
+/* Wake every parked worker */
+void wake_workers() {
+    for (int n = 0; n < topology.nodes; n++)
+        ring_wake(&job_rings[n], true);
+}
+
+/* Free buffer from the nodes in turn, starting at 'next_node' so that packets are spread over
+   them. JOB_NONE if every buffer is taken */
+int take_job(int &next_node) {
+    int i = JOB_NONE;
+    for (int k = 0; i == JOB_NONE && k < topology.nodes; k++) {
+        int n = (next_node + k) % topology.nodes;
+        if (ring_pop(&free_rings[n], i))
+            next_node = n + 1;
+    }
+    if (i == JOB_NONE)
+        pipeline_stats.free_stalls++;
+    return i;
+}
+
+/* create thread argument struct for thr_func() */
+typedef struct _thread_data_t {
+  int tid;
+  int node;
+} thread_data_t;
+/* Global information of threads */
+pthread_t thr[MAX_THREADS];
+thread_data_t thr_data[MAX_THREADS];
+
+/* set once the worker pool has to leave */
+std::atomic<int> pool_done(0);
+/* gives a channel segment back once its job is handled (zero-copy), NULL if jobs own their buffer */
+void (*release_segment)(int segment) = NULL;
+
+/* control variables shared with the tool */
+int verbose = 0;
+int launches_traced = 0;
+
+/* in-GPU traces per granule */
+int stream_depth = 2;
+/* granules queued as candidates by the device, and launches that queued too many */
+uint64_t candidates_total = 0;
+int worklist_fallbacks = 0;
+/* Keeping track of memory accesses and fences by threads, information maintained per address.
+   Each non-zero entry is a granule_summary_t pointer, carved out of the arena of the inserting worker.
+   Sparse: only pages of granules that receive packets are materialized. One map per launch slot */
+access_map_t access_maps[LAUNCH_SLOTS];
+trace_arena_t trace_arenas[LAUNCH_SLOTS][MAX_THREADS];
+
+/* Keeping track of fence-related information */
+std::unordered_map<uint64_t, std::string> fence_to_lineinfo_map;
+
+/* For measurement purposes, keeping track of number of transferred packets */
+std::atomic<uint64_t> m_packets;
+
+#include "trackers.h"
+
+/* Host copies of the device metadata of an allocation, staged in bulk once the kernel is over.
+   first: first shadow granule of the allocation, count: granules in it */
+typedef struct _staged_meta_t {
+    uint64_t first, count;
+    uint32_t *memory_meta;
+    /* stream_depth traces per granule, NULL when nothing is kept on the GPU */
+    uint32_t *stream_meta;
+} staged_meta_t;
+
+/* Host index of fence_meta, built once after the kernel: for each lane of each
+   warp, one bit per epoch at which the lane executed a fence. Epochs on the
+   channel are HSZ_EP bits wide, so one word per lane covers them all, and
+   previous/next sync lookups become bit scans that never touch managed memory.
+   A kernel may still number more fences than that: lookups reaching past the
+   first EPOCH_MASK_BITS of them walk fence_meta instead */
+typedef uint64_t epoch_mask_t;
+#define EPOCH_MASK_BITS (8 * (int)sizeof(epoch_mask_t))
+static_assert((1 << HSZ_EP) <= 8 * sizeof(epoch_mask_t), "epoch mask too narrow");
+
+/* Fences of an instrumented kernel, numbered from 0 for each kernel. KERNEL_BEGIN is
+   fence -1 and KERNEL_END is fence 'epochs'. fence_map starts with the static
+   information found while instrumenting, and gathers the verdicts of every launch */
+typedef struct _kernel_info_t {
+    std::string name;
+    int epochs, launches;
+    std::unordered_map<int, fence_info*> fence_map;
+    std::unordered_map<int, uint64_t> id_to_fence_map;
+    /* set once every fence it numbered is known to be needed: further launches cannot change
+       its report, they run uninstrumented. traced_ms: kernel and detection time of traced launches */
+    std::atomic<int> resolved;
+    double traced_ms;
+} kernel_info_t;
+/* kernels in the order they were first launched */
+std::vector<kernel_info_t*> kernels;
+
+/* Detection phases of a launch, each one is split in num_threads tasks */
+#define PHASE_INGEST 0
+#define PHASE_INDEX 1
+#define PHASE_SCAN 2
+/* granules per detection chunk before splitting (candidates: DETECT_CHUNK / 16), and
+   chunks per worker the scan is split into at least, so that there is something to steal */
+#define DETECT_CHUNK 4096
+#define CHUNKS_PER_WORKER 8
+
+/* State of one traced launch, from its setup until its analysis is over.
+   refs: held by the distributor until the kernel ends, and by every queued job.
+   Analysis starts when it drops to zero. tasks: left in the current phase */
+typedef struct _launch_t {
+    int id, slot;
+    kernel_info_t *kernel;
+    int epochs;
+    dimension_t dim;
+    /* verdicts of this launch only */
+    std::unordered_map<int, fence_info*> fence_map;
+    /* shadow layout of the allocations live when the kernel was launched */
+    std::vector<shadow_range_t> ranges;
+    uint64_t shadow_len;
+    /* device buffers, freed once the metadata is staged */
+    uint32_t *fence_meta;
+    uint32_t *exec_count;
+    /* host copies of the device metadata, and the index over fence_meta. Either the
+       candidate granules only (worklist), or every granule of every range */
+    bool worklist;
+    uint64_t candidates;
+    uint64_t *staged_worklist;
+    uint32_t *staged_candidates;
+    std::vector<staged_meta_t> staged_meta;
+    /* staged copies live in memory of the slot (pinned by the tool) rather than being malloc'd */
+    bool staged_pinned;
+    /* detection scan, see chunk_sched.h */
+    std::vector<detect_chunk_t> chunks;
+    chunk_deque_t deques[MAX_THREADS];
+    uint32_t *staged_fence_meta;
+    epoch_mask_t *fence_index;
+    uint64_t fence_index_warps;
+    /* traces received for this launch, from the structures of its slot */
+    access_map_t *access_map;
+    trace_arena_t *arenas;
+    int message_passes;
+    /* instrumented kernel time of the launch */
+    double kernel_ms;
+    std::atomic<int> refs, phase, tasks, staged, done;
+    duration message, detection;
+} launch_t;
+/* launch occupying each slot, replaced once analyzed */
+launch_t *launches[LAUNCH_SLOTS];
+
+/* serializes printing and the merge of launch results */
+pthread_mutex_t report_lock;
+
+/* Exponential backoff for accessing locks --- should improve performance? */
+#define HOST_BASE_DELAY 16
+#define HOST_MAX_DELAY 32768
+#define DO_BACKOFF 1
+void backoff(unsigned &us) {
+    if (DO_BACKOFF && us > 0) {
+        // unsigned entropy = rand() % us;
+        std::this_thread::sleep_for(std::chrono::microseconds(us));
+        us = us << 1;
+        us = max(us, HOST_MAX_DELAY);
+    }
+}
+
+/* global warp ID of a thread */
+uint64_t getWarp(launch_t *l, uint64_t tid) {
+    /* local thread id */
+    uint64_t ltid = tid % l->dim.blockDim;
+    /* local warp id */
+    uint64_t wid = ltid / WARP_SIZE;
+    /* block ID */
+    uint64_t bid = tid / l->dim.blockDim;
+    return wid + bid * l->dim.warpsPerBlock;
+}
+
+uint64_t getIdx(launch_t *l, int fence_id, uint64_t tid) {
+    return fence_id * l->dim.warpsInGrid + getWarp(l, tid);
+}
+
+inline epoch_mask_t getLaneEpochs(launch_t *l, uint64_t tid) {
+    uint64_t lane = (tid % l->dim.blockDim) % WARP_SIZE;
+    return l->fence_index[getWarp(l, tid) * WARP_SIZE + lane];
+}
+
+/* Build the index for the warps of part 'tid' */
+void build_fence_index(launch_t *l, int tid) {
+    uint64_t per_thread = roundUp(l->fence_index_warps, num_threads);
+    uint64_t sw = tid * per_thread;
+    uint64_t ew = min(sw + per_thread, (uint64_t)l->dim.warpsInGrid);
+    /* trace epochs never go past the mask width, later fences are looked up in fence_meta */
+    int epochs = min(l->epochs, EPOCH_MASK_BITS);
+    for (uint64_t w = sw; w < ew; w++) {
+        epoch_mask_t *lanes = &l->fence_index[w * WARP_SIZE];
+        for (int e = 0; e < epochs; e++) {
+            uint32_t mask = l->staged_fence_meta[e * l->dim.warpsInGrid + w];
+            while (mask) {
+                int lane = __builtin_ctz(mask);
+                lanes[lane] |= (epoch_mask_t)1 << e;
+                mask &= mask - 1;
+            }
+        }
+    }
+}
+
+/* Same lookups walking staged_fence_meta one epoch at a time, as done before the index.
+   Used past the epochs the index covers, and as the reference of the host tests and sa-bench */
+int getPrevSyncLinear(launch_t *l, int fence_id, uint64_t tid) {
+    uint32_t bit = 1u << ((tid % l->dim.blockDim) % WARP_SIZE);
+    for (int e = min(fence_id, l->epochs) - 1; e >= 0; e--)
+        if (bit & l->staged_fence_meta[getIdx(l, e, tid)])
+            return e;
+    return -1;
+}
+
+int getNextSyncLinear(launch_t *l, int fence_id, uint64_t tid) {
+    uint32_t bit = 1u << ((tid % l->dim.blockDim) % WARP_SIZE);
+    while (fence_id < l->epochs && !(bit & l->staged_fence_meta[getIdx(l, fence_id, tid)]))
+        fence_id++;
+    return fence_id;
+}
+
+/* latest fence before fence_id executed by tid, -1 (KERNEL_BEGIN) if none */
+int getPrevSync(launch_t *l, int fence_id, uint64_t tid) {
+    if (fence_id <= 0)
+        return -1;
+    /* fences past the index, kernels with more than EPOCH_MASK_BITS of them only */
+    if (fence_id > EPOCH_MASK_BITS && l->epochs > EPOCH_MASK_BITS) {
+        uint32_t bit = 1u << ((tid % l->dim.blockDim) % WARP_SIZE);
+        for (int e = min(fence_id, l->epochs) - 1; e >= EPOCH_MASK_BITS; e--)
+            if (bit & l->staged_fence_meta[getIdx(l, e, tid)])
+                return e;
+    }
+    epoch_mask_t before = getLaneEpochs(l, tid);
+    if (fence_id < EPOCH_MASK_BITS)
+        before &= ((epoch_mask_t)1 << fence_id) - 1;
+    if (!before)
+        return -1;
+    return 63 - __builtin_clzll(before);
+}
+
+/* first fence from fence_id onwards executed by tid, epoch (KERNEL_END) if none */
+int getNextSync(launch_t *l, int fence_id, uint64_t tid) {
+    /* epochs is the last epoch */
+    if (fence_id >= l->epochs)
+        return fence_id;
+    if (fence_id < EPOCH_MASK_BITS) {
+        epoch_mask_t after = getLaneEpochs(l, tid) & ~(((epoch_mask_t)1 << fence_id) - 1);
+        if (after)
+            return __builtin_ctzll(after);
+        if (l->epochs <= EPOCH_MASK_BITS)
+            return l->epochs;
+        fence_id = EPOCH_MASK_BITS;
+    }
+    /* the next fence is past the index */
+    return getNextSyncLinear(l, fence_id, tid);
+}
+
+static_assert(HSZ_EP <= SUMMARY_EPOCH_BITS && HSZ_ID <= SUMMARY_ID_BITS, "trace fields do not fit a summary key");
+
+/* Class of a trace (TRACE_*), -1 if detection has nothing to do with it */
+inline int trace_class(uint64_t trace) {
+    bool ld = getBit(trace, HPOS_LD), st = getBit(trace, HPOS_ST);
+    /* atomics are treated specially */
+    if (ld && st)
+        return TRACE_ATOMIC;
+    if (ld) {
+        uint64_t scp = getBits(trace, HPOS_SCP, HSZ_SCP);
+        return (scp == SCOPE_GPU || scp == SCOPE_SYS) ? TRACE_STRONG_LD : TRACE_WEAK_LD;
+    }
+    return st ? TRACE_STORE : -1;
+}
+
+/* Apply the rule of class 'cls' to an access at a_epoch by thread tid */
+void apply_rule(launch_t *l, int cls, int a_epoch, uint64_t tid) {
+    std::unordered_map<int, fence_info*> &fence_map = l->fence_map;
+    switch (cls) {
+        case TRACE_ATOMIC:
+            fence_map[a_epoch]->operations.fetch_or(ATOMIC);
+            break;
+        /* applying load rules */
+        case TRACE_STRONG_LD:
+            fence_map[a_epoch]->operations.fetch_or(VOLATILE_LD);
+            break;
+        case TRACE_WEAK_LD:
+            a_epoch = getPrevSync(l, a_epoch, tid);
+            fence_map[a_epoch]->not_oversynchronized.exchange(1);
+            break;
+        /* applying store rules */
+        case TRACE_STORE:
+            a_epoch = getNextSync(l, a_epoch, tid);
+            fence_map[a_epoch]->operations.fetch_or(VOLATILE_ST);
+            fence_map[a_epoch]->not_oversynchronized.exchange(1);
+            break;
+    }
+}
+
+/* a common function to process trace entries, present for each
+   address accessed on the GPU */
+void process_trace(launch_t *l, uint64_t trace) {
+    int cls = trace_class(trace);
+    if (cls >= 0)
+        apply_rule(l, cls, getBits(trace, HPOS_EP, HSZ_EP), getBits(trace, HPOS_ID, HSZ_ID));
+}
+
+/* Same as process_trace over the traces folded into a summary. Slots [slot_begin, slot_end)
+   only, the epoch masks go with the first part */
+void process_summary(launch_t *l, granule_summary_t *s, uint64_t slot_begin, uint64_t slot_end) {
+    if (slot_begin == 0) {
+        for (uint32_t mask = s->atomic_epochs; mask; mask &= mask - 1)
+            apply_rule(l, TRACE_ATOMIC, __builtin_ctz(mask), 0);
+        for (uint32_t mask = s->strong_epochs; mask; mask &= mask - 1)
+            apply_rule(l, TRACE_STRONG_LD, __builtin_ctz(mask), 0);
+    }
+    summary_entry_t *slots = summary_slots(s);
+    uint64_t end = min(slot_end, (uint64_t)s->capacity);
+    for (uint64_t j = slot_begin; j < end; j++) {
+        uint32_t key = slots[j].key;
+        if (key == SUMMARY_EMPTY)
+            continue;
+        int cls = key_store(key) ? TRACE_STORE : TRACE_WEAK_LD;
+        for (uint32_t lanes = slots[j].lanes; lanes; lanes &= lanes - 1)
+            apply_rule(l, cls, key_epoch(key), key_tid(key, __builtin_ctz(lanes)));
+    }
+}
+
+/* Fold 'n' traces into the summary of the granule at md_offset, taking its lock once */
+void handle_memory_batch(launch_t *l, uint64_t md_offset, packet_ref_t *packets, uint32_t n, int tid) {
+    bool done = false;
+    m_packets.fetch_add(n);
+    unsigned delay = HOST_BASE_DELAY;
+    thread_stats_t *stats = &worker_stats[tid];
+    amap_entry_t &slot = amap_slot(l->access_map, md_offset);
+    while (!done) {
+        uint64_t expected(slot.load());
+        uint64_t desired(LOCKED);
+        if (expected == desired) {
+            /* someone holds the lock --- backoff */
+            stats->lock_retries++;
+            hist_add(&stats->backoff_us, delay);
+            backoff(delay);
+            continue;
+        }
+
+        if (slot.compare_exchange_strong(expected, desired)) {
+            granule_summary_t *s;
+            /* Zero initialized, if not, meaning some address present! */
+            if (expected == 0) {
+                s = summary_create(&l->arenas[tid]);
+                stats->summaries++;
+            } else {
+                s = (granule_summary_t*)expected;
+            }
+
+            for (uint32_t j = 0; j < n; j++) {
+                uint64_t trace = packets[j].info;
+                int cls = trace_class(trace);
+                if (cls >= 0)
+                    summary_add(&l->arenas[tid], s, cls, getBits(trace, HPOS_EP, HSZ_EP), getBits(trace, HPOS_ID, HSZ_ID));
+            }
+            expected = (uint64_t)s;
+            /* Atomically write to it! */
+            slot.exchange(expected);
+            hist_add(&stats->fold_batch, n);
+            done = true;
+        } else {
+            /* someone got the lock --- backoff */
+            stats->lock_retries++;
+            hist_add(&stats->backoff_us, delay);
+            backoff(delay);
+        }
+    }
+}
+
+void handle_memory_access(launch_t *l, mem_access_t *ma, int tid) {
+    packet_ref_t packet;
+    packet.md_offset = ma->addr;
+    packet.info = channel_trace(*ma);
+    handle_memory_batch(l, packet.md_offset, &packet, 1, tid);
+}
+
+/* Decode a whole buffer, group its packets by granule and hand each group over */
+void handle_buffer(launch_t *l, channel_t *chan, uint32_t num_entries, std::vector<packet_ref_t> &packets,
+                   std::vector<packet_ref_t> &tmp, int tid) {
+    uint32_t n = decode_buffer(chan, num_entries, packets.data());
+    radix_sort_packets(packets.data(), tmp.data(), n, radix_passes(l->shadow_len));
+
+    uint32_t start = 0;
+    while (start < n) {
+        uint32_t end = start + 1;
+        while (end < n && packets[end].md_offset == packets[start].md_offset)
+            end++;
+        handle_memory_batch(l, packets[start].md_offset, &packets[start], end - start, tid);
+        start = end;
+    }
+}
+
+/* All conditions have to be met for this to work:
+   1. If multi_block
+   2. If there are stores
+   3. If there are weak operations, or cta scoped operations
+If yes to all questions, all relevant epochs in access_map have to be utilized.
+    for store epochs, next one is useful, aka, release operation
+    for load epochs, previous one is useful, aka, acquire operation. */
+template <int M>
+void process_granule(launch_t *l, uint64_t i, uint64_t md, uint32_t *stream, uint64_t trace_begin, uint64_t trace_end) {
+    if (!(getBit(md, POS_MB) && getBit(md, POS_ST)))
+        return;
+    if (DO_STREAM(M) && trace_begin == 0 && stream != NULL) {
+        /* get content from stream_meta */
+        uint64_t count = getBits(md, POS_CNT, SZ_CNT);
+        for (uint64_t j = 0; j < count && j < (uint64_t)stream_depth; j++)
+            process_trace(l, stream[j]);
+    }
+    /* Traverse the summary! Only slots [trace_begin, trace_end) of it when the granule is split */
+    uint64_t possible_summary = amap_peek(l->access_map, i);
+    if (possible_summary != 0)
+        process_summary(l, (granule_summary_t*)possible_summary, trace_begin, trace_end);
+}
+
+/* Words per compacted candidate: its memory_meta word, then its stream traces */
+int candidate_words() {
+    return 1 + (DO_STREAM(tool_mode) ? stream_depth : 0);
+}
+
+/* Shadow granule, metadata word and stream traces (NULL if none) of unit 'u' of a chunk */
+void chunk_unit(launch_t *l, const detect_chunk_t &c, uint64_t u, uint64_t &i, uint64_t &md, uint32_t *&stream) {
+    if (c.range < 0) {
+        uint32_t *record = l->staged_candidates + u * candidate_words();
+        i = l->staged_worklist[u];
+        md = record[0];
+        stream = record + 1;
+    } else {
+        staged_meta_t &staged = l->staged_meta[c.range];
+        i = staged.first + u;
+        md = staged.memory_meta[u];
+        stream = staged.stream_meta ? staged.stream_meta + u * stream_depth : NULL;
+    }
+}
+
+/* Traces detection would go through for unit 'u' of a chunk, summary slots for the host side */
+uint64_t unit_traces(launch_t *l, const detect_chunk_t &c, uint64_t u) {
+    uint64_t i, md;
+    uint32_t *stream;
+    chunk_unit(l, c, u, i, md, stream);
+    if (!(getBit(md, POS_MB) && getBit(md, POS_ST)))
+        return 0;
+    uint64_t traces = getBits(md, POS_CNT, SZ_CNT);
+    uint64_t possible_summary = amap_peek(l->access_map, i);
+    if (possible_summary != 0)
+        traces += ((granule_summary_t*)possible_summary)->capacity;
+    return traces;
+}
+
+/* Cost of a unit: reading its metadata, and its traces if it is a candidate */
+uint64_t unit_cost(launch_t *l, const detect_chunk_t &c, uint64_t u) {
+    return 1 + 16 * unit_traces(l, c, u);
+}
+
+/* Fixed-size chunks over every staged range, or over the candidate worklist */
+void build_chunks(launch_t *l) {
+    l->chunks.clear();
+    if (l->worklist) {
+        for (uint64_t u = 0; u < l->candidates; u += DETECT_CHUNK / 16)
+            l->chunks.push_back(make_chunk(-1, u, min((uint64_t)DETECT_CHUNK / 16, l->candidates - u)));
+        return;
+    }
+    for (size_t r = 0; r < l->staged_meta.size(); r++) {
+        uint64_t count = l->staged_meta[r].count;
+        for (uint64_t u = 0; u < count; u += DETECT_CHUNK)
+            l->chunks.push_back(make_chunk(r, u, min((uint64_t)DETECT_CHUNK, count - u)));
+    }
+}
+
+/* Cost of the chunks of one part, estimated along with the fence index */
+void estimate_chunks(launch_t *l, int part) {
+    for (size_t c = part; c < l->chunks.size(); c += num_threads) {
+        detect_chunk_t &chunk = l->chunks[c];
+        chunk.cost = 0;
+        for (uint64_t u = chunk.first; u < chunk.first + chunk.count; u++)
+            chunk.cost += unit_cost(l, chunk, u);
+    }
+}
+
+/* Split the heavy chunks and share the chunks among the workers */
+void plan_chunks(launch_t *l) {
+    uint64_t total = 0;
+    for (auto &each: l->chunks)
+        total += each.cost;
+    uint64_t target = max((uint64_t)DETECT_CHUNK, total / (num_threads * CHUNKS_PER_WORKER));
+    sched_split(l->chunks, target,
+        [l](const detect_chunk_t &c, uint64_t u) { return unit_cost(l, c, u); },
+        [l](const detect_chunk_t &c, uint64_t u) { return unit_traces(l, c, u); });
+    sched_assign(l->deques, num_threads, l->chunks);
+}
+
+/* Scan part: chunks of its own share first, then stolen ones */
+template <int M>
+void scan_chunks(launch_t *l, int part) {
+    if (!DO_ANALYZE(M))
+        return;
+    uint32_t c;
+    while (sched_next(l->deques, num_threads, part, c)) {
+        detect_chunk_t &chunk = l->chunks[c];
+        for (uint64_t u = chunk.first; u < chunk.first + chunk.count; u++) {
+            uint64_t i, md;
+            uint32_t *stream;
+            chunk_unit(l, chunk, u, i, md, stream);
+            process_granule<M>(l, i, md, stream, chunk.trace_begin, chunk.trace_end);
+        }
+    }
+}
+
+/* Fold the verdicts of a launch into its kernel, a fence stays over-synchronized only
+   if no launch of the kernel needed it. Then free the host state of the slot */
+void finish_launch(launch_t *l) {
+    l->detection.end();
+    pthread_mutex_lock(&report_lock);
+    for (auto &each: l->fence_map) {
+        fence_info *merged = l->kernel->fence_map[each.first];
+        merged->not_oversynchronized.fetch_or(each.second->not_oversynchronized.load());
+        merged->operations.fetch_or(each.second->operations.load());
+    }
+    l->kernel->launches += 1;
+    l->kernel->traced_ms += l->kernel_ms + l->detection.getMillis();
+    /* fences only ever go from over-synchronized to needed, once all of them are needed the report is final */
+    bool resolved = true;
+    for (auto &each: l->kernel->id_to_fence_map)
+        resolved = resolved && l->kernel->fence_map[each.first]->not_oversynchronized.load();
+    if (resolved)
+        l->kernel->resolved.store(1);
+    if (l->message_passes > 0)
+        message.milli += (double)std::chrono::duration_cast<std::chrono::microseconds>(l->detection.begin - l->message.begin).count() / 1000;
+    detection.milli += l->detection.getMillis();
+    pipeline.end();
+    pthread_mutex_unlock(&report_lock);
+
+    amap_reset(l->access_map);
+    for (int i = 0; i < num_threads; i++)
+        arena_release(&l->arenas[i]);
+    if (!l->staged_pinned) {
+        for (auto &each: l->staged_meta) {
+            free(each.memory_meta);
+            free(each.stream_meta);
+        }
+        free(l->staged_fence_meta);
+        free(l->staged_worklist);
+        free(l->staged_candidates);
+    }
+    l->staged_meta.clear();
+    free(l->fence_index);
+    /* slot can now be taken by a new launch */
+    l->done.store(1);
+}
+
+/* Queue the num_threads tasks of a detection phase */
+void push_tasks(launch_t *l, int phase) {
+    l->tasks.store(num_threads);
+    l->phase.store(phase);
+    /* part i goes to the node of worker i, any worker may still steal it */
+    for (int part = 0; part < num_threads; part++)
+        ring_push(&job_rings[worker_node[part]], TASK_BASE + l->slot * MAX_THREADS + part);
+    wake_workers();
+}
+
+/* Every packet of the launch is in, and its metadata is staged */
+void start_detection(launch_t *l) {
+    l->detection.start();
+    /* the kernel got resolved meanwhile, nothing this launch finds can change its report.
+       Nothing staged: it was resolved by the end of the kernel already */
+    if (!DO_ANALYZE(tool_mode) || l->kernel->resolved.load() || l->staged_fence_meta == NULL) {
+        finish_launch(l);
+        return;
+    }
+    build_chunks(l);
+    push_tasks(l, PHASE_INDEX);
+}
+
+/* Drop a reference to the launch, the last one starts its analysis */
+void launch_put(launch_t *l) {
+    if (l->refs.fetch_sub(1) == 1)
+        start_detection(l);
+}
+
+/* Hand buffer 'i', holding 'bytes' of packets of 'l', to the workers of its node */
+void queue_job(int i, launch_t *l, uint32_t bytes) {
+    if (l->message_passes++ == 0)
+        l->message.start();
+    uint64_t depth = 0;
+    for (int n = 0; n < topology.nodes; n++)
+        depth += ring_depth(&job_rings[n]);
+    hist_add(&pipeline_stats.pass_bytes, bytes);
+    hist_add(&pipeline_stats.queue_depth, depth);
+    series_add(&pipeline_stats.depth_series, (stats_now_ns() - pipeline_stats.origin_ns) / 1e6, depth);
+    jobs[i].job_amount = bytes;
+    jobs[i].launch = l;
+    /* the job holds the launch until handled */
+    l->refs.fetch_add(1);
+    int node = jobs[i].node;
+    ring_push(&job_rings[node], i);
+    ring_wake(&job_rings[node], false);
+}
+
+/* One part of a detection phase. Index over fence_meta and the chunk plan are needed by every
+   part of the scan, so the last part of a phase queues the next one */
+template <int M>
+void run_task(int task, int tid) {
+    launch_t *l = launches[task / MAX_THREADS];
+    int part = task % MAX_THREADS;
+    int phase = l->phase.load();
+    uint64_t begin = stats_now_ns();
+    if (phase == PHASE_INDEX) {
+        build_fence_index(l, part);
+        estimate_chunks(l, part);
+        hist_add(&worker_stats[tid].index_us, (stats_now_ns() - begin) / 1000);
+    } else {
+        scan_chunks<M>(l, part);
+        hist_add(&worker_stats[tid].scan_us, (stats_now_ns() - begin) / 1000);
+    }
+
+    if (l->tasks.fetch_sub(1) == 1) {
+        if (phase == PHASE_INDEX) {
+            plan_chunks(l);
+            push_tasks(l, PHASE_SCAN);
+        } else {
+            finish_launch(l);
+        }
+    }
+}
+
+/* Persistent worker: handles the buffers of whichever launch is running, and the
+   detection tasks of launches that are over, until the context goes away.
+   One instance per mode, see worker_modes */
+template <int M>
+void *worker(void *arg) {
+    thread_data_t *data = (thread_data_t *)arg;
+    int id = data->tid, node = data->node;
+    /* before anything is allocated, so that the worker's memory lives on its node */
+    if (!topo_bind(&topology, node, pthread_self()) && verbose)
+        fprintf(stderr, "warning: could not bind worker %d to node %d\n", id, topology.id[node]);
+
+    int jobs_handled = 0, spins = 0;
+    /* per-worker decode buffers, sized for a full channel buffer */
+    std::vector<packet_ref_t> packets(CHANNEL_SIZE / sizeof(channel_t)), tmp(CHANNEL_SIZE / sizeof(channel_t));
+    while (1) {
+
+        int i = JOB_NONE;
+        pop_job(node, i);
+
+        if (i >= TASK_BASE) {
+            run_task<M>(i - TASK_BASE, id);
+            spins = 0;
+        } else if (i != JOB_NONE) {
+            channel_t *chan = (channel_t*)jobs[i].buffer;
+            launch_t *l = jobs[i].launch;
+            /* Each worker-thread figures out their own content */
+            uint32_t num_entries = jobs[i].job_amount / sizeof(channel_t);
+            // printf("%d: Got job of size: %u (%uB)\n", id, num_entries, jobs[i].job_amount);
+            if (l->kernel->resolved.load()) {
+                /* resolved while the launch was running, drain its packets */
+                drained_packets.fetch_add(num_entries);
+            } else {
+                uint64_t begin = stats_now_ns();
+                worker_busy[id].start();
+                handle_buffer(l, chan, num_entries, packets, tmp, id);
+                worker_busy[id].end();
+                worker_packets[id] += num_entries;
+                worker_stats[id].buffers++;
+                hist_add(&worker_stats[id].buffer_us, (stats_now_ns() - begin) / 1000);
+            }
+            /* zero-copy: buffer is a channel segment, give it back to the GPU */
+            if (jobs[i].segment >= 0 && release_segment != NULL)
+                release_segment(jobs[i].segment);
+
+            /* Push back to free queue */
+            ring_push(&free_rings[jobs[i].node], i);
+            launch_put(l);
+
+            // printf("%d: %d done, waiting .... status\n", id, i);
+            jobs_handled += 1;
+            spins = 0;
+        } else if (pool_done.load()) {
+            /* context is going away, leave once the queue is drained */
+            if (jobs_empty())
+                break;
+        } else if (++spins > JOB_RING_SPINS) {
+            /* queues have been empty for a while, stop burning the core */
+            uint64_t begin = stats_now_ns();
+            ring_park(&job_rings[node], pool_done, 1);
+            worker_stats[id].parks++;
+            hist_add(&worker_stats[id].park_us, (stats_now_ns() - begin) / 1000);
+            spins = 0;
+        } else {
+            worker_stats[id].idle_spins++;
+        }
+    }
+    // printf("%d: finished %d jobs ... exiting\n", id, jobs_handled);
+    pthread_exit(NULL);
+}
+
+/* Worker instances of every mode, filled by worker_table<MODE_COUNT - 1>::fill */
+typedef void *(*worker_fn_t)(void *);
+worker_fn_t worker_modes[MODE_COUNT];
+template <int M>
+struct worker_table {
+    static void fill() {
+        worker_modes[M] = worker<M>;
+        worker_table<M - 1>::fill();
+    }
+};
+template <>
+struct worker_table<-1> {
+    static void fill() {}
+};
+
+/* New launch of kernel 'k'. Its slot is the one of the launch before last, whose analysis
+   has to be over. Dimension and shadow layout are left to the caller */
+launch_t *open_launch(kernel_info_t *k) {
+    int slot = launches_traced % LAUNCH_SLOTS;
+    launch_t *old = launches[slot];
+    if (old != NULL) {
+        while (!old->done.load())
+            std::this_thread::yield();
+        for (auto &each: old->fence_map)
+            delete each.second;
+        delete old;
+    }
+
+    launch_t *l = new launch_t();
+    l->id = launches_traced++;
+    l->slot = slot;
+    l->kernel = k;
+    l->epochs = k->epochs;
+    for (auto &each: k->fence_map)
+        l->fence_map[each.first] = new fence_info(each.first, each.second->is_redundant);
+    l->shadow_len = 0;
+    l->fence_meta = NULL;
+    l->exec_count = NULL;
+    l->staged_fence_meta = NULL;
+    l->staged_pinned = false;
+    l->worklist = false;
+    l->candidates = 0;
+    l->staged_worklist = NULL;
+    l->staged_candidates = NULL;
+    l->fence_index = NULL;
+    l->fence_index_warps = 0;
+    l->access_map = &access_maps[slot];
+    l->arenas = trace_arenas[slot];
+    l->message_passes = 0;
+    l->kernel_ms = 0;
+    /* reference of the distributor, dropped at the end of the kernel */
+    l->refs.store(1);
+    l->phase.store(PHASE_INGEST);
+    l->tasks.store(0);
+    l->staged.store(0);
+    l->done.store(0);
+    launches[slot] = l;
+    return l;
+}
+
+/* Job buffers spread over the nodes, and the num_threads workers of tool_mode. Without
+   'own_buffers' jobs point to memory of whoever fills them (zero-copy, capture file) */
+void pool_start(bool own_buffers) {
+    for (int n = 0; n < topology.nodes; n++) {
+        ring_init(&job_rings[n]);
+        ring_init(&free_rings[n]);
+    }
+    for (int i = 0; i < num_buffers; i++) {
+        jobs[i].job_amount = 0;
+        /* buffers are filled by the distributor but read by the workers of their node */
+        jobs[i].node = i % topology.nodes;
+        jobs[i].buffer = own_buffers ? (char *)huge_alloc (CHANNEL_SIZE) : NULL;
+        if (jobs[i].buffer != NULL)
+            topo_place(&topology, jobs[i].node, jobs[i].buffer, CHANNEL_SIZE);
+        jobs[i].segment = -1;
+        ring_push(&free_rings[jobs[i].node], i);
+    }
+    /* Init lock for launch results */
+    pthread_mutex_init(&report_lock, NULL);
+    for (int s = 0; s < LAUNCH_SLOTS; s++) {
+        launches[s] = NULL;
+        amap_init(&access_maps[s], 0);
+    }
+    pool_done.exchange(0);
+    pipeline_stats.origin_ns = stats_now_ns();
+    worker_table<MODE_COUNT - 1>::fill();
+    for (int i = 0; i < num_threads; ++i) {
+        thr_data[i].tid = i;
+        thr_data[i].node = worker_node[i];
+        /* Create multiple worker threads! */
+        int result = pthread_create(&thr[i], NULL, worker_modes[tool_mode], &thr_data[i]);
+        if (result)
+            fprintf(stderr, "error: pthread_create, rc: %d\n", result);
+    }
+}
+
+/* Every launch handed to the pool is analyzed */
+void pool_wait() {
+    for (int s = 0; s < LAUNCH_SLOTS; s++) {
+        while (launches[s] != NULL && !launches[s]->done.load())
+            std::this_thread::yield();
+    }
+}
+
+void pool_stop() {
+    pool_done.exchange(1);
+    wake_workers();
+    /* Wait till all worker threads are done */
+    for (int i = 0; i < num_threads; i++)
+        pthread_join(thr[i], NULL);
+}
+
+/* Print suggestions, per kernel over all its launches */
+void print_suggestions() {
+    for (auto k: kernels) {
+        printf("========== SUGGESTIONS: %s (%d launches) ==========\n", k->name.c_str(), k->launches);
+        for (int i = 0; i < k->epochs; i++) {
+            /* fences of shared device functions are reported with the kernel that numbered them */
+            if (k->id_to_fence_map.find(i) == k->id_to_fence_map.end())
+                continue;
+            auto current = k->fence_map[i];
+            if (!current->not_oversynchronized.load()) {
+                uint64_t addr = k->id_to_fence_map[i];
+                auto next = k->fence_map[i+1];
+                /* NOTE: wrapper script depends on this format. Do not change without changing the wrapper! */
+                printf("Fence@: %lx | Epoch: %d | Info: %s | Type: %s\n", addr, i, fence_to_lineinfo_map[addr].c_str(),
+                    current->get_comment(next->operations.load()).c_str());
+            }
+        }
+    }
+}
+/* Same as print_suggestions, as a JSON array of kernels with their fences */
+void json_suggestions(FILE *f, const char *sep) {
+    json_key(f, sep, "suggestions");
+    fprintf(f, "[");
+    for (size_t n = 0; n < kernels.size(); n++) {
+        kernel_info_t *k = kernels[n];
+        fprintf(f, "%s\n{\"kernel\": ", n ? "," : "");
+        json_string(f, k->name);
+        fprintf(f, ", \"launches\": %d, \"fences\": [", k->launches);
+        const char *comma = "";
+        for (int i = 0; i < k->epochs; i++) {
+            if (k->id_to_fence_map.find(i) == k->id_to_fence_map.end())
+                continue;
+            auto current = k->fence_map[i];
+            if (!current->not_oversynchronized.load()) {
+                uint64_t addr = k->id_to_fence_map[i];
+                auto next = k->fence_map[i+1];
+                fprintf(f, "%s\n{\"addr\": %lu, \"epoch\": %d, \"info\": ", comma, addr, i);
+                json_string(f, fence_to_lineinfo_map[addr]);
+                fprintf(f, ", \"type\": ");
+                json_string(f, current->get_comment(next->operations.load()));
+                fprintf(f, "}");
+                comma = ",";
+            }
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, "]");
+}
+
+/* Hot-path stats of the pool: each worker, their sum, and the feeding thread. Workers must be gone */
+void json_pool_stats(FILE *f, const char *sep) {
+    thread_stats_t total = {};
+    json_key(f, sep, "workers");
+    fprintf(f, "[");
+    for (int w = 0; w < num_threads; w++) {
+        fprintf(f, "%s\n{\"id\": %d, \"node\": %d, \"packets\": %lu, \"busy_ms\": %lf,", w ? "," : "", w,
+            topology.id[worker_node[w]], worker_packets[w], worker_busy[w].getMillis());
+        json_thread_stats(f, "", &worker_stats[w]);
+        fprintf(f, "}");
+        thread_stats_merge(&total, &worker_stats[w]);
+    }
+    fprintf(f, "]");
+    json_key(f, ",", "worker_totals");
+    fprintf(f, "{");
+    json_thread_stats(f, "", &total);
+    fprintf(f, "}");
+    json_key(f, ",", "pipeline");
+    fprintf(f, "{");
+    json_pipeline_stats(f, "", &pipeline_stats);
+    fprintf(f, "}");
+}
+#endif /* HOST_PIPELINE_H */
@@ -39,6 +39,9 @@
 /* contains definition of the mem_access_t structure */
 #include "common.h"
 
+/* metadata updates, shared by all lanes of a group */
+#include "device_meta.h"
+
 __device__ __inline__
 void dev_sleep(int &delay) {
     if(delay) {
@@ -51,108 +54,33 @@ void dev_sleep(int &delay) {
 }
 
 
+/* Queue a granule that just became multi-block and stored, detection only visits those */
 __device__ __inline__
-void set_device_metadata(uint64_t &metadata, uint32_t op_mask, uint64_t bid) {
-    uint64_t old_id = getBits(metadata, POS_ID, SZ_ID);
-    uint64_t first = getBit(metadata, POS_F);
-    /* This is the important information */
-    if (bid != old_id && first != 0) {
-        setBit(metadata, POS_MB);
-    }
-    setBit(metadata, POS_F);
-
-    uint64_t old_st = getBit(metadata, POS_ST);
-    setBit(metadata, POS_ST, old_st | (op_mask & MASK_STORE));
-
-    setBits(metadata, POS_ID, SZ_ID, bid);
-    // This metadata also houses 'count' of traces present in stream_meta.
-    // The field is updated in send_trace method.
-}
-
-
-__device__ __inline__
-uint64_t set_host_metadata(long id, int epoch, uint32_t op_mask) {
-    uint64_t info = 0;
-    setBit(info, HPOS_LD, MASK_LOAD & op_mask);
-    setBit(info, HPOS_ST, MASK_STORE & op_mask);
-    setBits(info, HPOS_SCP, HSZ_SCP, (op_mask & SCOPE_CTA) | (op_mask & SCOPE_GPU) | (op_mask & SCOPE_SYS));
-    setBits(info, HPOS_ID, HSZ_ID, id);
-    setBits(info, HPOS_EP, HSZ_EP, epoch);
-    return info;
-}
-
-
-__device__ __inline__
-bool skip_trace(uint32_t op_mask) {
-    bool skip = false;
-    if (DO_FILTER) {
-        // First two bits in mask is the scope of the operation, get it!
-        int scp = (op_mask & 3);
-        /* A Load and with scope greater than equal to device is enough
-           for a volatile load and atomics with device_scope or larger */
-        if ((MASK_LOAD & op_mask) && (scp >= SCOPE_GPU))
-            skip = true;
-    }
-    return skip;
+void queue_candidate(dev_args *dev, uint64_t md_offset) {
+    unsigned long long e = atomicAdd(dev->worklist_len, 1ull);
+    /* past the capacity, the host falls back to scanning every granule */
+    if (e < dev->worklist_cap)
+        dev->worklist[e] = md_offset;
 }
 
+/* Execution sampling, decided by a seeded hash rather than per thread per instruction state
+   SAMPLE_HASH: 1 in sample_period accesses, from (thread, instruction, dynamic count of the thread)
+   SAMPLE_CTA: every access of the blocks picked by ctaSampled */
 __device__ __inline__
 bool skip_instrumentation(dev_args *dev, uint64_t global_tid, uint64_t global_bid, int instr) {
-    bool skip = true;
-    long dimension = dev->threads;
-    /* Location of pointer, is of char pointer */;
-    char *instr_meta = dev->sampling_meta;
-
-    char local = instr_meta[dimension * instr + global_tid];
-    /* Once every PER_THREAD_PER_INSTR instructions */
-    if (local == 0  || local == dev->random_meta[global_bid])
-        skip = false;
-    local += 1;
-    if (local > PER_THREAD_PER_INSTR)
-        local = SAMP_BASE;
-    instr_meta[dimension * instr + global_tid] = local;
-    return skip;
+    if (dev->sample_policy == SAMPLE_CTA)
+        return !ctaSampled(dev->sample_seed, global_bid, dev->sample_period);
+    /* only this thread touches its count */
+    uint32_t count = dev->exec_count[global_tid]++;
+    return sampleHash(dev->sample_seed, global_tid, ((uint64_t)instr << 32) | count) % dev->sample_period != 0;
 }
 
-/*
- * This method performs a number of operations and runs optimizations
- * 1. Update the in-GPU metadata maintained per address (md_up)
- * 2. Filters trace based on the type of operation (skip_trace)
- * 3. Maintain some content on the GPU {a.k.a. streaming access-type content}
- */
-__device__ __inline__
-bool send_trace(dev_args *dev, uint64_t offset, uint64_t tid, int epoch, uint32_t op_mask, uint64_t &md_up, uint64_t bid) {
-    /* first set up content inside GPU aggregate metadata */
-    set_device_metadata(md_up, op_mask, bid);
-    /* return value */
-    bool should_trace = false;
-    // Do not maintain trace in stream_meta (version 1) if it does not help in detection
-    if (!skip_trace(op_mask)) {
-        uint64_t count = getBits(md_up, POS_CNT, SZ_CNT);
-        if (DO_STREAM && count < NUM_STREAM_TRACES) {
-            // prepare the trace that needs recording
-            uint64_t trace = set_host_metadata(tid, epoch, op_mask);
-            if (count != 0) {
-                // some traces exist, write to a new position
-                offset = offset + count * dev->length;
-            }
-            uint32_t *stream_meta = dev->stream_meta;
-            stream_meta[offset] = trace;
-            /* update count in aggregate metadata */
-            count += 1;
-            setBits(md_up, POS_CNT, SZ_CNT, count);
-        } else {
-            // no place in stream_meta, send it to host!
-            should_trace = true;
-        }
-    }
-    return should_trace;
-}
-
-extern "C" __device__ __noinline__
-void instrument_fence(int pred, uint32_t fenceId, uint64_t args) {
-#if DO_ANALYZE
-    if (!pred)
+/* Variants of the instrumentation functions are template instances, see INSTRUMENT_VARIANT.
+   Mode switches are compile-time constants inside each one */
+template <int M>
+__device__ __forceinline__
+void instrument_fence_impl(int pred, uint32_t fenceId, uint64_t args) {
+    if (!DO_ANALYZE(M) || !pred)
         return;
 
     unsigned mask = __activemask();
@@ -175,7 +103,6 @@ void instrument_fence(int pred, uint32_t fenceId, uint64_t args) {
     }
 
     __syncwarp(mask);
-#endif
 }
 
 /* Tracing memory accesses by each thread
@@ -184,10 +111,10 @@ void instrument_fence(int pred, uint32_t fenceId, uint64_t args) {
    3. op_mask - load/store/scope of operation
    4. epoch - for further analysis
  */
-extern "C" __device__ __noinline__
-void instrument_mem(int pred, uint64_t addr, uint32_t op_mask, volatile int epoch, uint32_t size, uint32_t instr, uint64_t args) {
-#if DO_ANALYZE
-    if (!pred)
+template <int M>
+__device__ __forceinline__
+void instrument_mem_impl(int pred, uint64_t addr, uint32_t op_mask, volatile int epoch, uint32_t size, uint32_t instr, uint64_t args) {
+    if (!DO_ANALYZE(M) || !pred)
         return;
 
     // Check if address belongs to global memory using PTX
@@ -203,61 +130,94 @@ void instrument_mem(int pred, uint64_t addr, uint32_t op_mask, volatile int epoc
 
         // threadId -- global
         uint64_t tid = serializeId(threadIdx.x, threadIdx.y, threadIdx.z, blockDim.x, blockDim.y, blockDim.z);
+        int lane = tid % WARP_SIZE;
         uint64_t bid = serializeId(blockIdx.x, blockIdx.y, blockIdx.z, gridDim.x, gridDim.y, gridDim.z);
         tid = tid + bid * dev->threads_per_block;
 
         /* Skip: Execution sampling */
-        if (DO_SAMPLING && skip_instrumentation(dev, tid, bid, instr)) {
-            /* non-sampled instance, do nothing */
-        } else {
+        bool sampled = !(DO_SAMPLING(M) && skip_instrumentation(dev, tid, bid, instr));
+        unsigned active = __ballot_sync(mask, sampled);
+        if (sampled) {
             uint32_t *md_array = dev->memory_meta;
-            uint64_t len = dev->length;
-            int offset = 0, delay = BASE_DELAY;
+            int offset = 0;
 
             do {
-                uint64_t md_offset = (addr + offset) / GRAN;
-                md_offset = md_offset % len;
-                unsigned int* md_addr = &(md_array)[md_offset];
-                uint32_t md = atomicAdd(md_addr, 0);
-                /* Need to lock before updating metadata, custom locking method */
-                if (md == D_LOCKED) {
-                    dev_sleep(delay);
-                    continue;
-                }
-
-                if (atomicCAS(md_addr, md, D_LOCKED) == md) {
-                    __threadfence();
-                    uint64_t md_up = md;
-                    /* should trace be tracked? */
-                    bool trace = send_trace(dev, md_offset, tid, epoch, op_mask, md_up, bid);
-                    md = md_up;
-                    __threadfence();
-                    /* update GPU metadata */
-                    atomicExch(md_addr, md);
-                    /* send the trace after releasing the lock */
-                    if (trace) {
-                        mem_access_t ma;
-                        ma.addr = addr + offset;
-                        ma.info = set_host_metadata(tid, epoch, op_mask);
-
-                        channel_t c;
-                        c.type = TYPE_MEM;
-                        c.ma = ma;
-                        ChannelDev *cdev = dev->channel_dev;
-                        cdev->push (&c, sizeof(channel_t));
+                /* global memory outside of the tracked allocations is NO_SHADOW, and left alone */
+                uint64_t md_offset = shadow_lookup(dev->ranges, dev->num_ranges, (addr + offset) / GRAN);
+                /* lanes on the same granule, the lowest one updates it for all of them */
+                unsigned peers = __match_any_sync(active, md_offset);
+                int leader = __ffs(peers) - 1;
+                unsigned overflow = 0;
+                if (lane == leader && md_offset != NO_SHADOW) {
+                    unsigned int* md_addr = &(md_array)[md_offset];
+                    int delay = BASE_DELAY;
+                    uint32_t md = *(volatile uint32_t *)md_addr;
+                    unsigned stored;
+                    uint32_t depth = DO_STREAM(M) ? dev->stream_depth : 0;
+                    while (1) {
+                        uint64_t md_up = md;
+                        /* which traces should be tracked? */
+                        overflow = merge_group<M>(peers, op_mask, md_up, bid, depth, stored);
+                        /* nothing to publish, e.g. a block reading its own granule again */
+                        if ((uint32_t)md_up == md)
+                            break;
+                        /* update GPU metadata, retry on top of whatever won the race */
+                        uint32_t seen = atomicCAS(md_addr, md, (uint32_t)md_up);
+                        if (seen == md) {
+                            if (became_candidate(md, md_up))
+                                queue_candidate(dev, md_offset);
+                            break;
+                        }
+                        md = seen;
+                        dev_sleep(delay);
                     }
-                    /* recorded meta, go to next size-offset */
-                    offset += GRAN;
-                    /* reset backoff delay for the next offset */
-                    delay = BASE_DELAY;
-                } else {
-                    dev_sleep(delay);
+                    if (stored)
+                        store_traces(dev, md_offset, stored, getBits(md, POS_CNT, SZ_CNT), leader, tid, epoch, op_mask);
+                }
+                /* every lane sends its own trace */
+                overflow = __shfl_sync(peers, overflow, leader);
+                if (overflow & (1u << lane)) {
+                    channel_t c;
+                    make_channel(c, md_offset, set_host_metadata(tid, epoch, op_mask), TYPE_MEM);
+                    ChannelDev *cdev = dev->channel_dev;
+                    cdev->push (&c, sizeof(channel_t));
                 }
+                /* recorded meta, go to next size-offset */
+                offset += GRAN;
             } while(offset < size);
         }
 
         /* sync */
         __syncwarp(mask);
     }
-#endif
 }
+
+/* Functions inserted by the host are looked up by name, one pair per device mode.
+   Host picks instrument_mem_<mode> and instrument_fence_<mode> (see nvbit_at_init) */
+#define INSTRUMENT_VARIANT(m) \
+extern "C" __device__ __noinline__ \
+void instrument_fence_##m(int pred, uint32_t fenceId, uint64_t args) { \
+    instrument_fence_impl<m>(pred, fenceId, args); \
+} \
+extern "C" __device__ __noinline__ \
+void instrument_mem_##m(int pred, uint64_t addr, uint32_t op_mask, volatile int epoch, uint32_t size, uint32_t instr, uint64_t args) { \
+    instrument_mem_impl<m>(pred, addr, op_mask, epoch, size, instr, args); \
+}
+
+static_assert(DEVICE_MODE_COUNT == 16, "one variant per device mode");
+INSTRUMENT_VARIANT(0)
+INSTRUMENT_VARIANT(1)
+INSTRUMENT_VARIANT(2)
+INSTRUMENT_VARIANT(3)
+INSTRUMENT_VARIANT(4)
+INSTRUMENT_VARIANT(5)
+INSTRUMENT_VARIANT(6)
+INSTRUMENT_VARIANT(7)
+INSTRUMENT_VARIANT(8)
+INSTRUMENT_VARIANT(9)
+INSTRUMENT_VARIANT(10)
+INSTRUMENT_VARIANT(11)
+INSTRUMENT_VARIANT(12)
+INSTRUMENT_VARIANT(13)
+INSTRUMENT_VARIANT(14)
+INSTRUMENT_VARIANT(15)
@@ -0,0 +1,130 @@
+#ifndef JOB_RING_H
+#define JOB_RING_H
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+
+/* Bounded multi-producer multi-consumer ring of buffer indices, used to trade
+ * jobs[] slots between the distributor and the workers without locks.
+ * Every cell carries a sequence number telling whether it is ready to be
+ * written (seq == pos) or read (seq == pos + 1) for a given ticket.
+ *
+ * Consumers that find the ring empty for a while park on a condition
+ * variable instead of spinning; producers only touch the mutex when someone
+ * is actually parked. */
+
+/* power of two, must hold all the buffers */
+#define JOB_RING_SIZE 1024
+/* failed pops before a consumer parks itself */
+#define JOB_RING_SPINS 1024
+
+typedef struct _ring_cell_t {
+    std::atomic<uint64_t> seq;
+    int value;
+} ring_cell_t;
+
+typedef struct _job_ring_t {
+    ring_cell_t cells[JOB_RING_SIZE];
+    /* keep producer and consumer tickets on separate cache lines */
+    alignas(64) std::atomic<uint64_t> enqueue_pos;
+    alignas(64) std::atomic<uint64_t> dequeue_pos;
+    /* parking support for idle consumers */
+    alignas(64) std::atomic<int> sleepers;
+    pthread_mutex_t park_lock;
+    pthread_cond_t park_cond;
+} job_ring_t;
+
+static void ring_init(job_ring_t *ring) {
+    for (uint64_t i = 0; i < JOB_RING_SIZE; i++)
+        ring->cells[i].seq.store(i, std::memory_order_relaxed);
+    ring->enqueue_pos.store(0, std::memory_order_relaxed);
+    ring->dequeue_pos.store(0, std::memory_order_relaxed);
+    ring->sleepers.store(0);
+    pthread_mutex_init(&ring->park_lock, NULL);
+    pthread_cond_init(&ring->park_cond, NULL);
+}
+
+static bool ring_push(job_ring_t *ring, int value) {
+    uint64_t pos = ring->enqueue_pos.load(std::memory_order_relaxed);
+    while (1) {
+        ring_cell_t *cell = &ring->cells[pos & (JOB_RING_SIZE - 1)];
+        uint64_t seq = cell->seq.load(std::memory_order_acquire);
+        int64_t diff = (int64_t)seq - (int64_t)pos;
+        if (diff == 0) {
+            if (ring->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                cell->value = value;
+                cell->seq.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            /* full */
+            return false;
+        } else {
+            pos = ring->enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+static bool ring_pop(job_ring_t *ring, int &value) {
+    uint64_t pos = ring->dequeue_pos.load(std::memory_order_relaxed);
+    while (1) {
+        ring_cell_t *cell = &ring->cells[pos & (JOB_RING_SIZE - 1)];
+        uint64_t seq = cell->seq.load(std::memory_order_acquire);
+        int64_t diff = (int64_t)seq - (int64_t)(pos + 1);
+        if (diff == 0) {
+            if (ring->dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                value = cell->value;
+                cell->seq.store(pos + JOB_RING_SIZE, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            /* empty */
+            return false;
+        } else {
+            pos = ring->dequeue_pos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+static bool ring_empty(job_ring_t *ring) {
+    return ring->dequeue_pos.load() >= ring->enqueue_pos.load();
+}
+
+/* Values in the ring, approximate while it is in use */
+static uint64_t ring_depth(job_ring_t *ring) {
+    uint64_t head = ring->dequeue_pos.load(), tail = ring->enqueue_pos.load();
+    return tail > head ? tail - head : 0;
+}
+
+/* Block the caller until the ring has something or 'done' is set.
+   Emptiness is re-checked under park_lock, and producers signal under it.
+   The caller counts itself in 'sleepers' before that check, and a producer
+   reads 'sleepers' after its push behind a full fence (see ring_wake): both
+   sides are sequentially consistent, so at least one of them sees the other,
+   and a push racing with the caller cannot be missed. */
+static void ring_park(job_ring_t *ring, std::atomic<int> &done, int done_value) {
+    pthread_mutex_lock(&ring->park_lock);
+    ring->sleepers.fetch_add(1);
+    while (ring_empty(ring) && done.load() != done_value)
+        pthread_cond_wait(&ring->park_cond, &ring->park_lock);
+    ring->sleepers.fetch_sub(1);
+    pthread_mutex_unlock(&ring->park_lock);
+}
+
+/* Wake parked consumers. 'all' is used when the producer is done */
+static void ring_wake(job_ring_t *ring, bool all) {
+    /* the push is a relaxed CAS: without the fence the load below may be satisfied
+       before it is visible (store buffering), missing a consumer about to park */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring->sleepers.load() == 0)
+        return;
+    pthread_mutex_lock(&ring->park_lock);
+    if (all)
+        pthread_cond_broadcast(&ring->park_cond);
+    else
+        pthread_cond_signal(&ring->park_cond);
+    pthread_mutex_unlock(&ring->park_lock);
+}
+
+#endif /* JOB_RING_H */
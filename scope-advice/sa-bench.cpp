@@ -0,0 +1,726 @@
+/* Microbenchmarks of the host analysis (host_pipeline.h) over synthetic launches,
+ * without a GPU or CUDA. Each stage is measured on its own, --stages picks some
+ * of them (comma-separated, default all):
+ *   storage       per-granule trace storage: a std::vector per granule, as before
+ *                 the arenas, against arena-backed summaries, time and RSS
+ *   amap          access map: sparse pages (access_map.h) against the flat array
+ *                 zeroed before every kernel it replaced, over --rounds kernels
+ *   decode        channel buffers folded into a launch: batched (decode, radix
+ *                 sort, one lock per granule run) against one packet at a time
+ *   fold          traces folded into one granule summary, repeats included
+ *   lookups       fence index of --index-warps warps and --index-epochs epochs
+ *                 built on one thread, then getPrevSync/getNextSync against the
+ *                 linear walk over fence_meta they replaced
+ *   sched         detection scan of one launch on num_threads threads: static
+ *                 slices of the granules, as before the chunks, against cost-split
+ *                 chunks with stealing. Per-worker times, and tail of the chunks
+ *   pipeline      rounds of ingest (channel buffers through the worker pool:
+ *                 decode, sort, fold) then detection (index, chunk plan and scan
+ *                 of the staged granules)
+ *
+ *   sa-bench [--stages LIST] [--packets N] [--granules N] [--hot F] [--epochs N]
+ *            [--blocks N] [--block-dim N] [--fences F] [--fold N] [--distinct N]
+ *            [--lookups N] [--index-warps N] [--index-epochs N] [--worklist]
+ *            [--rounds N] [--threads N] [--seed N]
+ *
+ * The pool is sized as in the tool unless --threads is given, HUGE_PAGES applies.
+ * Multi-threaded stages other than the pipeline use as many plain threads. */
+
+#include <algorithm>
+#include <getopt.h>
+#include <random>
+#include <thread>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host_pipeline.h"
+
+/* variant run by the pool, and by the scan of the sched stage */
+#define BENCH_MODE (MODE_FILTER | MODE_ANALYZE | MODE_PARALLEL)
+
+typedef struct {
+    uint64_t packets, granules;
+    /* share of the packets going to the 1% hottest granules */
+    double hot;
+    int epochs;
+    uint64_t blocks, block_dim;
+    /* chance a lane executed the fence of an epoch */
+    double fences;
+    uint64_t fold, distinct, lookups;
+    /* launch of the lookups stage, up to 64 epochs */
+    uint64_t index_warps;
+    int index_epochs;
+    bool worklist;
+    int rounds, threads;
+    uint64_t seed;
+    const char *stages;
+} bench_params_t;
+
+bench_params_t params = {8l << 20, 1l << 20, 0.1, 8, 1024, 256, 0.25, 16l << 20, 4096, 16l << 20, 1l << 16, 64, false, 3, 0, 1, "all"};
+
+/* Whether --stages selects 'name' */
+bool stage_on(const char *name) {
+    if (strcmp(params.stages, "all") == 0)
+        return true;
+    size_t len = strlen(name);
+    for (const char *at = params.stages; (at = strstr(at, name)) != NULL; at += len) {
+        bool starts = at == params.stages || at[-1] == ',';
+        if (starts && (at[len] == ',' || at[len] == '\0'))
+            return true;
+    }
+    return false;
+}
+
+/* Resident set of the process, in bytes */
+double rss_bytes() {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL)
+        return 0;
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return (double)resident * sysconf(_SC_PAGESIZE);
+}
+
+/* f(t) on 'workers' threads, t in [0, workers) */
+template <typename F>
+void run_threads(int workers, F f) {
+    std::vector<std::thread> pool;
+    for (int t = 0; t < workers; t++)
+        pool.emplace_back(f, t);
+    for (auto &each: pool)
+        each.join();
+}
+
+/* Synthetic trace: mostly weak loads and stores, some strong loads and atomics */
+uint64_t make_trace(std::mt19937_64 &rng, uint64_t threads) {
+    uint64_t trace = 0;
+    int op = rng() % 20;
+    bool ld = op < 12 || op >= 17, st = (op >= 12 && op < 17) || op >= 19;
+    setBits(trace, HPOS_LD, 1, ld);
+    setBits(trace, HPOS_ST, 1, st);
+    setBits(trace, HPOS_SCP, HSZ_SCP, op >= 17 ? SCOPE_GPU : SCOPE_CTA);
+    setBits(trace, HPOS_ID, HSZ_ID, rng() % threads);
+    setBits(trace, HPOS_EP, HSZ_EP, rng() % params.epochs);
+    return trace;
+}
+
+/* Kernel with fences 0 to epochs - 1, all of them over-synchronized so far */
+kernel_info_t *bench_kernel() {
+    kernel_info_t *k = new kernel_info_t();
+    k->name = "bench";
+    k->epochs = params.epochs;
+    k->launches = 0;
+    k->resolved.store(0);
+    k->traced_ms = 0;
+    for (int e = -1; e <= params.epochs; e++) {
+        k->fence_map[e] = new fence_info(e, false);
+        if (e >= 0 && e < params.epochs)
+            k->id_to_fence_map[e] = 0x100 * (e + 1);
+    }
+    return k;
+}
+
+/* Launch over one allocation of 'granules' granules, set up as the tool does */
+launch_t *bench_launch(kernel_info_t *k) {
+    /* verdicts of the last round would resolve the kernel and drain this one */
+    k->resolved.store(0);
+    for (auto &each: k->fence_map)
+        each.second->not_oversynchronized.store(0);
+    launch_t *l = open_launch(k);
+    l->dim.blockDim = params.block_dim;
+    l->dim.warpsPerBlock = roundUp(l->dim.blockDim, WARP_SIZE);
+    l->dim.gridDim = params.blocks * params.block_dim;
+    /* warps are numbered block by block (see instrument_fence_impl), a block may end with a partial warp */
+    l->dim.warpsInGrid = (l->dim.gridDim / l->dim.blockDim) * l->dim.warpsPerBlock;
+    shadow_range_t range = {0, params.granules, 0};
+    l->ranges.push_back(range);
+    l->shadow_len = params.granules;
+    amap_grow(l->access_map, l->shadow_len);
+    l->fence_index_warps = (l->dim.gridDim / l->dim.blockDim) * l->dim.warpsPerBlock;
+    l->fence_index = (epoch_mask_t *)calloc(l->fence_index_warps * WARP_SIZE, sizeof(epoch_mask_t));
+    return l;
+}
+
+/* fence_meta as staged after the kernel, params.fences of the lanes executing each fence */
+void stage_fences(launch_t *l, std::mt19937_64 &rng) {
+    uint64_t words = (uint64_t)l->dim.warpsInGrid * l->epochs;
+    l->staged_fence_meta = (uint32_t *)malloc(sizeof(uint32_t) * words);
+    /* a byte of randomness per lane, 1/256 steps of density are enough here */
+    unsigned threshold = params.fences * 256;
+    for (uint64_t w = 0; w < words; w++) {
+        uint32_t mask = 0;
+        for (int lane = 0; lane < WARP_SIZE; lane += 8) {
+            uint64_t bytes = rng();
+            for (int b = 0; b < 8; b++)
+                mask |= (uint32_t)(((bytes >> (8 * b)) & 0xff) < threshold) << (lane + b);
+        }
+        l->staged_fence_meta[w] = mask;
+    }
+}
+
+/* Metadata of the granules that got packets, multi-block and stored: either all granules
+   (as scanned when the worklist overflows) or the touched ones only */
+void stage_granules(launch_t *l, const std::vector<bool> &touched) {
+    uint32_t md = (1 << POS_MB) | (1 << POS_ST);
+    if (params.worklist) {
+        l->worklist = true;
+        for (uint64_t g = 0; g < params.granules; g++)
+            l->candidates += touched[g];
+        l->staged_worklist = (uint64_t *)malloc(sizeof(uint64_t) * l->candidates);
+        l->staged_candidates = (uint32_t *)malloc(sizeof(uint32_t) * l->candidates * candidate_words());
+        uint64_t c = 0;
+        for (uint64_t g = 0; g < params.granules; g++) {
+            if (touched[g]) {
+                l->staged_worklist[c] = g;
+                l->staged_candidates[c++ * candidate_words()] = md;
+            }
+        }
+        return;
+    }
+    staged_meta_t staged;
+    staged.first = 0;
+    staged.count = params.granules;
+    staged.memory_meta = (uint32_t *)malloc(sizeof(uint32_t) * staged.count);
+    staged.stream_meta = NULL;
+    for (uint64_t g = 0; g < params.granules; g++)
+        staged.memory_meta[g] = touched[g] ? md : 0;
+    l->staged_meta.push_back(staged);
+}
+
+/* Traces folded into a single summary, 'distinct' different ones repeated over and over */
+void bench_fold(std::mt19937_64 &rng, uint64_t threads) {
+    std::vector<uint64_t> traces(params.distinct);
+    for (auto &each: traces)
+        each = make_trace(rng, threads);
+    std::vector<uint32_t> order(params.fold);
+    for (auto &each: order)
+        each = rng() % params.distinct;
+    trace_arena_t arena;
+    arena.cur = arena.end = NULL;
+    granule_summary_t *s = summary_create(&arena);
+    duration fold;
+    fold.start();
+    for (uint64_t j = 0; j < params.fold; j++) {
+        uint64_t trace = traces[order[j]];
+        int cls = trace_class(trace);
+        if (cls >= 0)
+            summary_add(&arena, s, cls, getBits(trace, HPOS_EP, HSZ_EP), getBits(trace, HPOS_ID, HSZ_ID));
+    }
+    fold.end();
+    printf("Fold: %lu traces, %lu distinct, %lf ns/trace, %u slots (%lu KB)\n", params.fold, params.distinct,
+        fold.getMillis() * 1e6 / params.fold, s->capacity, (sizeof(granule_summary_t) + (s->table ? sizeof(summary_entry_t) * s->capacity : 0)) / 1024);
+    arena_release(&arena);
+}
+
+/* Every packet of 'buffers' stored per granule on num_threads threads, granule g by thread
+   g % num_threads: in a std::vector of traces allocated on first touch (the store before
+   the arenas), then folded into arena-backed summaries. Time, and RSS taken by the store */
+void bench_storage(const std::vector<std::vector<channel_t>> &buffers) {
+    int workers = num_threads;
+    uint64_t packets = 0;
+    for (auto &each: buffers)
+        packets += each.size() - (&each == &buffers.back());
+
+    std::vector<std::vector<uint64_t>*> vectors(params.granules, NULL);
+    double rss = rss_bytes();
+    duration fill, release;
+    fill.start();
+    run_threads(workers, [&](int t) {
+        for (auto &buffer: buffers) {
+            for (auto &c: buffer) {
+                if (channel_type(c) != TYPE_MEM || c.addr % workers != (uint64_t)t)
+                    continue;
+                if (vectors[c.addr] == NULL)
+                    vectors[c.addr] = new std::vector<uint64_t>();
+                vectors[c.addr]->push_back(channel_trace(c));
+            }
+        }
+    });
+    fill.end();
+    double vector_rss = rss_bytes() - rss;
+    release.start();
+    for (auto &each: vectors)
+        delete each;
+    release.end();
+    printf("Storage (vector): %lu packets, %lf ms, %lf Mpackets/s, %lf MB RSS, %lf ms to free\n", packets,
+        fill.getMillis(), fill.getMillis() > 0 ? packets / fill.getMillis() / 1000 : 0.0, vector_rss / (1024 * 1024),
+        release.getMillis());
+
+    std::vector<granule_summary_t*> summaries(params.granules, NULL);
+    std::vector<trace_arena_t> arenas(workers);
+    rss = rss_bytes();
+    duration fold, drop;
+    fold.start();
+    run_threads(workers, [&](int t) {
+        trace_arena_t *arena = &arenas[t];
+        arena->cur = arena->end = NULL;
+        for (auto &buffer: buffers) {
+            for (auto &c: buffer) {
+                if (channel_type(c) != TYPE_MEM || c.addr % workers != (uint64_t)t)
+                    continue;
+                if (summaries[c.addr] == NULL)
+                    summaries[c.addr] = summary_create(arena);
+                uint64_t trace = channel_trace(c);
+                int cls = trace_class(trace);
+                if (cls >= 0)
+                    summary_add(arena, summaries[c.addr], cls, getBits(trace, HPOS_EP, HSZ_EP),
+                        getBits(trace, HPOS_ID, HSZ_ID));
+            }
+        }
+    });
+    fold.end();
+    double arena_rss = rss_bytes() - rss;
+    drop.start();
+    for (auto &each: arenas)
+        arena_release(&each);
+    drop.end();
+    printf("Storage (arena): %lu packets, %lf ms, %lf Mpackets/s, %lf MB RSS, %lf ms to free\n", packets,
+        fold.getMillis(), fold.getMillis() > 0 ? packets / fold.getMillis() / 1000 : 0.0, arena_rss / (1024 * 1024),
+        drop.getMillis());
+}
+
+/* The access map of 'buffers' over --rounds kernels on num_threads threads: packets set
+   their granule slot (granule g by thread g % num_threads), detection reads every slot
+   (a contiguous slice per thread), then the map is emptied for the next kernel. Sparse
+   pages against the flat array, as sized to the shadow granules here. */
+void bench_amap(const std::vector<std::vector<channel_t>> &buffers) {
+    int workers = num_threads;
+    uint64_t packets = 0, granules = params.granules, slice = (granules + workers - 1) / workers;
+    for (auto &each: buffers)
+        packets += each.size() - (&each == &buffers.back());
+    std::vector<uint64_t> found(workers);
+
+    for (int dense = 0; dense < 2; dense++) {
+        double rss = rss_bytes(), peak = 0;
+        access_map_t map;
+        amap_entry_t *flat = NULL;
+        if (dense)
+            flat = (amap_entry_t *)calloc(granules, sizeof(amap_entry_t));
+        else
+            amap_init(&map, granules);
+        duration insert, scan, reset;
+        for (int round = 0; round < params.rounds; round++) {
+            insert.start();
+            run_threads(workers, [&](int t) {
+                for (auto &buffer: buffers) {
+                    for (auto &c: buffer) {
+                        if (channel_type(c) != TYPE_MEM || c.addr % workers != (uint64_t)t)
+                            continue;
+                        amap_entry_t &slot = dense ? flat[c.addr] : amap_slot(&map, c.addr);
+                        slot.store(slot.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                    }
+                }
+            });
+            insert.end();
+            peak = max(peak, rss_bytes() - rss);
+            scan.start();
+            run_threads(workers, [&](int t) {
+                uint64_t hits = 0;
+                for (uint64_t g = t * slice; g < min((t + 1) * slice, granules); g++)
+                    hits += (dense ? flat[g].load() : amap_peek(&map, g)) != 0;
+                found[t] = hits;
+            });
+            scan.end();
+            reset.start();
+            if (dense)
+                memset((void *)flat, 0, granules * sizeof(amap_entry_t));
+            else
+                amap_reset(&map);
+            reset.end();
+        }
+        uint64_t hits = 0;
+        for (auto each: found)
+            hits += each;
+        double held = dense ? (double)granules * sizeof(amap_entry_t) : amap_bytes(&map);
+        printf("Access map (%s): %d kernels, insert %lf ns/packet, scan %lf ns/granule (%lu hit), "
+            "reset %lf ms, %lf MB held, %lf MB RSS at most\n", dense ? "flat" : "sparse", params.rounds,
+            insert.getMillis() * 1e6 / max(packets * params.rounds, (uint64_t)1),
+            scan.getMillis() * 1e6 / (granules * params.rounds), hits, reset.getMillis() / params.rounds,
+            held / (1024 * 1024), peak / (1024 * 1024));
+        if (dense)
+            free(flat);
+        else
+            huge_free(map.dir, map.pages * sizeof(std::atomic<amap_entry_t*>));
+    }
+}
+
+/* 'buffers' folded into a launch --rounds times on num_threads threads, buffer b by thread
+   b % num_threads as the pool deals them: one packet at a time as the workers did, then
+   batched by handle_buffer. Decoding and sorting alone are timed as well */
+void bench_decode(const std::vector<std::vector<channel_t>> &buffers) {
+    int workers = num_threads;
+    uint64_t packets = 0;
+    for (auto &each: buffers)
+        packets += each.size() - (&each == &buffers.back());
+    packets *= params.rounds;
+    kernel_info_t *k = bench_kernel();
+    launch_t *l = bench_launch(k);
+    uint32_t per_buffer = CHANNEL_SIZE / sizeof(channel_t);
+    std::vector<uint64_t> runs(workers);
+
+    duration sort;
+    sort.start();
+    run_threads(workers, [&](int t) {
+        std::vector<packet_ref_t> refs(per_buffer), tmp(per_buffer);
+        for (int round = 0; round < params.rounds; round++) {
+            for (size_t b = t; b < buffers.size(); b += workers) {
+                channel_t *chan = const_cast<channel_t *>(buffers[b].data());
+                uint32_t n = decode_buffer(chan, buffers[b].size(), refs.data());
+                radix_sort_packets(refs.data(), tmp.data(), n, radix_passes(l->shadow_len));
+                for (uint32_t j = 0; j < n; j++)
+                    runs[t] += j == 0 || refs[j].md_offset != refs[j - 1].md_offset;
+            }
+        }
+    });
+    sort.end();
+    uint64_t groups = 0;
+    for (auto each: runs)
+        groups += each;
+    printf("Decode (sort only): %lu packets, %lu granule runs, %lf ms, %lf Mpackets/s\n", packets, groups,
+        sort.getMillis(), sort.getMillis() > 0 ? packets / sort.getMillis() / 1000 : 0.0);
+
+    for (int batched = 0; batched < 2; batched++) {
+        duration fold;
+        fold.start();
+        run_threads(workers, [&](int t) {
+            std::vector<packet_ref_t> refs(per_buffer), tmp(per_buffer);
+            for (int round = 0; round < params.rounds; round++) {
+                for (size_t b = t; b < buffers.size(); b += workers) {
+                    channel_t *chan = const_cast<channel_t *>(buffers[b].data());
+                    uint32_t n = buffers[b].size();
+                    if (batched) {
+                        handle_buffer(l, chan, n, refs, tmp, t);
+                        continue;
+                    }
+                    for (uint32_t e = 0; e < n; e++)
+                        if (channel_type(chan[e]) == TYPE_MEM)
+                            handle_memory_access(l, &chan[e], t);
+                }
+            }
+        });
+        fold.end();
+        uint64_t retries = 0;
+        for (int t = 0; t < workers; t++) {
+            retries += worker_stats[t].lock_retries;
+            worker_stats[t].lock_retries = 0;
+        }
+        printf("Decode (%s): %lu packets, %lf ms, %lf Mpackets/s, %lu lock retries\n",
+            batched ? "batched" : "per packet", packets, fold.getMillis(),
+            fold.getMillis() > 0 ? packets / fold.getMillis() / 1000 : 0.0, retries);
+        amap_reset(l->access_map);
+        for (int t = 0; t < workers; t++)
+            arena_release(&l->arenas[t]);
+    }
+    /* the slot may be reopened by the pipeline stage */
+    l->done.store(1);
+}
+
+/* Fence index of a launch of its own, --index-warps full warps and --index-epochs epochs,
+   built on one thread. Then random lookups on it, and the same ones walking fence_meta */
+void bench_lookups(std::mt19937_64 &rng) {
+    launch_t *l = new launch_t();
+    l->epochs = params.index_epochs;
+    l->dim.blockDim = params.block_dim;
+    l->dim.warpsPerBlock = roundUp(l->dim.blockDim, WARP_SIZE);
+    uint64_t blocks = max(params.index_warps / l->dim.warpsPerBlock, (uint64_t)1);
+    l->dim.gridDim = blocks * l->dim.blockDim;
+    l->dim.warpsInGrid = blocks * l->dim.warpsPerBlock;
+    l->fence_index_warps = l->dim.warpsInGrid;
+    l->fence_index = (epoch_mask_t *)calloc(l->fence_index_warps * WARP_SIZE, sizeof(epoch_mask_t));
+    stage_fences(l, rng);
+
+    int workers = num_threads;
+    num_threads = 1;
+    duration index;
+    index.start();
+    build_fence_index(l, 0);
+    index.end();
+    num_threads = workers;
+    printf("Fence index: %lf ms for %lu warps, %d epochs, %lf MB\n", index.getMillis(), l->fence_index_warps,
+        l->epochs, (double)l->fence_index_warps * WARP_SIZE * sizeof(epoch_mask_t) / (1024 * 1024));
+
+    std::vector<uint64_t> tids(1 << 16);
+    std::vector<int> epochs(1 << 16);
+    for (size_t j = 0; j < tids.size(); j++) {
+        tids[j] = rng() % l->dim.gridDim;
+        epochs[j] = rng() % (l->epochs + 1);
+    }
+    /* results are summed so that the lookups are not optimized away, and must agree */
+    long sums[2][2] = {{0, 0}, {0, 0}};
+    double ns[2][2];
+    for (int linear = 0; linear < 2; linear++) {
+        duration prev, next;
+        prev.start();
+        for (uint64_t j = 0; j < params.lookups; j++)
+            sums[linear][0] += (linear ? getPrevSyncLinear : getPrevSync)(l, epochs[j & 0xffff], tids[j & 0xffff]);
+        prev.end();
+        next.start();
+        for (uint64_t j = 0; j < params.lookups; j++)
+            sums[linear][1] += (linear ? getNextSyncLinear : getNextSync)(l, epochs[j & 0xffff], tids[j & 0xffff]);
+        next.end();
+        ns[linear][0] = prev.getMillis() * 1e6 / max(params.lookups, (uint64_t)1);
+        ns[linear][1] = next.getMillis() * 1e6 / max(params.lookups, (uint64_t)1);
+        printf("Sync lookups (%s): %lu each, prev %lf ns, next %lf ns (sum %ld)\n", linear ? "linear" : "index",
+            params.lookups, ns[linear][0], ns[linear][1], sums[linear][0] + sums[linear][1]);
+    }
+    if (sums[0][0] != sums[1][0] || sums[0][1] != sums[1][1])
+        printf("Sync lookups: index and linear walk disagree\n");
+    free(l->staged_fence_meta);
+    free(l->fence_index);
+    delete l;
+}
+
+/* Buffers of the launch through the pool, until every one of them is handled */
+void ingest_launch(launch_t *l, const std::vector<std::vector<channel_t>> &buffers, int &next_node) {
+    for (auto &each: buffers) {
+        int i;
+        while ((i = take_job(next_node)) == JOB_NONE)
+            std::this_thread::yield();
+        jobs[i].buffer = (char *)each.data();
+        queue_job(i, l, each.size() * sizeof(channel_t));
+    }
+    /* only the reference of the feeder is left once every buffer is handled */
+    while (l->refs.load() > 1)
+        std::this_thread::yield();
+}
+
+/* Units of a chunk, as scan_chunks goes through them */
+void scan_chunk(launch_t *l, const detect_chunk_t &chunk) {
+    for (uint64_t u = chunk.first; u < chunk.first + chunk.count; u++) {
+        uint64_t i, md;
+        uint32_t *stream;
+        chunk_unit(l, chunk, u, i, md, stream);
+        process_granule<BENCH_MODE>(l, i, md, stream, chunk.trace_begin, chunk.trace_end);
+    }
+}
+
+/* Busy time of every worker and time of every chunk of a scan, in ms */
+void print_sched(const char *name, double wall, uint64_t units, std::vector<double> &busy,
+                 std::vector<double> &chunks) {
+    double sum = 0, most = 0, least = busy.empty() ? 0 : busy[0];
+    for (double each: busy) {
+        sum += each;
+        most = max(most, each);
+        least = min(least, each);
+    }
+    double mean = busy.empty() ? 0 : sum / busy.size();
+    std::sort(chunks.begin(), chunks.end());
+    double p99 = chunks.empty() ? 0 : chunks[(chunks.size() * 99 + 99) / 100 - 1];
+    printf("Sched (%s): %lu units, %lf ms, workers min %lf mean %lf max %lf ms (max/mean %lf), "
+        "%lu chunks, p99 %lf ms, max %lf ms\n", name, units, wall, least, mean, most, mean > 0 ? most / mean : 0.0,
+        chunks.size(), p99, chunks.empty() ? 0.0 : chunks.back());
+    printf("Sched (%s) per worker:", name);
+    for (double each: busy)
+        printf(" %.3lf", each);
+    printf("\n");
+}
+
+/* Detection scan of a launch ingested by the pool, on num_threads plain threads. First every
+   thread scans its static slice of the units, as the scan was split before the chunks (timed
+   by DETECT_CHUNK units), then the chunks are estimated, split and stolen as by the pool */
+void bench_sched(kernel_info_t *k, const std::vector<std::vector<channel_t>> &buffers,
+                 const std::vector<bool> &touched, std::mt19937_64 &rng, int &next_node) {
+    launch_t *l = bench_launch(k);
+    ingest_launch(l, buffers, next_node);
+    stage_fences(l, rng);
+    stage_granules(l, touched);
+    int workers = num_threads;
+    run_threads(workers, [&](int t) { build_fence_index(l, t); });
+    int32_t range = params.worklist ? -1 : 0;
+    uint64_t units = params.worklist ? l->candidates : params.granules;
+
+    std::vector<double> busy(workers);
+    std::vector<std::vector<double>> times(workers);
+    std::vector<double> chunks;
+    duration wall;
+    wall.start();
+    run_threads(workers, [&](int t) {
+        uint64_t per_thread = roundUp(units, workers);
+        uint64_t end = min((t + 1) * per_thread, units);
+        uint64_t begin = stats_now_ns();
+        for (uint64_t u = t * per_thread; u < end; u += DETECT_CHUNK) {
+            uint64_t start = stats_now_ns();
+            scan_chunk(l, make_chunk(range, u, min((uint64_t)DETECT_CHUNK, end - u)));
+            times[t].push_back((stats_now_ns() - start) / 1e6);
+        }
+        busy[t] = (stats_now_ns() - begin) / 1e6;
+    });
+    wall.end();
+    for (auto &each: times)
+        chunks.insert(chunks.end(), each.begin(), each.end());
+    print_sched("static", wall.getMillis(), units, busy, chunks);
+
+    for (auto &each: times)
+        each.clear();
+    chunks.clear();
+    duration split;
+    split.start();
+    build_chunks(l);
+    run_threads(workers, [&](int t) { estimate_chunks(l, t); });
+    plan_chunks(l);
+    run_threads(workers, [&](int t) {
+        uint64_t begin = stats_now_ns();
+        uint32_t c;
+        while (sched_next(l->deques, workers, t, c)) {
+            uint64_t start = stats_now_ns();
+            scan_chunk(l, l->chunks[c]);
+            times[t].push_back((stats_now_ns() - start) / 1e6);
+        }
+        busy[t] = (stats_now_ns() - begin) / 1e6;
+    });
+    split.end();
+    for (auto &each: times)
+        chunks.insert(chunks.end(), each.begin(), each.end());
+    print_sched("chunks", split.getMillis(), units, busy, chunks);
+
+    /* the pool finishes the launch */
+    l->staged.store(1);
+    launch_put(l);
+    while (!l->done.load())
+        std::this_thread::yield();
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "usage: %s [--stages LIST] [--packets N] [--granules N] [--hot F] [--epochs N] [--blocks N]\n"
+        "       [--block-dim N] [--fences F] [--fold N] [--distinct N] [--lookups N] [--index-warps N]\n"
+        "       [--index-epochs N] [--worklist] [--rounds N] [--threads N] [--seed N]\n"
+        "stages: storage, amap, decode, fold, lookups, sched, pipeline (default all)\n", name);
+    exit(1);
+}
+
+void parse_params(int argc, char **argv) {
+    static struct option options[] = {
+        {"packets", required_argument, NULL, 'p'}, {"granules", required_argument, NULL, 'g'},
+        {"hot", required_argument, NULL, 'h'}, {"epochs", required_argument, NULL, 'e'},
+        {"blocks", required_argument, NULL, 'b'}, {"block-dim", required_argument, NULL, 'd'},
+        {"fences", required_argument, NULL, 'f'}, {"fold", required_argument, NULL, 'F'},
+        {"distinct", required_argument, NULL, 'D'}, {"lookups", required_argument, NULL, 'l'},
+        {"worklist", no_argument, NULL, 'w'}, {"rounds", required_argument, NULL, 'r'},
+        {"threads", required_argument, NULL, 't'}, {"seed", required_argument, NULL, 's'},
+        {"stages", required_argument, NULL, 'S'}, {"index-warps", required_argument, NULL, 'W'},
+        {"index-epochs", required_argument, NULL, 'E'}, {NULL, 0, NULL, 0}};
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'p': params.packets = strtoull(optarg, NULL, 0); break;
+            case 'g': params.granules = strtoull(optarg, NULL, 0); break;
+            case 'h': params.hot = atof(optarg); break;
+            case 'e': params.epochs = atoi(optarg); break;
+            case 'b': params.blocks = strtoull(optarg, NULL, 0); break;
+            case 'd': params.block_dim = strtoull(optarg, NULL, 0); break;
+            case 'f': params.fences = atof(optarg); break;
+            case 'F': params.fold = strtoull(optarg, NULL, 0); break;
+            case 'D': params.distinct = strtoull(optarg, NULL, 0); break;
+            case 'l': params.lookups = strtoull(optarg, NULL, 0); break;
+            case 'w': params.worklist = true; break;
+            case 'r': params.rounds = atoi(optarg); break;
+            case 't': params.threads = atoi(optarg); break;
+            case 's': params.seed = strtoull(optarg, NULL, 0); break;
+            case 'S': params.stages = optarg; break;
+            case 'W': params.index_warps = strtoull(optarg, NULL, 0); break;
+            case 'E': params.index_epochs = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    /* epochs beyond the trace field cannot be looked up, nor beyond the index mask */
+    if (optind != argc || params.granules == 0 || params.epochs < 1 || params.epochs >= (1 << HSZ_EP) ||
+        params.blocks == 0 || params.block_dim == 0 || params.blocks * params.block_dim > (ONE << HSZ_ID) ||
+        params.distinct == 0 || params.hot < 0 || params.hot > 1 || params.fences < 0 || params.fences > 1 ||
+        params.index_epochs < 1 || params.index_epochs > EPOCH_MASK_BITS)
+        usage(argv[0]);
+}
+
+int main(int argc, char **argv) {
+    parse_params(argc, argv);
+    tool_mode = BENCH_MODE;
+    stream_depth = 0;
+    const char *huge = getenv("HUGE_PAGES");
+    huge_pages = huge == NULL || atoi(huge) != 0;
+    topo_init(&topology);
+    num_threads = params.threads > 0 ? min(params.threads, MAX_THREADS) : topo_pool_size(&topology, MAX_THREADS);
+    num_buffers = min(BUFFERS_PER_WORKER * num_threads, MAX_BUFFERS);
+    topology.nodes = min(topology.nodes, num_threads);
+    topo_assign(&topology, num_threads, worker_node);
+    std::mt19937_64 rng(params.seed);
+    uint64_t threads = params.blocks * params.block_dim;
+    uint64_t hot_granules = max(params.granules / 100, (uint64_t)1);
+
+    /* full channel buffers, the last one ending with the end-of-kernel marker */
+    uint64_t per_buffer = CHANNEL_SIZE / sizeof(channel_t) - 1;
+    std::vector<std::vector<channel_t>> buffers;
+    std::vector<bool> touched(params.granules, false);
+    std::bernoulli_distribution to_hot(params.hot);
+    for (uint64_t p = 0; p < params.packets; p++) {
+        if (p % per_buffer == 0)
+            buffers.emplace_back();
+        uint64_t g = to_hot(rng) ? rng() % hot_granules : rng() % params.granules;
+        touched[g] = true;
+        channel_t c;
+        make_channel(c, g, make_trace(rng, threads), TYPE_MEM);
+        buffers.back().push_back(c);
+    }
+    if (buffers.empty())
+        buffers.emplace_back();
+    channel_t end;
+    make_channel(end, 0, 0, TYPE_INV);
+    buffers.back().push_back(end);
+    uint64_t granules_touched = 0;
+    for (uint64_t g = 0; g < params.granules; g++)
+        granules_touched += touched[g];
+
+    printf("========== BENCH ==========\n");
+    printf("Input: %lu packets over %lu granules (%lu touched, %.0lf%% of packets to the 1%% hottest), "
+        "%d epochs, %lu threads, seed %lu\n", params.packets, params.granules, granules_touched, 100 * params.hot,
+        params.epochs, threads, params.seed);
+    printf("Analysis pool: %d workers on %d nodes, %d buffers%s\n", num_threads, topology.nodes, num_buffers,
+        huge_pages ? ", huge pages" : "");
+    if (stage_on("storage"))
+        bench_storage(buffers);
+    if (stage_on("amap"))
+        bench_amap(buffers);
+    if (stage_on("decode"))
+        bench_decode(buffers);
+    if (stage_on("fold"))
+        bench_fold(rng, threads);
+    if (stage_on("lookups"))
+        bench_lookups(rng);
+    if (!stage_on("sched") && !stage_on("pipeline"))
+        return 0;
+
+    pool_start(false);
+    pipeline.start();
+    kernel_info_t *k = bench_kernel();
+    kernels.push_back(k);
+    int next_node = 0;
+    if (stage_on("sched"))
+        bench_sched(k, buffers, touched, rng, next_node);
+    for (int round = 0; round < params.rounds && stage_on("pipeline"); round++) {
+        launch_t *l = bench_launch(k);
+        uint64_t before = m_packets.load();
+        duration ingest;
+        ingest.start();
+        ingest_launch(l, buffers, next_node);
+        ingest.end();
+        uint64_t packets = m_packets.load() - before;
+        printf("Round %d ingest: %lu packets in %lu buffers, %lf ms, %lf Mpackets/s, map %lf MB\n", round, packets,
+            buffers.size(), ingest.getMillis(), ingest.getMillis() > 0 ? packets / ingest.getMillis() / 1000 : 0.0,
+            amap_bytes(l->access_map) / (1024 * 1024));
+
+        stage_fences(l, rng);
+        stage_granules(l, touched);
+        uint64_t units = params.worklist ? l->candidates : params.granules;
+        l->staged.store(1);
+        launch_put(l);
+        while (!l->done.load())
+            std::this_thread::yield();
+        printf("Round %d detection: %lu granules (%s), %lf ms, %lf ns/granule, %lu chunks\n", round, units,
+            params.worklist ? "worklist" : "full scan", l->detection.getMillis(),
+            units ? l->detection.getMillis() * 1e6 / units : 0.0, l->chunks.size());
+    }
+    pool_wait();
+    pool_stop();
+    return 0;
+}
@@ -0,0 +1,322 @@
+/* Offline analyzer: replays a capture of the tool (CAPTURE=file, see capture.h)
+ * through the host pipeline of the tool, its workers and its detection, and
+ * prints the same suggestions. Needs neither a GPU nor CUDA.
+ *
+ *   sa-replay <capture file>
+ *
+ * The pool is sized as in the tool, NUM_THREADS, NUM_BUFFERS and HUGE_PAGES
+ * apply, STATS_FILE gets the hot-path stats of the replay. Channel buffers are
+ * handed to the workers in place, from the mapped file, so the replay goes as
+ * fast as the pipeline drains them. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host_pipeline.h"
+#include "capture.h"
+
+/* launches of the capture whose metadata is not staged yet, by id */
+std::unordered_map<uint32_t, launch_t*> replayed;
+bool pool_started = false;
+/* buffers are taken from the nodes in turn, as by the distributor */
+int next_node = 0;
+int message_passes = 0;
+uint64_t channel_bytes = 0;
+
+static int env_int(const char *name, int def) {
+    const char *value = getenv(name);
+    return value != NULL && *value != '\0' ? atoi(value) : def;
+}
+
+/* Pool for the settings the capture was taken with, sized as in nvbit_at_init */
+void start_replay(const capture_launch_t *launch) {
+    tool_mode = launch->tool_mode;
+    stream_depth = launch->stream_depth;
+    int workers = env_int("NUM_THREADS", 0), buffers = env_int("NUM_BUFFERS", 0);
+    huge_pages = env_int("HUGE_PAGES", 1) != 0;
+    verbose = env_int("TOOL_VERBOSE", 0);
+    topo_init(&topology);
+    if (DO_PARALLEL(tool_mode)) {
+        num_threads = workers > 0 ? min(workers, MAX_THREADS) : topo_pool_size(&topology, MAX_THREADS);
+        num_buffers = buffers > 0 ? min(buffers, MAX_BUFFERS) : min(BUFFERS_PER_WORKER * num_threads, MAX_BUFFERS);
+    } else {
+        num_threads = num_buffers = 1;
+    }
+    topology.nodes = min(topology.nodes, num_threads);
+    topo_assign(&topology, num_threads, worker_node);
+    registry_init(&allocation_records);
+    /* jobs point into the mapped capture */
+    pool_start(false);
+    pool_started = true;
+    pipeline.start();
+}
+
+/* Copy of the next 'count' items of a payload, as the tool stages them. False past its end */
+template <typename T>
+static bool take_copy(capture_cursor_t *c, uint64_t count, T *&copy) {
+    const void *src = cursor_take(c, sizeof(T) * count);
+    if (src == NULL)
+        return false;
+    copy = (T *)malloc(sizeof(T) * count);
+    memcpy(copy, src, sizeof(T) * count);
+    return true;
+}
+
+/* Static fence table of a kernel, new or grown since its last launch */
+bool replay_kernel(const record_header_t *header, const char *payload) {
+    capture_cursor_t c = capture_cursor(header, payload);
+    const capture_kernel_t *kernel = (const capture_kernel_t *)cursor_take(&c, sizeof(capture_kernel_t));
+    if (kernel == NULL || kernel->kernel > kernels.size())
+        return false;
+    const capture_fence_t *fences = (const capture_fence_t *)cursor_take(&c, sizeof(capture_fence_t) * kernel->fences);
+    const char *name = (const char *)cursor_take(&c, kernel->name_len);
+    if (fences == NULL || name == NULL)
+        return false;
+    if (kernel->kernel == kernels.size()) {
+        kernel_info_t *k = new kernel_info_t();
+        k->name.assign(name, kernel->name_len);
+        k->launches = 0;
+        k->resolved.store(0);
+        k->traced_ms = 0;
+        kernels.push_back(k);
+    }
+    kernel_info_t *k = kernels[kernel->kernel];
+    k->epochs = kernel->epochs;
+    for (uint32_t f = 0; f < kernel->fences; f++) {
+        const char *info = (const char *)cursor_take(&c, fences[f].info_len);
+        if (info == NULL)
+            return false;
+        /* verdicts gathered so far are kept */
+        fence_info *&fence = k->fence_map[fences[f].id];
+        if (fence == NULL)
+            fence = new fence_info(fences[f].id, fences[f].is_redundant);
+        fence->is_redundant = fences[f].is_redundant;
+        if (fences[f].numbered) {
+            k->id_to_fence_map[fences[f].id] = fences[f].addr;
+            fence_to_lineinfo_map[fences[f].addr].assign(info, fences[f].info_len);
+        }
+    }
+    return true;
+}
+
+/* Set up a launch as begin_launch and set_fence_meta do, from the recorded layout */
+bool replay_launch(const record_header_t *header, const char *payload) {
+    capture_cursor_t c = capture_cursor(header, payload);
+    const capture_launch_t *launch = (const capture_launch_t *)cursor_take(&c, sizeof(capture_launch_t));
+    if (launch == NULL)
+        return false;
+    const shadow_range_t *ranges = (const shadow_range_t *)cursor_take(&c, sizeof(shadow_range_t) * launch->ranges);
+    const capture_alloc_t *allocations = (const capture_alloc_t *)cursor_take(&c, sizeof(capture_alloc_t) * launch->allocations);
+    if (ranges == NULL || allocations == NULL || launch->kernel >= kernels.size() || launch->blockDim <= 0)
+        return false;
+    /* grid laid out as set_dimension does, the fence index and fence_meta are sized from it */
+    if (launch->warpsPerBlock != roundUp(launch->blockDim, WARP_SIZE) || launch->gridDim < 0 ||
+        launch->warpsInGrid != (launch->gridDim / launch->blockDim) * launch->warpsPerBlock)
+        return false;
+    /* granules of the ranges are indexed in the access map */
+    for (uint64_t r = 0; r < launch->ranges; r++)
+        if (ranges[r].bound < ranges[r].base || ranges[r].shadow > launch->shadow_len ||
+            ranges[r].bound - ranges[r].base > launch->shadow_len - ranges[r].shadow)
+            return false;
+    if (!pool_started)
+        start_replay(launch);
+
+    launch_t *l = open_launch(kernels[launch->kernel]);
+    l->epochs = launch->epochs;
+    l->dim.warpsInGrid = launch->warpsInGrid;
+    l->dim.warpsPerBlock = launch->warpsPerBlock;
+    l->dim.blockDim = launch->blockDim;
+    l->dim.gridDim = launch->gridDim;
+    l->ranges.assign(ranges, ranges + launch->ranges);
+    l->shadow_len = launch->shadow_len;
+    amap_grow(l->access_map, l->shadow_len);
+    l->fence_index_warps = (l->dim.gridDim / l->dim.blockDim) * l->dim.warpsPerBlock;
+    l->fence_index = (epoch_mask_t *)calloc(l->fence_index_warps * WARP_SIZE, sizeof(epoch_mask_t));
+
+    /* allocations the layout was built from */
+    registry_init(&allocation_records);
+    for (uint64_t a = 0; a < launch->allocations; a++) {
+        allocation_records.live[allocations[a].base] = {allocations[a].bound, allocations[a].owner};
+        allocation_records.bytes += allocations[a].bound - allocations[a].base;
+    }
+    allocation_records.allocs = launch->allocs;
+    allocation_records.frees = launch->frees;
+    allocation_records.stale = launch->stale;
+    allocation_records.peak = launch->peak;
+    replayed[header->launch] = l;
+    return true;
+}
+
+/* Hand a message pass to the workers, as the distributor does */
+bool replay_buffer(const record_header_t *header, const char *payload) {
+    auto it = replayed.find(header->launch);
+    if (it == replayed.end() || header->bytes > CHANNEL_SIZE || !channel_pass_valid(payload, header->bytes))
+        return false;
+    launch_t *l = it->second;
+    /* memory packets name granules of the access map */
+    const channel_t *packets = (const channel_t *)payload;
+    for (uint64_t e = 0; e < header->bytes / sizeof(channel_t); e++)
+        if (channel_type(packets[e]) == TYPE_MEM && packets[e].addr >= l->shadow_len)
+            return false;
+    int i;
+    while ((i = take_job(next_node)) == JOB_NONE)
+        std::this_thread::yield();
+    message_passes += 1;
+    channel_bytes += header->bytes;
+    jobs[i].buffer = (char *)payload;
+    queue_job(i, l, header->bytes);
+    return true;
+}
+
+/* Staged metadata of a launch, as stage_device_metadata leaves it. Its analysis starts
+   once the workers are done with its buffers */
+bool replay_staged(const record_header_t *header, const char *payload) {
+    auto it = replayed.find(header->launch);
+    if (it == replayed.end())
+        return false;
+    launch_t *l = it->second;
+    replayed.erase(it);
+    capture_cursor_t c = capture_cursor(header, payload);
+    const capture_staged_t *staged = (const capture_staged_t *)cursor_take(&c, sizeof(capture_staged_t));
+    bool ok = staged != NULL;
+    if (ok) {
+        l->kernel_ms = staged->kernel_ms;
+        /* fence_meta of every warp at every epoch, the fence index is built from all of it */
+        ok = !staged->analyzed || (staged->fence_words == (uint64_t)l->dim.warpsInGrid * l->epochs &&
+            take_copy(&c, staged->fence_words, l->staged_fence_meta));
+    }
+    if (ok && staged->analyzed && staged->worklist) {
+        l->worklist = true;
+        l->candidates = staged->candidates;
+        ok = take_copy(&c, l->candidates, l->staged_worklist) &&
+            take_copy(&c, l->candidates * candidate_words(), l->staged_candidates);
+        for (uint64_t u = 0; ok && u < l->candidates; u++)
+            ok = l->staged_worklist[u] < l->shadow_len;
+        if (ok)
+            candidates_total += l->candidates;
+    } else if (ok && staged->analyzed) {
+        worklist_fallbacks++;
+        for (size_t r = 0; ok && r < l->ranges.size(); r++) {
+            staged_meta_t meta;
+            meta.first = l->ranges[r].shadow;
+            meta.count = l->ranges[r].bound - l->ranges[r].base;
+            meta.memory_meta = NULL;
+            meta.stream_meta = NULL;
+            ok = take_copy(&c, meta.count, meta.memory_meta);
+            if (ok && staged->stream)
+                ok = take_copy(&c, meta.count * stream_depth, meta.stream_meta);
+            l->staged_meta.push_back(meta);
+        }
+    }
+    if (!ok) {
+        /* partial copies are dropped, the launch is finished without detection */
+        for (auto &each: l->staged_meta) {
+            free(each.memory_meta);
+            free(each.stream_meta);
+        }
+        l->staged_meta.clear();
+        free(l->staged_fence_meta);
+        free(l->staged_worklist);
+        free(l->staged_candidates);
+        l->staged_fence_meta = NULL;
+        l->staged_worklist = NULL;
+        l->staged_candidates = NULL;
+        l->worklist = false;
+        l->candidates = 0;
+    }
+    l->staged.store(1);
+    /* analysis starts with the last job of the launch */
+    launch_put(l);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <capture file>\n", argv[0]);
+        return 1;
+    }
+    capture_reader_t reader;
+    if (!capture_map(&reader, argv[1], WIRE_VERSION)) {
+        fprintf(stderr, "%s: not a capture of wire format v%d\n", argv[1], WIRE_VERSION);
+        return 1;
+    }
+    duration replay;
+    replay.start();
+    const record_header_t *header;
+    const char *payload;
+    uint64_t records = 0;
+    bool ok = true;
+    while (ok && capture_next(&reader, header, payload)) {
+        records++;
+        switch (header->type) {
+            case CAPTURE_KERNEL:
+                ok = replay_kernel(header, payload);
+                break;
+            case CAPTURE_LAUNCH:
+                ok = replay_launch(header, payload);
+                break;
+            case CAPTURE_BUFFER:
+                ok = replay_buffer(header, payload);
+                break;
+            case CAPTURE_STAGED:
+                ok = replay_staged(header, payload);
+                break;
+            default:
+                ok = false;
+                break;
+        }
+    }
+    if (!ok || reader.at != reader.size)
+        fprintf(stderr, "%s: bad or truncated record %lu, replaying what came before\n", argv[1], records);
+    /* launches cut short by the end of the capture are dropped without detection */
+    for (auto &each: replayed) {
+        each.second->staged.store(1);
+        launch_put(each.second);
+    }
+    replayed.clear();
+    if (pool_started) {
+        pool_wait();
+        pool_stop();
+    }
+    replay.end();
+
+    if (DO_ANALYZE(tool_mode))
+        print_suggestions();
+    printf("========== REPLAY ==========\n");
+    printf("Records: %lu (%lf MB), traced launches: %d (%lu kernels)\n", records,
+        (double)reader.size / (1024 * 1024), launches_traced, kernels.size());
+    printf("Memory packets: %lu in %d message passes\n", m_packets.load(), message_passes);
+    printf("Analysis pool: %d workers on %d nodes, %d buffers\n", num_threads, topology.nodes, num_buffers);
+    printf("Candidate granules: %lu (%d launches scanned every granule)\n", candidates_total, worklist_fallbacks);
+    printf("Detection time: %lf ms\n", detection.getMillis());
+    printf("Replay time: %lf ms, %lf Mpackets/s\n", replay.getMillis(),
+        replay.getMillis() > 0 ? m_packets.load() / replay.getMillis() / 1000 : 0.0);
+    /* same stats file as the tool, with what a replay knows of */
+    const char *stats_file = getenv("STATS_FILE");
+    FILE *f = stats_file != NULL && *stats_file != '\0' ? fopen(stats_file, "w") : NULL;
+    if (f != NULL) {
+        json_key(f, "{", "mode");
+        fprintf(f, "%d", tool_mode);
+        json_key(f, ",", "replay");
+        json_u64(f, "{", "records", records);
+        json_u64(f, ",", "memory_packets", m_packets.load());
+        json_u64(f, ",", "message_passes", message_passes);
+        json_u64(f, ",", "channel_bytes", channel_bytes);
+        json_u64(f, ",", "traced_launches", launches_traced);
+        json_u64(f, ",", "candidate_granules", candidates_total);
+        json_u64(f, ",", "worklist_fallbacks", worklist_fallbacks);
+        json_double(f, ",", "detection_ms", detection.getMillis());
+        json_double(f, ",", "replay_ms", replay.getMillis());
+        fprintf(f, "}");
+        if (DO_ANALYZE(tool_mode))
+            json_suggestions(f, ",");
+        json_pool_stats(f, ",");
+        fprintf(f, "\n}\n");
+        fclose(f);
+    } else if (stats_file != NULL && *stats_file != '\0') {
+        fprintf(stderr, "Cannot write STATS_FILE %s\n", stats_file);
+    }
+    capture_unmap(&reader);
+    return ok ? 0 : 1;
+}
@@ -46,358 +46,319 @@
 
 #include "helper.h"
 
-void handle_memory_access(mem_access_t *ma, int tid) {
-    uint64_t addr = ma->addr, md_offset;
-    md_offset = (addr / GRAN) % host_metadata_len;
-    bool done = false;
-    m_packets.fetch_add(1);
-    unsigned delay = HOST_BASE_DELAY;
-    while (!done) {
-        uint64_t expected(access_map[md_offset].load());
-        uint64_t desired(LOCKED);
-        if (expected == desired) {
-            /* someone holds the lock --- backoff */
-            backoff(delay);
-            continue;
-        }
-
-        if (access_map[md_offset].compare_exchange_strong(expected, desired)) {
-            std::vector<uint64_t> *s;
-            /* Zero initialized, if not, meaning some address present! */
-            if (expected == 0) {
-                s = new std::vector<uint64_t>;
-                // (*s).reserve(UNIQ_THRESHOLD);
-            } else {
-                s = (std::vector<uint64_t>*)expected;
-            }
 
-            (*s).push_back(ma->info);
-            expected = (uint64_t)s;
-            if ((*s).size() > UNIQ_THRESHOLD) {
-                pthread_mutex_lock(&async_lock);
-                /* Insert offset */
-                cleaner_queue.insert(md_offset);
-                pthread_mutex_unlock(&async_lock);
-            }
-            /* Atomically write to it! */
-            access_map[md_offset].exchange(expected);
-            done = true;
-        } else {
-            /* someone got the lock --- backoff */
-            backoff(delay);
-        }
+/* Static fence table of the kernel of 'l', then the setup of the launch, see capture.h */
+void capture_launch(launch_t *l) {
+    kernel_info_t *k = l->kernel;
+    std::vector<capture_fence_t> fences;
+    std::string text = k->name;
+    for (auto &each: k->fence_map) {
+        capture_fence_t fence;
+        auto numbered = k->id_to_fence_map.find(each.first);
+        fence.id = each.first;
+        fence.is_redundant = each.second->is_redundant;
+        fence.numbered = numbered != k->id_to_fence_map.end();
+        fence.addr = fence.numbered ? numbered->second : 0;
+        std::string info = fence.numbered ? fence_to_lineinfo_map[fence.addr] : "";
+        fence.info_len = info.size();
+        text += info;
+        fences.push_back(fence);
     }
+    capture_kernel_t kernel;
+    kernel.kernel = std::find(kernels.begin(), kernels.end(), k) - kernels.begin();
+    kernel.epochs = k->epochs;
+    kernel.fences = fences.size();
+    kernel.name_len = k->name.size();
+    capture_part_t kernel_parts[] = {{&kernel, sizeof(kernel)},
+        {fences.data(), sizeof(capture_fence_t) * fences.size()}, {text.data(), text.size()}};
+    capture_write(&capture, CAPTURE_KERNEL, l->id, kernel_parts, 3);
+
+    std::vector<capture_alloc_t> allocations;
+    for (auto &record: allocation_records.live)
+        allocations.push_back({record.first, record.second.bound, record.second.owner});
+    capture_launch_t launch;
+    launch.kernel = kernel.kernel;
+    launch.epochs = l->epochs;
+    launch.tool_mode = tool_mode;
+    launch.stream_depth = stream_depth;
+    launch.warpsInGrid = l->dim.warpsInGrid;
+    launch.warpsPerBlock = l->dim.warpsPerBlock;
+    launch.blockDim = l->dim.blockDim;
+    launch.gridDim = l->dim.gridDim;
+    launch.ranges = l->ranges.size();
+    launch.shadow_len = l->shadow_len;
+    launch.allocations = allocations.size();
+    launch.allocs = allocation_records.allocs;
+    launch.frees = allocation_records.frees;
+    launch.stale = allocation_records.stale;
+    launch.peak = allocation_records.peak;
+    capture_part_t launch_parts[] = {{&launch, sizeof(launch)},
+        {l->ranges.data(), sizeof(shadow_range_t) * l->ranges.size()},
+        {allocations.data(), sizeof(capture_alloc_t) * allocations.size()}};
+    capture_write(&capture, CAPTURE_LAUNCH, l->id, launch_parts, 3);
 }
 
-/* All conditions have to be met for this to work:
-   1. If multi_block
-   2. If there are stores
-   3. If there are weak operations, or cta scoped operations
-If yes to all questions, all relevant epochs in access_map have to be utilized.
-    for store epochs, next one is useful, aka, release operation
-    for load epochs, previous one is useful, aka, acquire operation. */
-void process_access_info(int tid, allocation record) {
-    uint64_t per_thread, sidx, eidx;
-    /* Divide addresses in record into NUM_THREADS portions */
-    per_thread = (record.bound - record.base) / NUM_THREADS;
-
-    /* start and end address */
-    sidx = tid * per_thread + record.base;
-    if (tid == NUM_THREADS - 1)
-        eidx = record.bound;
-    else
-        eidx = (tid + 1) * per_thread + record.base;
-
-    /* traverse across allocated addresses */
-    for (uint64_t addr = sidx; addr < eidx; addr += GRAN) {
-        uint64_t i = (addr / GRAN) % host_metadata_len;
-
-        uint64_t md_offset = (addr / GRAN) % device_arguments.length;
-        uint64_t md = device_arguments.memory_meta[md_offset];
-        // print_md(md, addr);
-        if (getBit(md, POS_MB) && getBit(md, POS_ST)) {
-            if (DO_STREAM) {
-                /* get content from stream_meta */
-                uint64_t count = getBits(md, POS_CNT, SZ_CNT);
-                for (uint64_t j = 0; j < count && j < NUM_STREAM_TRACES; j++) {
-                    uint64_t _offset = md_offset + j * device_arguments.length;
-                    uint64_t trace = device_arguments.stream_meta[_offset];
-                    process_trace(trace);
-                }
-            }
-            /* Traverse the set! */
-            uint64_t possible_vector = access_map[i].load();
-            if (possible_vector != 0) {
-                std::vector<uint64_t> *s = (std::vector<uint64_t>*)possible_vector;
-                for (auto trace : *s) {
-                    process_trace(trace);
-                }
-            }
-        }
+/* Host copies of the device metadata of 'l', once staged */
+void capture_staged(launch_t *l) {
+    capture_staged_t staged;
+    memset(&staged, 0, sizeof(staged));
+    staged.analyzed = l->staged_fence_meta != NULL;
+    staged.worklist = l->worklist;
+    staged.kernel_ms = l->kernel_ms;
+    std::vector<capture_part_t> parts;
+    parts.push_back({&staged, sizeof(staged)});
+    if (staged.analyzed) {
+        staged.fence_words = (uint64_t)l->dim.warpsInGrid * l->epochs;
+        parts.push_back({l->staged_fence_meta, sizeof(uint32_t) * staged.fence_words});
     }
-}
-
-/* iterate over all allocations */
-void iterate_allocations(int tid) {
-    if (DO_ANALYZE) {
-        for (auto each: allocation_records) {
-            process_access_info(tid, each);
+    if (staged.analyzed && l->worklist) {
+        staged.candidates = l->candidates;
+        parts.push_back({l->staged_worklist, sizeof(uint64_t) * l->candidates});
+        parts.push_back({l->staged_candidates, sizeof(uint32_t) * l->candidates * candidate_words()});
+    }
+    for (auto &each: l->staged_meta) {
+        parts.push_back({each.memory_meta, sizeof(uint32_t) * each.count});
+        if (each.stream_meta != NULL) {
+            staged.stream = 1;
+            parts.push_back({each.stream_meta, sizeof(uint32_t) * each.count * stream_depth});
         }
     }
+    capture_write(&capture, CAPTURE_STAGED, l->id, parts.data(), parts.size());
 }
 
-void worker(int id) {
-
-    int jobs_handled = 0;
-    while (1) {
-
-        int i = JOB_NONE;
-        pthread_mutex_lock(&job_lock);
-        if (job_queue.size() != 0) {
-            i = job_queue.back();
-            job_queue.pop_back();
-        }
-        pthread_mutex_unlock(&job_lock);
-
-        if (i != JOB_NONE) {
-            channel_t *chan = (channel_t*)jobs[i].buffer;
-            /* Each worker-thread figures out their own content */
-            uint32_t num_entries = jobs[i].job_amount / sizeof(channel_t);
-            uint32_t start_entry = 0;
-            // printf("%d: Got job of size: %u (%uB)\n", id, num_entries, jobs[i].job_amount);
-
-            while (start_entry < num_entries) {
-                channel_t *c = &chan[start_entry];
-                // printf("%d: processing %u @%p\n", id, start_entry, c);
-                if (c->type == TYPE_MEM) {
-                    handle_memory_access(&c->ma, id);
-                }
-                start_entry += 1;
-            }
-
-            /* Push back to free queue */
-            pthread_mutex_lock(&free_lock);
-            free_queue.push_back(i);
-            pthread_mutex_unlock(&free_lock);
-
-            // printf("%d: %d done, waiting .... status\n", id, i);
-            jobs_handled += 1;
-        } else if (last_job.load() == JOB_NONE) {
-            /* no job in queue and last job seen by distributor, break */
-            // printf("%d: all jobs done ... exiting\n", id);
-            break;
-        }
+/* Copy 'count' words of a device table, starting at word 'first' */
+void stage_range(uint32_t *dst, uint32_t *table, uint64_t first, uint64_t count) {
+    uint64_t done = 0;
+    while (done < count) {
+        uint64_t n = min(count - done, (uint64_t)(STAGE_CHUNK / sizeof(uint32_t)));
+        cudaMemcpyAsync(dst + done, table + first + done, n * sizeof(uint32_t), cudaMemcpyDeviceToHost, stream);
+        done += n;
     }
-
-    // printf("%d: finished %d jobs ... moving to detection. Wait till dedup reaches barrier\n", id, jobs_handled);
-    pthread_barrier_wait(&barrier);
-    // avoid races on 'detection' var ... make only 1 thread update it
-    if (id == 0)
-        detection.start();
-    /* Parallelize detection logic */
-    iterate_allocations(id);
-    // jobs being equally allocated among workers, they are expected to finish together
-    if (id == 0)
-        detection.end();
 }
 
-void set_meta(int id, allocation record) {
-    /* only 1 thread does this! Avoid launching too many tasks! */
-    if (id != 0)
+/* Pinned host memory the device metadata of the launch in each slot is staged into. Kept
+   across launches and only grown, so that staging copies are DMA transfers the host thread
+   does not take part in, without pinning pages anew for every launch */
+typedef struct {
+    uint8_t *base;
+    uint64_t size, used;
+} staging_area_t;
+staging_area_t staging_areas[LAUNCH_SLOTS];
+
+/* Room for 'bytes' of metadata in the area of the slot of 'l'. The launch before it in the
+   slot is done, hence so are its staged copies */
+void staging_reserve(launch_t *l, uint64_t bytes) {
+    staging_area_t *area = &staging_areas[l->slot];
+    area->used = 0;
+    if (bytes <= area->size)
         return;
-
-    uint64_t sidx, eidx, size, length = device_arguments.length;
-    uint32_t *base = device_arguments.memory_meta, *end;
-    sidx = (record.base / GRAN) % length;
-    eidx = (record.bound / GRAN) % length;
-    if (sidx > eidx) {
-        /* first half */
-        size = (uint64_t)(base + eidx) - (uint64_t)base;
-        cudaMemsetAsync(device_arguments.memory_meta, 0, size, stream);
-        end = base + length;
-        /* second half */
-        size = (uint64_t)end - (uint64_t)(base + sidx);
-        cudaMemsetAsync(device_arguments.memory_meta + sidx, 0, size, stream);
-    } else {
-        size = record.bound - record.base;
-        cudaMemsetAsync(device_arguments.memory_meta + sidx, 0, size, stream);
+    if (area->base != NULL)
+        cudaFreeHost(area->base);
+    pinned_mem -= area->size;
+    area->size = max(bytes, 2 * area->size);
+    if (cudaHostAlloc((void **)&area->base, area->size, cudaHostAllocDefault) != cudaSuccess) {
+        fprintf(stderr, "Cannot pin %lu bytes to stage device metadata\n", area->size);
+        exit(1);
     }
+    pinned_mem += area->size;
 }
 
-void *async_zero(void *arg) {
-    thread_data_t *data = (thread_data_t *)arg;
-    int tid = data->tid;
-    uint64_t per_thread, s_addr, e_addr, sidx, eidx, size;
-
-    /* Wait till the instrumenation completes. Syncing with main thread (which does instrumenttion) */
-    pthread_barrier_wait(&barrier);
-
-    for (auto record: allocation_records) {
-        per_thread = (record.bound - record.base) / NUM_THREADS;
-
-        /* start and end address */
-        s_addr = tid * per_thread + record.base;
-        if (tid == NUM_THREADS - 1)
-            e_addr = record.bound;
-        else
-            e_addr = (tid + 1) * per_thread + record.base;
-
-        sidx = (s_addr / GRAN) % host_metadata_len;
-        eidx = (e_addr / GRAN) % host_metadata_len;
-        if (sidx > eidx) {
-            std::atomic<uint64_t> *end = access_map + host_metadata_len;
-            /* first half */
-            size = (uint64_t)(access_map + eidx) - (uint64_t)access_map;
-            memset((uint64_t*) access_map, 0, size);
-            /* second half */
-            size = (uint64_t)end - (uint64_t)(access_map + sidx);
-            memset((uint64_t*) access_map + sidx, 0, size);
-        } else {
-            memset((uint64_t*) access_map + sidx, 0, e_addr - s_addr);
-        }
-        set_meta(tid, record);
-    }
-    /* Wait till setup is complete. Syncing with min thread (which does device metadata setup) */
-    pthread_barrier_wait(&barrier);
-
-    worker(tid);
-    pthread_exit(NULL);
+/* Next 'count' items of the area of the slot of 'l', cache-line aligned */
+template <typename T>
+T *staging_take(launch_t *l, uint64_t count) {
+    staging_area_t *area = &staging_areas[l->slot];
+    T *p = (T *)(area->base + area->used);
+    area->used += (sizeof(T) * count + 63) & ~(uint64_t)63;
+    assert(area->used <= area->size);
+    return p;
 }
 
-void *deduplicate(void *arg) {
-
-    unsigned long long cleaner_jobs = 0, cleaned = 0;
-    while (1) {
-        if (last_job.load() == JOB_NONE)
-            break;
-
-        if (cleaner_queue.size() == 0)
-            continue;
-
-        pthread_mutex_lock(&async_lock);
-        cleaner_jobs++;
-        std::unordered_set<uint64_t> l_job = cleaner_queue;
-        cleaner_queue.clear();
-        pthread_mutex_unlock(&async_lock);
-        // printf("cleaner: got job of size: %lu\n", l_job.size());
-        for (uint64_t s: l_job) {
-            /* Set has offsets into access_map, no need to recalculate */
-            bool done = false;
-            unsigned delay = HOST_BASE_DELAY;
-            while (!done) {
-                uint64_t expected(access_map[s].load());
-                uint64_t desired(LOCKED);
-                if (expected == desired) {
-                    /* someone holds the lock --- backoff */
-                    backoff(delay);
-                    continue;
-                }
-
-                if (access_map[s].compare_exchange_strong(expected, desired)) {
-                    std::vector<uint64_t> *se = (std::vector<uint64_t>*)expected;
-
-                    std::sort((*se).begin(), (*se).end());
-                    (*se).erase(std::unique((*se).begin(), (*se).end()), (*se).end());
-
-                    expected = (uint64_t)se;
-                    cleaned++;
-                    /* Atomically write to it! */
-                    access_map[s].exchange(expected);
-                    done = true;
-                } else {
-                    /* someone got the lock --- backoff */
-                    backoff(delay);
-                }
+/* Bulk copy device metadata of every allocation to the host, so detection does not
+   fault on managed memory granule by granule. Kernel must be over. */
+void stage_device_metadata(launch_t *l) {
+    if (!DO_ANALYZE(tool_mode) || l->kernel->resolved.load()) {
+        if (capture.file != NULL)
+            capture_staged(l);
+        l->staged.store(1);
+        return;
+    }
+    staging.start();
+    uint64_t begin = stats_now_ns();
+    uint64_t fence_words = (uint64_t)l->dim.warpsInGrid * l->epochs;
+    int words = candidate_words();
+
+    /* only the candidate granules, unless the device queued more than the worklist holds.
+       Their count sizes what is staged, so it comes first */
+    unsigned long long queued = 0;
+    cudaMemcpyAsync(&queued, device_arguments.worklist_len, sizeof(queued), cudaMemcpyDeviceToHost, stream);
+    cudaStreamSynchronize(stream);
+    l->worklist = queued <= device_arguments.worklist_cap;
+    /* 64 bytes of alignment slack per buffer */
+    uint64_t bytes = sizeof(uint32_t) * fence_words + 64;
+    if (l->worklist) {
+        bytes += (sizeof(uint64_t) + sizeof(uint32_t) * words) * queued + 128;
+    } else {
+        int per_granule = 1 + (DO_STREAM(tool_mode) ? stream_depth : 0);
+        for (auto each: l->ranges)
+            bytes += sizeof(uint32_t) * (each.bound - each.base) * per_granule + 128;
+    }
+    staging_reserve(l, bytes);
+    l->staged_pinned = true;
+
+    l->staged_fence_meta = staging_take<uint32_t>(l, fence_words);
+    cudaMemcpyAsync(l->staged_fence_meta, l->fence_meta, sizeof(uint32_t) * fence_words, cudaMemcpyDeviceToHost, stream);
+    staged_mem += sizeof(uint32_t) * fence_words;
+
+    if (l->worklist) {
+        l->candidates = queued;
+        l->staged_worklist = staging_take<uint64_t>(l, queued);
+        l->staged_candidates = staging_take<uint32_t>(l, queued * words);
+        cudaMemcpyAsync(l->staged_worklist, device_arguments.worklist, sizeof(uint64_t) * queued,
+                        cudaMemcpyDeviceToHost, stream);
+        stage_range(l->staged_candidates, device_arguments.candidates, 0, queued * words);
+        staged_mem += (sizeof(uint64_t) + sizeof(uint32_t) * words) * queued;
+        candidates_total += queued;
+    } else {
+        worklist_fallbacks++;
+        for (auto each: l->ranges) {
+            staged_meta_t staged;
+            staged.first = each.shadow;
+            staged.count = each.bound - each.base;
+            staged.memory_meta = staging_take<uint32_t>(l, staged.count);
+            stage_range(staged.memory_meta, device_arguments.memory_meta, staged.first, staged.count);
+            staged_mem += sizeof(uint32_t) * staged.count;
+            staged.stream_meta = NULL;
+            if (DO_STREAM(tool_mode) && stream_depth > 0) {
+                staged.stream_meta = staging_take<uint32_t>(l, staged.count * stream_depth);
+                stage_range(staged.stream_meta, device_arguments.stream_meta, staged.first * stream_depth,
+                    staged.count * stream_depth);
+                staged_mem += sizeof(uint32_t) * staged.count * stream_depth;
             }
+            l->staged_meta.push_back(staged);
         }
     }
-    /* Participate in the barrier. Syncing with worker threads (waiting after processing all packets) */
-    pthread_barrier_wait(&barrier);
-    // printf("[Cleaner] Clean jobs: %llu, Cleaned offsets: %llu .... exiting\n", cleaner_jobs, cleaned);
-    pthread_exit(NULL);
+    cudaStreamSynchronize(stream);
+    staging.end();
+    hist_add(&pipeline_stats.staging_us, (stats_now_ns() - begin) / 1000);
+    if (capture.file != NULL)
+        capture_staged(l);
+    /* device metadata may now be reset for the next launch */
+    l->staged.store(1);
 }
 
-void prefetch_device_metadata() {
-    /* use stream to prefetch fence content */
-    cudaMemPrefetchAsync(device_arguments.fence_meta, sizeof(uint32_t) * kernel_dimension.warpsInGrid * epoch, cudaCpuDeviceId, stream);
-    uint64_t base, bound, sidx, eidx, size;
-    /* prefetch memory metadata */
-    for (auto each: allocation_records) {
-        base = each.base;
-        bound = each.bound;
-
-        sidx = (base / GRAN) % device_arguments.length;
-        eidx = (bound / GRAN) % device_arguments.length;
-        /* if eidx < sidx, requires roundabout */
-        if (eidx < sidx) {
-            uint32_t* end = device_arguments.memory_meta + host_metadata_len;
-            size = (uint64_t)end - (uint64_t)(device_arguments.memory_meta + sidx);
-            cudaMemPrefetchAsync(device_arguments.memory_meta + sidx, size, cudaCpuDeviceId, stream);
-            size = (uint64_t)(device_arguments.memory_meta + eidx) - (uint64_t)device_arguments.memory_meta;
-            cudaMemPrefetchAsync(device_arguments.memory_meta, size, cudaCpuDeviceId, stream);
-        } else {
-            cudaMemPrefetchAsync(device_arguments.memory_meta + sidx, bound - base, cudaCpuDeviceId, stream);
-        }
+/* Fill job with the next message pass from the channel, returns its size.
+   In zero-copy mode the job points to the channel segment itself */
+uint32_t receive(volatile job_info_t &job) {
+    if (!zero_copy)
+        return channel_host.recv(job.buffer, CHANNEL_SIZE);
+
+    uint32_t nbytes = 0;
+    int seg;
+    uint8_t *segment = channel_host.recv_segment(nbytes, seg);
+    if (segment != NULL) {
+        job.buffer = (char *)segment;
+        job.segment = seg;
     }
+    return nbytes;
 }
 
 void *distributor(void *) {
+    /* free buffer held by the distributor, kept across iterations until filled */
+    int i = JOB_NONE;
+    int seg;
+    /* buffers are taken from the nodes in turn, spreading the packets over them */
+    int next_node = 0;
+    /* launch whose packets are being received, launches are received in order */
+    launch_t *cur = NULL;
     while(recv_thread_started) {
 
-        /* Spin-lock to check size */
-        pthread_mutex_lock(&free_lock);
-        /* It's ok to do this while holding lock as the procedure is short */
-        if (free_queue.size() != 0) {
-            int i = free_queue.back();
+        if (cur == NULL) {
+            int slot;
+            if (ring_pop(&launch_ring, slot))
+                cur = launches[slot];
+        }
+
+        if (i == JOB_NONE)
+            i = take_job(next_node);
+
+        if (i != JOB_NONE) {
             uint32_t num_recv_bytes = 0;
             /* Boss thread --- waits for generated data to process */
-            if (recv_thread_receiving && (num_recv_bytes = channel_host.recv(jobs[i].buffer, CHANNEL_SIZE)) > 0) {
+            if (cur != NULL && (num_recv_bytes = receive(jobs[i])) > 0) {
                 message_passes += 1;
-                /* Don't have to reset this! */
-                if (message_passes == 1)
-                    message.start();
-
-                /* Write job information */
-                jobs[i].job_amount = num_recv_bytes;
-                // printf("Boss: set up job %d\n", i);
-
-                pthread_mutex_lock(&job_lock);
-                /* Remove from free queue */
-                free_queue.pop_back();
-                /* Push to job queue */
-                job_queue.push_back(i);
-                pthread_mutex_unlock(&job_lock);
+                channel_bytes += num_recv_bytes;
 
-                /* Check if it was last message */
+                /* a stale or foreign record would be decoded as garbage, stop here */
+                if (!channel_pass_valid(jobs[i].buffer, num_recv_bytes)) {
+                    fprintf(stderr, "Channel message pass of %u bytes is not in wire format v%d\n",
+                        num_recv_bytes, WIRE_VERSION);
+                    exit(1);
+                }
+                /* Check if it was last message, before handing the buffer over */
                 char *recv = jobs[i].buffer;
                 recv = recv + num_recv_bytes - sizeof(channel_t);
                 channel_t *possible_last_message = (channel_t*)recv;
-                if (possible_last_message->type == TYPE_INV) {
-                    /* distributor can now return, nothing more to do */
-                    recv_thread_receiving = false;
-                    last_job.exchange(JOB_NONE);
-                    /* No break as lock needs to be released */
-                    message.end();
+                bool is_last = (channel_type(*possible_last_message) == TYPE_INV);
+                if (capture.file != NULL) {
+                    capture_part_t part = {jobs[i].buffer, num_recv_bytes};
+                    capture_write(&capture, CAPTURE_BUFFER, cur->id, &part, 1);
                 }
-            } else if (!recv_thread_receiving) {
+
+                /* Push to job queue */
+                queue_job(i, cur, num_recv_bytes);
+                i = JOB_NONE;
+
+                if (is_last) {
+                    /* kernel is over, stage its metadata while workers drain the jobs */
+                    stage_device_metadata(cur);
+                    /* analysis starts with the last job of the launch */
+                    launch_put(cur);
+                    cur = NULL;
+                }
+            } else if (cur == NULL) {
                 /* Re executing instrumented kernel can generate messages. If not processed
                    can block the kernel. Process them by putting content in a dummy buffer. */
-                num_recv_bytes = channel_host.recv(&dummy_buffer, CHANNEL_SIZE);
+                if (!zero_copy)
+                    num_recv_bytes = channel_host.recv(&dummy_buffer, CHANNEL_SIZE);
+                else if (channel_host.recv_segment(num_recv_bytes, seg) != NULL)
+                    channel_host.release(seg);
             }
         }
-        /* Release lock */
-        pthread_mutex_unlock(&free_lock);
     }
-    // prefetch_device_metadata();
     pthread_exit(NULL);
 }
 
 
+/* Compact the metadata of the 'count' queued candidates, so that only they are staged */
+__global__ void gather_candidates(uint64_t count, int words) {
+    uint64_t e = blockIdx.x * (uint64_t)blockDim.x + threadIdx.x;
+    if (e >= count)
+        return;
+    uint64_t i = device_arguments.worklist[e];
+    uint32_t *record = device_arguments.candidates + e * words;
+    record[0] = device_arguments.memory_meta[i];
+    for (int j = 1; j < words; j++)
+        record[j] = device_arguments.stream_meta[i * device_arguments.stream_depth + j - 1];
+}
+
+/* Launched once the instrumented kernel is over, nothing updates the metadata anymore */
+void compact_candidates() {
+    if (!DO_ANALYZE(tool_mode))
+        return;
+    unsigned long long queued = 0;
+    cudaMemcpy(&queued, device_arguments.worklist_len, sizeof(queued), cudaMemcpyDeviceToHost);
+    /* overflowing launches are staged whole */
+    if (queued == 0 || queued > device_arguments.worklist_cap)
+        return;
+    int threads = 256;
+    gather_candidates<<<(queued + threads - 1) / threads, threads>>> (queued, candidate_words());
+}
+
 __global__ void flush_channel() {
     /* push memory access with negative cta id to communicate the kernel is
      * completed */
     channel_t c;
-    c.type = TYPE_INV;
+    make_channel(c, 0, 0, TYPE_INV);
     device_arguments.channel_dev->push(&c, sizeof(channel_t));
 
     /* flush channel */
@@ -405,9 +366,29 @@ __global__ void flush_channel() {
 }
 
 
+/* Device functions of the selected mode, inserted before instrumented instructions */
+std::string mem_func, fence_func;
+
 /* Set used to avoid re-instrumenting the same functions multiple times */
 std::unordered_set<CUfunction> already_instrumented;
-void instrument_function_if_needed(CUcontext ctx, CUfunction func) {
+/* one past the last fence epoch instrumented into each function */
+std::unordered_map<CUfunction, int> function_epochs;
+kernel_info_t *instrument_function_if_needed(CUcontext ctx, CUfunction func) {
+    kernel_info_t *&k = kernel_infos[func];
+    if (k == NULL) {
+        k = new kernel_info_t();
+        k->name = nvbit_get_func_name(ctx, func);
+        k->epochs = 0;
+        k->launches = 0;
+        k->resolved.store(0);
+        k->traced_ms = 0;
+        kernels.push_back(k);
+    }
+    /* fences are numbered per kernel */
+    int &epoch = k->epochs;
+    std::unordered_map<int, fence_info*> &fence_map = k->fence_map;
+    std::unordered_map<int, uint64_t> &id_to_fence_map = k->id_to_fence_map;
+
     /* Get related functions of the kernel (device function that can be
      * called by the kernel) */
     std::vector<CUfunction> related_functions = nvbit_get_related_functions(ctx, func);
@@ -420,6 +401,10 @@ void instrument_function_if_needed(CUcontext ctx, CUfunction func) {
         /* "recording" function was instrumented, if set insertion failed
          * we have already encountered this function */
         if (!already_instrumented.insert(f).second) {
+            /* Device function shared with a kernel instrumented earlier keeps the fence numbering
+               of that kernel. Fence state has to cover those epochs, their traces are attributed
+               to this kernel's fences */
+            epoch = max(epoch, function_epochs[f]);
             continue;
         }
 
@@ -461,7 +446,7 @@ void instrument_function_if_needed(CUcontext ctx, CUfunction func) {
             /* Need only device scope for now, not useful to keep track of block scope */
             if(isFence(instr) && getScope(instr) == SCOPE_GPU) {
                 /* Add some instrumentation information! */
-                nvbit_insert_call(instr, "instrument_fence", IPOINT_BEFORE);
+                nvbit_insert_call(instr, fence_func.c_str(), IPOINT_BEFORE);
                 /* predicate value */
                 nvbit_add_call_arg_guard_pred_val(instr);
                 /* epoch value */
@@ -506,7 +491,7 @@ void instrument_function_if_needed(CUcontext ctx, CUfunction func) {
                     || instr->getMemorySpace() == InstrType::MemorySpace::GLOBAL)) {
                     /* insert call to the instrumentation function with its
                      * arguments */
-                    nvbit_insert_call(instr, "instrument_mem", IPOINT_BEFORE);
+                    nvbit_insert_call(instr, mem_func.c_str(), IPOINT_BEFORE);
                     /* predicate value */
                     nvbit_add_call_arg_guard_pred_val(instr);
                     /* memory reference 64 bit address */
@@ -534,12 +519,19 @@ void instrument_function_if_needed(CUcontext ctx, CUfunction func) {
         }
         /* Inserting final one, KERNEL_END */
         fence_map[epoch] = new fence_info(epoch, !memory_between);
+        function_epochs[f] = epoch;
     }
+    /* epochs reached through shared device functions only */
+    for (int e = -1; e <= epoch; e++) {
+        if (fence_map.find(e) == fence_map.end())
+            fence_map[e] = new fence_info(e, false);
+    }
+    return k;
 }
 
 
 void set_allocations(nvbit_api_cuda_t cbid, void *params) {
-    uint64_t local_base, local_bound;
+    uint64_t local_base, local_bound, owner = 0;
     setup.start();
     switch(cbid) {
         case API_CUDA_cuMemAlloc_v2: {
@@ -557,75 +549,207 @@ void set_allocations(nvbit_api_cuda_t cbid, void *params) {
         case API_CUDA_cuMemAllocPitch_v2: {
             cuMemAllocPitch_v2_params *p3 = (cuMemAllocPitch_v2_params *)params;
             local_base = (uint64_t)*p3->dptr;
-            local_bound = (uint64_t)*p3->dptr + (p3->WidthInBytes * p3->Height);
+            /* rows are *pPitch bytes apart, not WidthInBytes */
+            local_bound = (uint64_t)*p3->dptr + (*p3->pPitch * p3->Height);
             break;
         }
         case API_CUDA_cuModuleGetGlobal_v2: {
             cuModuleGetGlobal_v2_params_st *p4 = (cuModuleGetGlobal_v2_params_st *)params;
-            local_base = (uint64_t)*p4->dptr;
-            /* HACK: size for global allocations not available. Correct way is (uint64_t)*(p4->bytes) */
-            local_bound = (uint64_t)*p4->dptr + NUM_THREADS * GRAN * 2;
+            CUdeviceptr dptr = 0;
+            size_t bytes = 0;
+            if (p4->dptr != NULL && p4->bytes != NULL) {
+                dptr = *p4->dptr;
+                bytes = *p4->bytes;
+            } else {
+                /* either out-param may be NULL (e.g., size-only queries), look both up again */
+                skip_flag = true;
+                CUresult found = cuModuleGetGlobal_v2(&dptr, &bytes, p4->hmod, p4->name);
+                skip_flag = false;
+                if (found != CUDA_SUCCESS) {
+                    setup.end();
+                    return;
+                }
+            }
+            local_base = (uint64_t)dptr;
+            local_bound = (uint64_t)dptr + bytes;
+            /* globals go away with their module */
+            owner = (uint64_t)p4->hmod;
             break;
         }
         default:
+            setup.end();
             return;
     }
-    allocation_records.emplace_back(local_base, local_bound);
-    app_mem += (local_bound - local_base);
+    registry_add(&allocation_records, local_base, local_bound, owner);
+    /* trackers report the most ever live at once */
+    app_mem = allocation_records.peak;
     // for in-GPU metadata, 4B per each 4B addr
-    meta_mem += (local_bound - local_base);
-    // for in-GPU trace, NUM_STREAM_TRACES * 4B per each 4B addr (only when enabled)
-    if (DO_STREAM)
-        meta_mem += ((local_bound - local_base) * NUM_STREAM_TRACES);
+    meta_mem = app_mem;
+    // for in-GPU trace, stream_depth * 4B per each 4B addr (only when enabled)
+    if (DO_STREAM(tool_mode))
+        meta_mem += app_mem * stream_depth;
+    setup.end();
+}
+
+void release_allocations(nvbit_api_cuda_t cbid, void *params) {
+    setup.start();
+    switch(cbid) {
+        case API_CUDA_cuMemFree_v2:
+            registry_remove(&allocation_records, (uint64_t)((cuMemFree_v2_params *)params)->dptr);
+            break;
+        case API_CUDA_cuMemFree:
+            registry_remove(&allocation_records, (uint64_t)((cuMemFree_params *)params)->dptr);
+            break;
+        case API_CUDA_cuModuleUnload:
+            registry_remove_owner(&allocation_records, (uint64_t)((cuModuleUnload_params *)params)->hmod);
+            break;
+        default:
+            break;
+    }
     setup.end();
 }
 
 
-void set_dimension(cuLaunchKernel_params *p) {
-    kernel_dimension.blockDim = p->blockDimX * p->blockDimY * p->blockDimZ;
-    kernel_dimension.warpsPerBlock = roundUp(kernel_dimension.blockDim, WARP_SIZE);
-    kernel_dimension.gridDim = p->gridDimX * p->gridDimY * p->gridDimZ * kernel_dimension.blockDim;
-    kernel_dimension.warpsInGrid = roundUp(kernel_dimension.gridDim, WARP_SIZE);
+void set_dimension(launch_t *l, cuLaunchKernel_params *p) {
+    l->dim.blockDim = p->blockDimX * p->blockDimY * p->blockDimZ;
+    l->dim.warpsPerBlock = roundUp(l->dim.blockDim, WARP_SIZE);
+    l->dim.gridDim = p->gridDimX * p->gridDimY * p->gridDimZ * l->dim.blockDim;
+    /* warps are numbered block by block (see instrument_fence_impl), a block may end with a partial warp */
+    l->dim.warpsInGrid = (l->dim.gridDim / l->dim.blockDim) * l->dim.warpsPerBlock;
     /* Set information that can be sent to instrumented device functions */
-    device_arguments.threads_per_block = kernel_dimension.blockDim;
-    device_arguments.threads = kernel_dimension.gridDim;
+    device_arguments.threads_per_block = l->dim.blockDim;
+    device_arguments.threads = l->dim.gridDim;
 }
 
 
 
-void set_sampling_meta() {
-    if (!DO_SAMPLING)
+void set_sampling_meta(launch_t *l) {
+    l->exec_count = NULL;
+    device_arguments.exec_count = NULL;
+    device_arguments.sample_seed = sample_seed;
+    device_arguments.sample_period = sample_period;
+    device_arguments.sample_policy = sample_policy;
+    if (!DO_SAMPLING(tool_mode) || sample_policy != SAMPLE_HASH)
         return;
 
-    /* Requires kernel_dimension to be set! */
-    srand(time(0));
-    uint64_t blocks = (kernel_dimension.gridDim / kernel_dimension.blockDim) + 1;
-    /* Set up metadata for instr-thread level sampling, no need to instrument this, skipping */
+    /* Requires the launch dimension to be set! One count per thread, whatever the number of instructions */
+    uint64_t bytes = sizeof(uint32_t) * l->dim.gridDim;
     skip_flag = true;
-    cudaMallocManaged((void**)&device_arguments.random_meta, sizeof(char) * blocks);
-    samp_mem += sizeof(char) * blocks;
-    for (uint64_t i = 0; i < blocks; i++) {
-        /* create a random number between SAMP_BASE and PER_THREAD_PER_INSTR */
-        device_arguments.random_meta[i] = rand() % (PER_THREAD_PER_INSTR - SAMP_BASE + 1) + SAMP_BASE;
-    }
-    cudaMallocManaged((void**)&device_arguments.sampling_meta, sizeof(char) * kernel_dimension.gridDim * static_counter);
-    samp_mem += sizeof(char) * kernel_dimension.gridDim * static_counter;
+    cudaMalloc((void**)&l->exec_count, bytes);
+    /* memory trackers report the largest launch */
+    samp_mem = max(samp_mem, (double)bytes);
     // memset async as the driver launches the kernel after these operations are over
-    cudaMemsetAsync(device_arguments.sampling_meta, 0, sizeof(char) * kernel_dimension.gridDim * static_counter, stream);
+    cudaMemsetAsync(l->exec_count, 0, bytes, stream);
+    device_arguments.exec_count = l->exec_count;
     skip_flag = false;
 }
 
 
-void set_fence_meta() {
-    int entries = kernel_dimension.warpsInGrid;
+void set_fence_meta(launch_t *l) {
+    int entries = l->dim.warpsInGrid;
+    uint64_t bytes = sizeof(uint32_t) * entries * l->epochs;
     skip_flag = true;
     // Should consider a different multiple here if the threads_per_block is not a multiple of WARP_SIZE
-    cudaMallocManaged((void**)&device_arguments.fence_meta, sizeof(uint32_t) * entries * epoch);
-    fence_mem +=  sizeof(uint32_t) * entries * epoch;
+    cudaMallocManaged((void**)&l->fence_meta, bytes);
+    /* fresh for every launch */
+    cudaMemsetAsync(l->fence_meta, 0, bytes, stream);
+    fence_mem = max(fence_mem, (double)bytes);
+    device_arguments.fence_meta = l->fence_meta;
     device_arguments.warps_per_grid = entries;
+    /* host index over fence_meta, built after the kernel */
+    l->fence_index_warps = (l->dim.gridDim / l->dim.blockDim) * l->dim.warpsPerBlock;
+    l->fence_index = (epoch_mask_t *)calloc(l->fence_index_warps * WARP_SIZE, sizeof(epoch_mask_t));
     skip_flag = false;
 }
 
+/* Device buffers of a launch, no longer needed once its metadata is staged */
+void release_device_buffers(launch_t *l) {
+    skip_flag = true;
+    cudaFree(l->fence_meta);
+    if (l->exec_count)
+        cudaFree(l->exec_count);
+    skip_flag = false;
+}
+
+/* Shadow layout of the allocations live now: granule ranges in address order, the ones sharing
+   a granule merged, and packed one after the other in the shadow region */
+void build_shadow(launch_t *l) {
+    l->shadow_len = 0;
+    for (auto &record: allocation_records.live) {
+        shadow_range_t each;
+        each.base = record.first / GRAN;
+        each.bound = roundUp(record.second.bound, GRAN);
+        if (!l->ranges.empty() && each.base <= l->ranges.back().bound) {
+            shadow_range_t &last = l->ranges.back();
+            if (each.bound > last.bound) {
+                l->shadow_len += each.bound - last.bound;
+                last.bound = each.bound;
+            }
+            continue;
+        }
+        each.shadow = l->shadow_len;
+        l->shadow_len += each.bound - each.base;
+        l->ranges.push_back(each);
+    }
+
+    /* the access_map of the slot is empty, and unused until the launch is registered */
+    amap_grow(l->access_map, l->shadow_len);
+}
+
+/* Upload the shadow layout of the launch, and reset its metadata. Device buffers only grow,
+   the kernel of the last launch is over by now */
+void set_shadow(launch_t *l) {
+    skip_flag = true;
+    if (l->shadow_len > shadow_capacity) {
+        shadow_capacity = max(l->shadow_len, 2 * shadow_capacity);
+        cudaFree(device_arguments.memory_meta);
+        cudaMalloc((void**)&device_arguments.memory_meta, sizeof(uint32_t) * shadow_capacity);
+        if (DO_STREAM(tool_mode) && stream_depth > 0) {
+            cudaFree(device_arguments.stream_meta);
+            cudaMalloc((void**)&device_arguments.stream_meta, sizeof(uint32_t) * shadow_capacity * stream_depth);
+        }
+    }
+    uint64_t worklist_cap = min(l->shadow_len, max((uint64_t)WORKLIST_MIN, l->shadow_len / WORKLIST_RATIO));
+    if (worklist_cap > worklist_capacity) {
+        worklist_capacity = max(worklist_cap, 2 * worklist_capacity);
+        cudaFree(device_arguments.worklist);
+        cudaFree(device_arguments.candidates);
+        cudaMalloc((void**)&device_arguments.worklist, sizeof(uint64_t) * worklist_capacity);
+        cudaMalloc((void**)&device_arguments.candidates, sizeof(uint32_t) * worklist_capacity * candidate_words());
+    }
+    device_arguments.worklist_cap = worklist_cap;
+    cudaMemsetAsync(device_arguments.worklist_len, 0, sizeof(unsigned long long), stream);
+    if (l->ranges.size() > ranges_capacity) {
+        ranges_capacity = max((uint32_t)l->ranges.size(), 2 * ranges_capacity);
+        cudaFree(device_arguments.ranges);
+        cudaMalloc((void**)&device_arguments.ranges, sizeof(shadow_range_t) * ranges_capacity);
+    }
+    cudaMemcpyAsync(device_arguments.ranges, l->ranges.data(), sizeof(shadow_range_t) * l->ranges.size(),
+                    cudaMemcpyHostToDevice, stream);
+    device_arguments.num_ranges = l->ranges.size();
+    device_arguments.length = l->shadow_len;
+    /* stream_meta needs no reset, the count in memory_meta tells which traces are valid */
+    cudaMemsetAsync(device_arguments.memory_meta, 0, sizeof(uint32_t) * l->shadow_len, stream);
+    /* sync zeroing */
+    cudaStreamSynchronize(stream);
+    skip_flag = false;
+}
+
+/* Set up the state of a new launch of kernel 'k'. The last launch has to be staged, as
+   device metadata is reset for the new one */
+launch_t *begin_launch(kernel_info_t *k) {
+    launch_t *last = launches[(launches_traced + LAUNCH_SLOTS - 1) % LAUNCH_SLOTS];
+    if (last != NULL) {
+        while (!last->staged.load())
+            std::this_thread::yield();
+        release_device_buffers(last);
+    }
+    launch_t *l = open_launch(k);
+    /* snapshot, the application may allocate while the launch is analyzed */
+    build_shadow(l);
+    return l;
+}
+
 /*****************************************************
  *                                                   *
  *  NVBIT Instrumentation Interface Calls Below      *
@@ -643,7 +767,60 @@ void nvbit_at_init() {
     GET_VAR_INT(timeout, "TIMEOUT", 0, "Time in seconds after which to quit detection (0 = never; def = 0)");
     GET_VAR_INT(debug_out, "DEBUG", 0, "Output debug info (def = 0)");
     GET_VAR_STR(kernel_id, "KERNELID", "Specific kernel that needs to be traced (def = all)");
-    GET_VAR_INT(instance, "INSTANCE", 1, "The dynamic instance of the KERNELID to be traced (def = first)");
+    GET_VAR_INT(instance, "INSTANCE", 1, "The dynamic instance of the KERNELID to be traced (0 = all; def = first)");
+    std::string policy_name = "hash";
+    GET_VAR_STR(policy_name, "SAMPLE_POLICY", "Execution sampling: hash (1 in SAMPLE_PERIOD accesses of each thread) or cta (every access of about 1 in SAMPLE_PERIOD blocks) (def = hash)");
+    if (policy_name == "hash") {
+        sample_policy = SAMPLE_HASH;
+    } else if (policy_name == "cta") {
+        sample_policy = SAMPLE_CTA;
+    } else {
+        fprintf(stderr, "Unknown SAMPLE_POLICY %s\n", policy_name.c_str());
+        exit(1);
+    }
+    GET_VAR_INT(sample_period, "SAMPLE_PERIOD", SAMPLE_PERIOD, "Sampling period of SAMPLE_POLICY (def = 15)");
+    sample_period = max(sample_period, 1);
+    GET_VAR_LONG(sample_seed, "SAMPLE_SEED", 0, "Seed of execution sampling, runs with the same seed sample the same accesses (0 = from time; def = 0)");
+    if (sample_seed == 0)
+        sample_seed = time(0);
+    GET_VAR_INT(stream_depth, "STREAM_DEPTH", 2, "In-GPU traces kept per granule, 0 to 16, others are sent to the host (def = 2)");
+    if (stream_depth < 0 || stream_depth > MAX_STREAM_DEPTH) {
+        fprintf(stderr, "STREAM_DEPTH %d out of range\n", stream_depth);
+        exit(1);
+    }
+    GET_VAR_INT(zero_copy, "ZERO_COPY", 0, "Keep channel segments in mapped pinned memory, workers read them in place (def = 0)");
+    std::string capture_path;
+    GET_VAR_STR(capture_path, "CAPTURE", "Record the traced launches to this file, for sa-replay (def = none)");
+    if (!capture_path.empty() && !capture_open(&capture, capture_path.c_str(), WIRE_VERSION)) {
+        fprintf(stderr, "Cannot write CAPTURE %s\n", capture_path.c_str());
+        exit(1);
+    }
+    GET_VAR_STR(stats_path, "STATS_FILE", "Write counters, timings, suggestions and hot-path stats as JSON to this file at exit (def = none)");
+    std::string mode_name = "scope-advice";
+    GET_VAR_STR(mode_name, "SA_MODE", "Pipeline variant: naive, para, para+sampling, scope-advice, scope-advice+filter, nvbit or a mask of MODE_* switches (def = scope-advice)");
+    tool_mode = parse_mode(mode_name);
+    if (tool_mode < 0) {
+        fprintf(stderr, "Unknown SA_MODE %s\n", mode_name.c_str());
+        exit(1);
+    }
+    int workers = 0, buffers = 0, huge = 1;
+    GET_VAR_INT(workers, "NUM_THREADS", 0, "Analysis workers, at most 64 (0 = one per available CPU but one, within the cgroup quota; def = 0)");
+    GET_VAR_INT(buffers, "NUM_BUFFERS", 0, "Channel buffers, at most 768 (0 = 64 per worker; def = 0)");
+    GET_VAR_INT(huge, "HUGE_PAGES", 1, "Back large host tables with transparent huge pages (def = 1)");
+    huge_pages = huge != 0;
+    topo_init(&topology);
+    if (DO_PARALLEL(tool_mode)) {
+        num_threads = workers > 0 ? min(workers, MAX_THREADS) : topo_pool_size(&topology, MAX_THREADS);
+        num_buffers = buffers > 0 ? min(buffers, MAX_BUFFERS) : min(BUFFERS_PER_WORKER * num_threads, MAX_BUFFERS);
+    } else {
+        num_threads = num_buffers = 1;
+    }
+    /* only nodes holding workers are used, topo_assign fills them first */
+    topology.nodes = min(topology.nodes, num_threads);
+    topo_assign(&topology, num_threads, worker_node);
+    /* instrumented functions only depend on the device switches */
+    mem_func = "instrument_mem_" + std::to_string(tool_mode % DEVICE_MODE_COUNT);
+    fence_func = "instrument_fence_" + std::to_string(tool_mode % DEVICE_MODE_COUNT);
     std::string pad(100, '-');
     printf ("%s\n", pad.c_str());
 }
@@ -653,19 +830,25 @@ void nvbit_at_cuda_event (CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
                          const char *name, void *params, CUresult *pStatus) {
     if (skip_flag) return;
 
-    /* returning from memory allocation APIs */
-    if (is_exit && cbid == API_CUDA_cuMemAlloc_v2) {
-        set_allocations(API_CUDA_cuMemAlloc_v2, params);
-        return;
-    } else if (is_exit && cbid == API_CUDA_cuMemAllocManaged) {
-        set_allocations(API_CUDA_cuMemAllocManaged, params);
-        return;
-    } else if (is_exit && cbid == API_CUDA_cuMemAllocPitch_v2) {
-        set_allocations(API_CUDA_cuMemAllocPitch_v2, params);
-        return;
-    } else if (is_exit && cbid == API_CUDA_cuModuleGetGlobal_v2) {
-        set_allocations(API_CUDA_cuModuleGetGlobal_v2, params);
-        return;
+    /* returning from memory allocation and release APIs, failed calls change nothing */
+    if (is_exit) {
+        switch(cbid) {
+            case API_CUDA_cuMemAlloc_v2:
+            case API_CUDA_cuMemAllocManaged:
+            case API_CUDA_cuMemAllocPitch_v2:
+            case API_CUDA_cuModuleGetGlobal_v2:
+                if (*pStatus == CUDA_SUCCESS)
+                    set_allocations(cbid, params);
+                return;
+            case API_CUDA_cuMemFree_v2:
+            case API_CUDA_cuMemFree:
+            case API_CUDA_cuModuleUnload:
+                if (*pStatus == CUDA_SUCCESS)
+                    release_allocations(cbid, params);
+                return;
+            default:
+                break;
+        }
     }
 
     if (cbid == API_CUDA_cuLaunchKernel_ptsz || cbid == API_CUDA_cuLaunchKernel ||
@@ -682,7 +865,7 @@ void nvbit_at_cuda_event (CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
                 kernel_instances += 1;
             }
             // If this is the suggested instance do it, else skip
-            if (kernel_instances != instance) {
+            if (instance != 0 && kernel_instances != instance) {
                 // Disable instrumentation if the instance is not to be traced
                 // Only do this after required instance is traced
                 if (kernel_instances > instance) {
@@ -694,15 +877,23 @@ void nvbit_at_cuda_event (CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
 
         if (!is_exit) {
             instrumentation.start();
-            instrument_function_if_needed(ctx, p->f);
+            kernel_info_t *k = instrument_function_if_needed(ctx, p->f);
+            if (k->resolved.load()) {
+                /* every fence is known to be needed, run the original code */
+                nvbit_enable_instrumented(ctx, p->f, false);
+                instrumentation.end();
+                pthread_mutex_lock(&report_lock);
+                launches_uninstrumented += 1;
+                early_saved_ms += k->traced_ms / max(k->launches, 1);
+                pthread_mutex_unlock(&report_lock);
+                running_launch = NULL;
+                return;
+            }
             nvbit_enable_instrumented(ctx, p->f, true);
             instrumentation.end();
+            /* May wait for the analysis of the launch before last, that time is part of the pipeline */
+            launch_t *l = begin_launch(k);
             setup.start();
-            /* let dedup thread move ahead as well! */
-            last_job.exchange(JOB_BEGIN);
-
-            /* Start zeroing, this will wake up the workers, after instrumentation completes! */
-            pthread_barrier_wait(&barrier);
 
             int nregs;
             CUDA_SAFECALL (cuFuncGetAttribute (&nregs, CU_FUNC_ATTRIBUTE_NUM_REGS, p->f));
@@ -715,23 +906,28 @@ void nvbit_at_cuda_event (CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
                 p->blockDimZ, nregs, shmem_static_nbytes + p->sharedMemBytes, (uint64_t)p->hStream);
 
             /* Useful for calculation later */
-            set_dimension(p);
+            set_dimension(l, p);
             /* Information needed for implementing execution sampling */
-            set_sampling_meta();
+            set_sampling_meta(l);
             /* initialize fence meta */
-            set_fence_meta();
-
-            /* Ensure that workers have completed zeroing! */
-            pthread_barrier_wait(&barrier);
+            set_fence_meta(l);
 
-            /* sync zeroing */
-            cudaStreamSynchronize(stream);
+            /* Host access_map pages come zeroed when materialized, only device metadata needs a reset */
+            set_shadow(l);
+            if (capture.file != NULL)
+                capture_launch(l);
 
             setup.end();
+            if (l->id == 0)
+                pipeline.start();
             kernel.start();
-            /* Ensure that boss thread now starts listening for GPU jobs */
-            recv_thread_receiving = true;
+            running_launch = l;
+            /* Ensure that boss thread now starts listening for the packets of this launch */
+            ring_push(&launch_ring, l->slot);
         } else {
+            /* launched uninstrumented, see above */
+            if (running_launch == NULL)
+                return;
             /* Removing this can cause trouble, as flush marker below must be set after kernel finishes */
             cudaDeviceSynchronize ();
             cudaError_t error = cudaGetLastError ();
@@ -739,10 +935,14 @@ void nvbit_at_cuda_event (CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
                 printf ("CUDA error_%d: %s\n", error, cudaGetErrorName (error));
                 assert (false);
             }
+            double before = kernel.getMillis();
             kernel.end();
+            running_launch->kernel_ms = kernel.getMillis() - before;
+            running_launch = NULL;
             /* Will be launching a kernel from here, so skip all instrumentation of that one */
             skip_flag = true;
 
+            compact_candidates();
             flush_channel<<<1,1>>> ();
             cudaDeviceSynchronize ();
             error = cudaGetLastError ();
@@ -761,53 +961,41 @@ void nvbit_at_cuda_event (CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
 void nvbit_at_ctx_init (CUcontext ctx) {
     setup.start();
     if (!recv_thread_started) {
-        /* Initialize job content */
-        for (int i = 0; i < NUM_BUFFERS; i++) {
-            jobs[i].job_amount = 0;
-            jobs[i].buffer = (char *)malloc (CHANNEL_SIZE);
-            free_queue.push_back(i);
-        }
-
         /* Need not init this for every ctx, just once! */
         recv_thread_started = true;
-        channel_host.init (0, CHANNEL_SIZE, &channel_dev, NULL);
+        if (zero_copy)
+            channel_host.init (0, CHANNEL_SIZE, &channel_dev, NULL, NULL, ZERO_COPY_SEGMENTS, true);
+        else
+            channel_host.init (0, CHANNEL_SIZE, &channel_dev, NULL);
         /* set up channel in device_arguments */
         device_arguments.channel_dev = &channel_dev;
-        /* Init locks for job, free queues, async */
-        pthread_mutex_init(&async_lock, NULL);
-        pthread_mutex_init(&free_lock, NULL);
-        pthread_mutex_init(&job_lock, NULL);
-        /* Creates a barrier with workers + async_task amount of threads */
-        pthread_barrier_init(&barrier, NULL, NUM_THREADS + 1);
+        /* zero-copy jobs point to channel segments, no buffer of their own */
+        if (zero_copy)
+            release_segment = [](int segment) { channel_host.release(segment); };
+        ring_init(&launch_ring);
+        pool_start(!zero_copy);
         /* Create boss thread */
-        int result = pthread_create (&recv_thread, NULL, distributor, NULL);
-        /* Create cleaner thread */
-        result = pthread_create (&async_task, NULL, deduplicate, NULL);
-        for (int i = 0; i < NUM_THREADS; ++i) {
-            thr_data[i].tid = i;
-            /* Create multiple worker threads! */
-            if ((result = pthread_create(&thr[i], NULL, async_zero, &thr_data[i]))) {
-                fprintf(stderr, "error: pthread_create, rc: %d\n", result);
-            }
-        }
-        uint64_t free = 0, total = 0;
-        CUDA_SAFECALL(cudaMemGetInfo(&free, &total));
-        host_metadata_len = roundUp(total, GRAN);
-        /* UVM ensures lazy allocation at 64K boundaries. Below allocations create a hash map for all posisble locations present on
-           the GPU. Being lazily allocated, it does not consume the whole GPU memory area even though the VA space is quite large. */
-        cudaMallocManaged((void**)&device_arguments.memory_meta, sizeof(uint32_t) * host_metadata_len);
-        if (DO_STREAM)
-            cudaMallocManaged((void**)&device_arguments.stream_meta, sizeof(uint32_t) * host_metadata_len * NUM_STREAM_TRACES);
-        device_arguments.length = host_metadata_len;
-        access_map = new std::atomic<uint64_t>[host_metadata_len];
+        pthread_create (&recv_thread, NULL, distributor, NULL);
+        /* Shadow buffers are sized by the tracked allocations, see set_shadow */
+        device_arguments.memory_meta = NULL;
+        device_arguments.stream_meta = NULL;
+        device_arguments.ranges = NULL;
+        device_arguments.length = 0;
+        device_arguments.num_ranges = 0;
+        device_arguments.stream_depth = stream_depth;
+        device_arguments.worklist = NULL;
+        device_arguments.candidates = NULL;
+        device_arguments.worklist_cap = 0;
+        cudaMalloc((void**)&device_arguments.worklist_len, sizeof(unsigned long long));
+        cudaMemset(device_arguments.worklist_len, 0, sizeof(unsigned long long));
+        shadow_capacity = ranges_capacity = worklist_capacity = 0;
         /* creating high priority stream for prefetching, async memset and memcpy */
         int high, low;
         cudaDeviceGetStreamPriorityRange(&low, &high);
         cudaStreamCreateWithPriority(&stream, cudaStreamNonBlocking, high);
         /* Initialize global variables as well  */
         static_counter = 0;
-        allocation_records.clear();
-        last_job.exchange(0);
+        registry_init(&allocation_records);
     }
     setup.end();
 }
@@ -816,31 +1004,18 @@ void nvbit_at_ctx_term(CUcontext ctx) {
     if (!recv_thread_started)
         return;
 
+    /* Every traced launch is analyzed before the threads go away */
+    pool_wait();
     recv_thread_started = false;
     pthread_join (recv_thread, NULL);
-    pthread_join (async_task, NULL);
-    /* Wait till all worker threads are done */
-    for (int i = 0; i < NUM_THREADS; i++) {
-        //if (verbose) {
-        //    printf("Joined: %d, with status: %d\n", i, pthread_join(thr[i], NULL));
-        //}
-        pthread_join(thr[i], NULL);
-    }
+    pool_stop();
 
-    if (DO_ANALYZE) {
-        /* Print suggestions */
-        printf("========== SUGGESTIONS ==========\n");
-        for (int i = 0; i < epoch; i++) {
-            auto current = fence_map[i];
-            if (!current->not_oversynchronized.load()) {
-                uint64_t addr = id_to_fence_map[i];
-                auto next = fence_map[i+1];
-                /* NOTE: wrapper script depends on this format. Do not change without changing the wrapper! */
-                printf("Fence@: %lx | Epoch: %d | Info: %s | Type: %s\n", addr, i, fence_to_lineinfo_map[addr].c_str(),
-                    fence_map[i]->get_comment(next->operations.load()).c_str());
-            }
-        }
-    }
+    capture_close(&capture);
+
+    if (DO_ANALYZE(tool_mode))
+        print_suggestions();
     printCounters();
     printTrackers();
+    if (!stats_path.empty())
+        writeStats(stats_path.c_str());
 }
@@ -0,0 +1,102 @@
+#ifndef CHANNEL_MODEL_H
+#define CHANNEL_MODEL_H
+
+/* Host model of the segmented ChannelDev (core/utils/channel.hpp), plain threads
+ * standing for warps, over segment state in host memory as the mapped words are
+ * on a GPU. Records are 8B, each one its position in the stream, in records. */
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "check.h"
+
+#define SEGMENTS 4
+/* 32 records per segment */
+#define SEG_SIZE 256
+
+/* Segment state shared by the device model and the host side */
+int doorbells[SEGMENTS];
+uint64_t seg_gen[SEGMENTS];
+uint64_t buff[SEGMENTS * SEG_SIZE / sizeof(uint64_t)];
+
+/* ChannelDev with plain threads for warps */
+struct device_model_t {
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> committed[SEGMENTS];
+    std::atomic<uint64_t> open_gen[SEGMENTS];
+
+    void init() {
+        head.store(0);
+        for (int s = 0; s < SEGMENTS; s++) {
+            committed[s].store(0);
+            open_gen[s].store(0);
+        }
+    }
+
+    void wait_gen(int seg, uint64_t gen) {
+        while (__atomic_load_n(&seg_gen[seg], __ATOMIC_ACQUIRE) != gen)
+            std::this_thread::yield();
+    }
+
+    void close(int seg, uint64_t gen, uint32_t nbytes) {
+        wait_gen(seg, gen);
+        while (committed[seg].load() != nbytes)
+            std::this_thread::yield();
+        committed[seg].store(0);
+        CHECK_EQ(__atomic_load_n(&doorbells[seg], __ATOMIC_ACQUIRE), 0);
+        __atomic_store_n(&doorbells[seg], (int)nbytes, __ATOMIC_RELEASE);
+    }
+
+    void push() {
+        uint64_t pos = head.fetch_add(sizeof(uint64_t));
+        uint64_t gen = pos / SEG_SIZE;
+        uint32_t off = pos % SEG_SIZE;
+        int seg = gen % SEGMENTS;
+        /* the generation word is only polled until a warp of the generation has seen it */
+        if (open_gen[seg].load() != gen + 1) {
+            wait_gen(seg, gen);
+            uint64_t seen = open_gen[seg].load();
+            while (seen < gen + 1 && !open_gen[seg].compare_exchange_weak(seen, gen + 1)) {
+            }
+        }
+        __atomic_store_n(&buff[(seg * SEG_SIZE + off) / sizeof(uint64_t)], pos / sizeof(uint64_t), __ATOMIC_RELAXED);
+        committed[seg].fetch_add(sizeof(uint64_t));
+        if (off + sizeof(uint64_t) == SEG_SIZE)
+            close(seg, gen, SEG_SIZE);
+    }
+
+    /* 'records' pushes shared by 'warps' threads, then the flush at the end of the kernel */
+    void run(int warps, uint64_t records) {
+        std::atomic<uint64_t> tickets(0);
+        std::vector<std::thread> threads;
+        for (int w = 0; w < warps; w++) {
+            threads.emplace_back([&]() {
+                while (tickets.fetch_add(1) < records)
+                    push();
+            });
+        }
+        for (auto &each: threads)
+            each.join();
+        flush();
+    }
+
+    void flush() {
+        uint64_t pos = head.load();
+        if (pos == 0)
+            return;
+        uint64_t gen = pos / SEG_SIZE;
+        uint32_t off = pos % SEG_SIZE;
+        if (off != 0) {
+            head.fetch_add(SEG_SIZE - off);
+            close(gen % SEGMENTS, gen, off);
+        } else {
+            gen -= 1;
+        }
+        while (__atomic_load_n(&seg_gen[gen % SEGMENTS], __ATOMIC_ACQUIRE) == gen)
+            std::this_thread::yield();
+    }
+};
+
+device_model_t device;
+
+#endif /* CHANNEL_MODEL_H */
@@ -0,0 +1,37 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Minimal checks for the host tests: a failed CHECK reports itself and the test
+ * goes on, check_exit() gives the exit status of the test. */
+
+static int check_failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+            check_failures++; \
+        } \
+    } while (0)
+
+#define CHECK_EQ(a, b) \
+    do { \
+        unsigned long long _a = (unsigned long long)(a), _b = (unsigned long long)(b); \
+        if (_a != _b) { \
+            fprintf(stderr, "%s:%d: CHECK failed: %s == %s (%llu != %llu)\n", __FILE__, __LINE__, #a, #b, _a, _b); \
+            check_failures++; \
+        } \
+    } while (0)
+
+static int check_exit(const char *name) {
+    if (check_failures)
+        printf("%s: %d checks failed\n", name, check_failures);
+    else
+        printf("%s: ok\n", name);
+    return check_failures ? 1 : 0;
+}
+
+#endif /* CHECK_H */
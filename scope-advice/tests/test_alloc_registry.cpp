@@ -0,0 +1,212 @@
+/* alloc_registry.h: callback sequences of the tool (allocation, free, re-allocation
+ * at the same address, globals looked up twice, allocations overlapping stale ones,
+ * module unload), then random sequences against a plain list of intervals. */
+
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "check.h"
+#include "../alloc_registry.h"
+
+typedef struct {
+    uint64_t base, bound, owner;
+} interval_t;
+
+/* Reference: the documented behaviour on a list */
+typedef struct {
+    std::vector<interval_t> live;
+    uint64_t bytes, peak, allocs, frees, stale;
+} reference_t;
+
+void reference_add(reference_t *ref, uint64_t base, uint64_t bound, uint64_t owner) {
+    if (bound <= base)
+        return;
+    ref->allocs++;
+    for (size_t j = 0; j < ref->live.size();) {
+        interval_t &each = ref->live[j];
+        if (each.base < bound && base < each.bound) {
+            ref->stale += each.base != base;
+            ref->bytes -= each.bound - each.base;
+            ref->live.erase(ref->live.begin() + j);
+        } else {
+            j++;
+        }
+    }
+    ref->live.push_back({base, bound, owner});
+    ref->bytes += bound - base;
+    ref->peak = std::max(ref->peak, ref->bytes);
+}
+
+void reference_remove(reference_t *ref, uint64_t base) {
+    for (size_t j = 0; j < ref->live.size(); j++) {
+        if (ref->live[j].base == base) {
+            ref->frees++;
+            ref->bytes -= ref->live[j].bound - base;
+            ref->live.erase(ref->live.begin() + j);
+            return;
+        }
+    }
+}
+
+void reference_remove_owner(reference_t *ref, uint64_t owner) {
+    for (size_t j = 0; j < ref->live.size();) {
+        if (ref->live[j].owner == owner) {
+            ref->frees++;
+            ref->bytes -= ref->live[j].bound - ref->live[j].base;
+            ref->live.erase(ref->live.begin() + j);
+        } else {
+            j++;
+        }
+    }
+}
+
+bool same(alloc_registry_t *reg, reference_t *ref) {
+    if (reg->live.size() != ref->live.size() || reg->bytes != ref->bytes || reg->peak != ref->peak ||
+        reg->allocs != ref->allocs || reg->frees != ref->frees || reg->stale != ref->stale)
+        return false;
+    for (auto &each: ref->live) {
+        auto it = reg->live.find(each.base);
+        if (it == reg->live.end() || it->second.bound != each.bound || it->second.owner != each.owner)
+            return false;
+    }
+    /* disjoint, in address order */
+    uint64_t end = 0;
+    for (auto &each: reg->live) {
+        if (each.first < end)
+            return false;
+        end = each.second.bound;
+    }
+    return true;
+}
+
+void sequences() {
+    alloc_registry_t reg;
+    registry_init(&reg);
+
+    /* allocation and free */
+    registry_add(&reg, 0x1000, 0x2000);
+    CHECK_EQ(reg.live.size(), 1);
+    CHECK_EQ(reg.bytes, 0x1000);
+    CHECK(registry_find(&reg, 0x1000) != reg.live.end());
+    CHECK(registry_find(&reg, 0x1fff) != reg.live.end());
+    CHECK(registry_find(&reg, 0x2000) == reg.live.end());
+    CHECK(registry_find(&reg, 0xfff) == reg.live.end());
+    CHECK(!registry_remove(&reg, 0x1800));
+    CHECK(registry_remove(&reg, 0x1000));
+    CHECK(!registry_remove(&reg, 0x1000));
+    CHECK(reg.live.empty());
+    CHECK_EQ(reg.bytes, 0);
+    CHECK_EQ(reg.frees, 1);
+
+    /* re-allocation at the same address, larger this time */
+    registry_add(&reg, 0x1000, 0x3000);
+    CHECK_EQ(reg.live.size(), 1);
+    CHECK_EQ(reg.live[0x1000].bound, 0x3000);
+    CHECK_EQ(reg.bytes, 0x2000);
+    CHECK_EQ(reg.peak, 0x2000);
+    CHECK_EQ(reg.stale, 0);
+
+    /* a global looked up twice updates its entry, nothing is stale */
+    registry_add(&reg, 0x8000, 0x8100, 7);
+    registry_add(&reg, 0x8000, 0x8100, 7);
+    CHECK_EQ(reg.live.size(), 2);
+    CHECK_EQ(reg.bytes, 0x2100);
+    CHECK_EQ(reg.stale, 0);
+    CHECK_EQ(reg.allocs, 4);
+
+    /* the free of 0x1000 was missed: a new allocation over it and the global drops both */
+    registry_add(&reg, 0x2000, 0x9000);
+    CHECK_EQ(reg.live.size(), 1);
+    CHECK_EQ(reg.stale, 2);
+    CHECK_EQ(reg.bytes, 0x7000);
+    CHECK_EQ(reg.peak, 0x7000);
+    /* the one starting before the new base is dropped as well */
+    registry_add(&reg, 0x1000, 0x2800);
+    CHECK_EQ(reg.live.size(), 1);
+    CHECK_EQ(reg.stale, 3);
+    CHECK(registry_find(&reg, 0x3000) == reg.live.end());
+
+    /* adjacent allocations do not overlap */
+    registry_add(&reg, 0x2800, 0x3000);
+    registry_add(&reg, 0x800, 0x1000);
+    CHECK_EQ(reg.live.size(), 3);
+    CHECK_EQ(reg.stale, 3);
+
+    /* empty allocations are ignored */
+    uint64_t allocs = reg.allocs;
+    registry_add(&reg, 0x5000, 0x5000);
+    registry_add(&reg, 0x6000, 0x5000);
+    CHECK_EQ(reg.allocs, allocs);
+    CHECK_EQ(reg.live.size(), 3);
+
+    /* module unload: globals of modules 1 and 2, among plain allocations */
+    registry_add(&reg, 0x10000, 0x10100, 1);
+    registry_add(&reg, 0x10100, 0x10180, 2);
+    registry_add(&reg, 0x10200, 0x10300, 1);
+    registry_add(&reg, 0x20000, 0x30000);
+    uint64_t frees = reg.frees, bytes = reg.bytes;
+    registry_remove_owner(&reg, 1);
+    CHECK_EQ(reg.frees, frees + 2);
+    CHECK_EQ(reg.bytes, bytes - 0x200);
+    CHECK(registry_find(&reg, 0x10000) == reg.live.end());
+    CHECK(registry_find(&reg, 0x10100) != reg.live.end());
+    CHECK(registry_find(&reg, 0x10250) == reg.live.end());
+    CHECK(registry_find(&reg, 0x20000) != reg.live.end());
+    /* unloading again, or a module without globals, does nothing */
+    registry_remove_owner(&reg, 1);
+    registry_remove_owner(&reg, 3);
+    CHECK_EQ(reg.frees, frees + 2);
+    registry_remove_owner(&reg, 2);
+    CHECK_EQ(reg.live.size(), 4);
+    /* peak never goes down */
+    CHECK(reg.peak >= reg.bytes);
+    registry_init(&reg);
+    CHECK(reg.live.empty());
+    CHECK_EQ(reg.peak, 0);
+}
+
+void random_sequences() {
+    std::mt19937_64 rng(17);
+    uint64_t mismatches = 0;
+    for (int run = 0; run < 200; run++) {
+        alloc_registry_t reg;
+        registry_init(&reg);
+        reference_t ref = {{}, 0, 0, 0, 0, 0};
+        /* a small address space, so that allocations collide */
+        uint64_t space = 64 + rng() % 4096;
+        for (int op = 0; op < 500; op++) {
+            int kind = rng() % 10;
+            if (kind < 5) {
+                uint64_t base = rng() % space, bound = base + rng() % (space / 8 + 1);
+                uint64_t owner = rng() % 3 == 0 ? 1 + rng() % 3 : 0;
+                registry_add(&reg, base, bound, owner);
+                reference_add(&ref, base, bound, owner);
+            } else if (kind < 9) {
+                /* mostly live bases, sometimes anything */
+                uint64_t base = rng() % space;
+                if (!ref.live.empty() && rng() % 4 != 0)
+                    base = ref.live[rng() % ref.live.size()].base;
+                bool known = false;
+                for (auto &each: ref.live)
+                    known = known || each.base == base;
+                CHECK_EQ(registry_remove(&reg, base), known);
+                reference_remove(&ref, base);
+            } else {
+                uint64_t owner = 1 + rng() % 3;
+                registry_remove_owner(&reg, owner);
+                reference_remove_owner(&ref, owner);
+            }
+            if (!same(&reg, &ref)) {
+                mismatches++;
+                break;
+            }
+        }
+    }
+    CHECK_EQ(mismatches, 0);
+}
+
+int main() {
+    sequences();
+    random_sequences();
+    return check_exit("test_alloc_registry");
+}
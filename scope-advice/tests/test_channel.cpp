@@ -0,0 +1,63 @@
+/* core/utils/channel.hpp segmented protocol: ChannelDev::push and flush modelled with
+ * threads for warps (channel_model.h), drained as ChannelHost::recv does, by copies of
+ * random sizes segment after segment, over thousands of generations and with from one
+ * to many more warps than segments. Every record must arrive once and in push order,
+ * and every generation, the flushed one included, must be handed back to the device. */
+
+#include <algorithm>
+#include <random>
+#include <signal.h>
+#include <unistd.h>
+#include "channel_model.h"
+#include "../core/utils/segment_ring.hpp"
+
+#define RECORDS 400000
+#define TIMEOUT 120
+
+void timeout(int) {
+    const char msg[] = "test_channel: timed out\n";
+    if (write(2, msg, sizeof(msg) - 1) < 0)
+        _exit(2);
+    _exit(1);
+}
+
+void by_copies(int warps, uint64_t records, uint64_t seed) {
+    SegmentRing ring;
+    ring.init(doorbells, seg_gen, SEGMENTS);
+    device.init();
+    std::thread dev([&]() { device.run(warps, records); });
+    std::mt19937_64 rng(seed);
+    uint64_t expected = 0, wrong = 0;
+    while (expected < records) {
+        int seg;
+        uint32_t left = ring.pending(seg);
+        if (left == 0) {
+            std::this_thread::yield();
+            continue;
+        }
+        uint32_t nbytes = std::min(left, (uint32_t)(1 + rng() % 5) * (uint32_t)sizeof(uint64_t));
+        uint32_t start = __atomic_load_n(&doorbells[seg], __ATOMIC_ACQUIRE) - left;
+        for (uint32_t off = start; off < start + nbytes; off += sizeof(uint64_t))
+            wrong += buff[(seg * SEG_SIZE + off) / sizeof(uint64_t)] != expected++;
+        ring.consume(nbytes);
+    }
+    dev.join();
+    if (wrong)
+        printf("%d warps, %lu records: %lu out of place\n", warps, records, wrong);
+    CHECK_EQ(expected, records);
+    CHECK_EQ(wrong, 0);
+    uint64_t generations = (records * sizeof(uint64_t) + SEG_SIZE - 1) / SEG_SIZE;
+    for (int s = 0; s < SEGMENTS; s++)
+        CHECK_EQ(seg_gen[s], s + SEGMENTS * ((generations - s + SEGMENTS - 1) / SEGMENTS));
+}
+
+int main() {
+    signal(SIGALRM, timeout);
+    alarm(TIMEOUT);
+    /* a segment filled exactly, one partial segment left to the flush, then long runs */
+    by_copies(1, SEG_SIZE / sizeof(uint64_t), 1);
+    by_copies(3, 5, 2);
+    for (int warps = 1; warps <= 16; warps *= 2)
+        by_copies(warps, RECORDS / 4 + warps, 6 + warps);
+    return check_exit("test_channel");
+}
@@ -0,0 +1,319 @@
+/* device_meta.h warp-cooperative update: the leader of each match-any group replaying
+ * the group (merge_group, store_traces) must leave the same granule metadata, the same
+ * stream_meta traces and the same lanes sending to the host as every lane updating on
+ * its own in lane order, as instrument_mem did before. Random warps over a few
+ * granules, untracked lanes, every device mode with and without streaming.
+ *
+ * Then the lock-free publication of instrument_mem_impl, leaders being threads
+ * racing on shared metadata words, next to the spin-locked update it replaced on
+ * the same updates: with both, among the updates of a granule exactly one sees it
+ * become multi-block and stored (became_candidate), stream_meta slots are claimed
+ * once each, and the final words are those of the updates made one at a time.
+ * The time of both is printed. */
+
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+#include "check.h"
+#include "../common.h"
+#include "../device_meta.h"
+
+#define WARPS 100000
+#define GRANULES 6
+/* CAS model: rounds on fresh granules, leaders and updates per leader in a round */
+#define CAS_ROUNDS 300
+#define CAS_GRANULES 8
+#define CAS_LEADERS 8
+#define CAS_UPDATES 256
+
+typedef struct {
+    unsigned active;
+    uint64_t keys[WARP_SIZE];
+    uint32_t op_mask;
+    uint64_t bid, tid;
+    int epoch;
+} warp_t;
+
+/* Granule state: metadata word and its stream_meta traces */
+typedef struct {
+    uint64_t md[GRANULES];
+    uint32_t stream[GRANULES * MAX_STREAM_DEPTH];
+} state_t;
+
+warp_t random_warp(std::mt19937_64 &rng) {
+    warp_t w;
+    unsigned shapes[] = {0xffffffffu, 0x0000ffffu, 0x1u, 0x80000001u, (unsigned)rng()};
+    w.active = shapes[rng() % 5];
+    if (w.active == 0)
+        w.active = 1;
+    /* mostly few distinct granules, so that groups are large, some untracked lanes */
+    int spread = 1 + rng() % GRANULES;
+    for (int lane = 0; lane < WARP_SIZE; lane++)
+        w.keys[lane] = rng() % 16 == 0 ? NO_SHADOW : rng() % spread;
+    const uint32_t ops[] = {MASK_LOAD, MASK_STORE, MASK_ATOMIC, MASK_LOAD | MASK_STRONG};
+    w.op_mask = ops[rng() % 4] | (uint32_t)(rng() % 4);
+    w.bid = rng() % 3;
+    w.tid = w.bid * 1024 + (rng() % 32) * WARP_SIZE;
+    w.epoch = rng() % (1 << HSZ_EP);
+    return w;
+}
+
+/* every active lane on its own, in lane order */
+template <int M>
+unsigned per_lane(const warp_t &w, state_t &s, uint32_t depth) {
+    unsigned host = 0;
+    for (int lane = 0; lane < WARP_SIZE; lane++) {
+        if (!(w.active & (1u << lane)) || w.keys[lane] == NO_SHADOW)
+            continue;
+        uint64_t g = w.keys[lane];
+        uint64_t slot = getBits(s.md[g], POS_CNT, SZ_CNT);
+        trace_dest_t dest = claim_trace<M>(w.op_mask, s.md[g], w.bid, depth);
+        if (dest == TRACE_STREAM)
+            s.stream[g * MAX_STREAM_DEPTH + slot] = set_host_metadata(w.tid + lane, w.epoch, w.op_mask);
+        else if (dest == TRACE_HOST)
+            host |= 1u << lane;
+    }
+    return host;
+}
+
+/* leaders update for their group, as instrument_mem_impl */
+template <int M>
+unsigned merged(const warp_t &w, state_t &s, uint32_t depth) {
+    dev_args dev;
+    dev.stream_meta = s.stream;
+    dev.stream_depth = MAX_STREAM_DEPTH;
+    unsigned host = 0, covered = 0;
+    for (int lane = 0; lane < WARP_SIZE; lane++) {
+        if (!(w.active & (1u << lane)))
+            continue;
+        unsigned peers = emulate_match_any(w.active, w.keys, lane);
+        int leader = __builtin_ctz(peers);
+        /* groups partition the active lanes */
+        CHECK(peers & (1u << lane));
+        CHECK_EQ(peers & ~w.active, 0);
+        if (lane != leader) {
+            CHECK(covered & (1u << lane));
+            continue;
+        }
+        CHECK_EQ(covered & peers, 0);
+        covered |= peers;
+        for (unsigned p = peers; p; p &= p - 1)
+            CHECK_EQ(w.keys[__builtin_ctz(p)], w.keys[lane]);
+        if (w.keys[lane] == NO_SHADOW)
+            continue;
+        uint64_t g = w.keys[lane];
+        uint64_t md = s.md[g], md_up = md;
+        unsigned stored;
+        host |= merge_group<M>(peers, w.op_mask, md_up, w.bid, depth, stored);
+        s.md[g] = md_up;
+        if (stored)
+            store_traces(&dev, g, stored, getBits(md, POS_CNT, SZ_CNT), leader, w.tid + leader, w.epoch, w.op_mask);
+    }
+    CHECK_EQ(covered, w.active);
+    return host;
+}
+
+template <int M>
+void compare(std::mt19937_64 &rng) {
+    uint64_t wrong_md = 0, wrong_stream = 0, wrong_host = 0;
+    state_t a, b;
+    for (int j = 0; j < WARPS; j++) {
+        /* fresh granules now and then, so that streams fill up and overflow */
+        if (j % 64 == 0) {
+            a = state_t();
+            b = state_t();
+        }
+        uint32_t depth = DO_STREAM(M) ? rng() % (MAX_STREAM_DEPTH + 1) : 0;
+        warp_t w = random_warp(rng);
+        wrong_host += per_lane<M>(w, a, depth) != merged<M>(w, b, depth);
+        for (int g = 0; g < GRANULES; g++)
+            wrong_md += a.md[g] != b.md[g];
+        for (int t = 0; t < GRANULES * MAX_STREAM_DEPTH; t++)
+            wrong_stream += a.stream[t] != b.stream[t];
+        if (wrong_md || wrong_stream || wrong_host)
+            break;
+    }
+    if (wrong_md || wrong_stream || wrong_host)
+        printf("mode %d: metadata %lu, stream %lu, host lanes %lu differ\n", M, wrong_md, wrong_stream, wrong_host);
+    CHECK_EQ(wrong_md, 0);
+    CHECK_EQ(wrong_stream, 0);
+    CHECK_EQ(wrong_host, 0);
+}
+
+/* Claims of one published update: the granule, and stream_meta slots [first, first + n) */
+typedef struct {
+    int granule;
+    uint32_t first, n;
+    uint64_t bid;
+    bool candidate;
+} claim_t;
+
+/* One update of a round: a group of lanes of block 'bid' on granule 'g' */
+typedef struct {
+    int g;
+    unsigned peers;
+    uint32_t op_mask;
+    uint64_t bid;
+} update_t;
+
+/* Word of a granule under the spin lock instrument_mem took before the CAS (D_LOCKED) */
+#define MODEL_LOCKED (uint32_t)-2
+
+/* 'updates' of each leader published by a thread of its own, as the leaders of
+   instrument_mem_impl do: merge_group on the word read then CAS, starting over on failure.
+   'locked': as instrument_mem did before, swapping the word for MODEL_LOCKED first and
+   storing the new word after. Returns the time taken in ms, 'races' counts failed CAS
+   (and lock waits) */
+template <int M>
+double publish(bool locked, const std::vector<std::vector<update_t>> &updates, uint32_t depth,
+               std::atomic<uint32_t> *words, std::vector<std::vector<claim_t>> &claims, std::atomic<uint64_t> &races,
+               uint64_t seed) {
+    std::atomic<int> ready(0);
+    std::vector<std::thread> leaders;
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < CAS_LEADERS; t++) {
+        leaders.emplace_back([&, t]() {
+            std::mt19937_64 mine(seed + t);
+            /* start together, so that the loops interleave */
+            ready.fetch_add(1);
+            while (ready.load() < CAS_LEADERS)
+                std::this_thread::yield();
+            for (const update_t &u: updates[t]) {
+                uint32_t md = words[u.g].load();
+                while (1) {
+                    if (locked && (md == MODEL_LOCKED || !words[u.g].compare_exchange_strong(md, MODEL_LOCKED))) {
+                        races.fetch_add(1);
+                        std::this_thread::yield();
+                        md = words[u.g].load();
+                        continue;
+                    }
+                    uint64_t md_up = md;
+                    unsigned stored;
+                    merge_group<M>(u.peers, u.op_mask, md_up, u.bid, depth, stored);
+                    bool changed = (uint32_t)md_up != md;
+                    /* widen the window between read and publication now and then, even on one core */
+                    if (changed && mine() % 4 == 0)
+                        std::this_thread::yield();
+                    if (locked)
+                        words[u.g].store((uint32_t)md_up);
+                    else if (changed && !words[u.g].compare_exchange_strong(md, (uint32_t)md_up)) {
+                        /* md now holds the word that won the race */
+                        races.fetch_add(1);
+                        continue;
+                    }
+                    if (changed) {
+                        claim_t c = {u.g, (uint32_t)getBits(md, POS_CNT, SZ_CNT), (uint32_t)__builtin_popcount(stored),
+                            u.bid, became_candidate(md, md_up)};
+                        claims[t].push_back(c);
+                    }
+                    break;
+                }
+            }
+        });
+    }
+    for (auto &each: leaders)
+        each.join();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+/* Granules after a round: exactly one candidate transition for each one multi-block and
+   stored, stream_meta slots claimed once each and below depth, and the block ID one of a
+   published update. Returns the errors found */
+uint64_t check_round(const std::atomic<uint32_t> *words, const std::vector<std::vector<claim_t>> &claims,
+                     uint32_t depth, uint64_t &published) {
+    uint64_t errors = 0;
+    for (int g = 0; g < CAS_GRANULES; g++) {
+        uint64_t md = words[g].load();
+        int transitions = 0;
+        bool writer = md == 0;
+        std::vector<int> slot_claims(MAX_STREAM_DEPTH + 1, 0);
+        for (auto &mine: claims) {
+            for (auto &c: mine) {
+                if (c.granule != g)
+                    continue;
+                published++;
+                transitions += c.candidate;
+                writer = writer || c.bid == getBits(md, POS_ID, SZ_ID);
+                for (uint32_t k = c.first; k < c.first + c.n; k++)
+                    slot_claims[min(k, (uint32_t)MAX_STREAM_DEPTH)]++;
+            }
+        }
+        bool candidate = getBit(md, POS_MB) && getBit(md, POS_ST);
+        errors += transitions != (candidate ? 1 : 0);
+        uint64_t count = getBits(md, POS_CNT, SZ_CNT);
+        for (uint32_t k = 0; k <= MAX_STREAM_DEPTH; k++)
+            errors += slot_claims[k] != (k < count ? 1 : 0);
+        errors += count > depth;
+        errors += !writer;
+    }
+    return errors;
+}
+
+/* Random groups published by CAS_LEADERS threads at once, lock-free and under the spin lock
+   it replaced, on the same updates. Both have to meet check_round, and end with the words of
+   the updates applied one after the other: F, ST, MB and CNT do not depend on the order of
+   the updates, ID is the block of the last one (checked by check_round) */
+template <int M>
+void cas_model(std::mt19937_64 &rng) {
+    const uint32_t order_free = ((1u << POS_ID) - 1) | (((1u << SZ_CNT) - 1) << POS_CNT);
+    uint64_t errors[2] = {0, 0}, published[2] = {0, 0}, words_wrong[2] = {0, 0};
+    std::atomic<uint64_t> races[2];
+    double ms[2] = {0, 0};
+    races[0].store(0);
+    races[1].store(0);
+    for (int round = 0; round < CAS_ROUNDS; round++) {
+        uint32_t depth = DO_STREAM(M) ? 1 + rng() % MAX_STREAM_DEPTH : 0;
+        std::vector<std::vector<update_t>> updates(CAS_LEADERS);
+        uint64_t sequential[CAS_GRANULES] = {0};
+        for (int t = 0; t < CAS_LEADERS; t++) {
+            for (int j = 0; j < CAS_UPDATES; j++) {
+                update_t u;
+                u.g = rng() % CAS_GRANULES;
+                u.peers = (unsigned)rng() | 1;
+                u.op_mask = (rng() % 4 == 0 ? MASK_STORE : MASK_LOAD) | (uint32_t)(rng() % 3);
+                /* a few blocks, each leader mostly in its own */
+                u.bid = rng() % 4 == 0 ? rng() % CAS_LEADERS : t;
+                updates[t].push_back(u);
+                unsigned stored;
+                merge_group<M>(u.peers, u.op_mask, sequential[u.g], u.bid, depth, stored);
+            }
+        }
+        uint64_t seed = rng();
+        for (int locked = 0; locked < 2; locked++) {
+            std::atomic<uint32_t> words[CAS_GRANULES];
+            for (auto &each: words)
+                each.store(0);
+            std::vector<std::vector<claim_t>> claims(CAS_LEADERS);
+            ms[locked] += publish<M>(locked, updates, depth, words, claims, races[locked], seed);
+            errors[locked] += check_round(words, claims, depth, published[locked]);
+            for (int g = 0; g < CAS_GRANULES; g++)
+                words_wrong[locked] += (words[g].load() & order_free) != (sequential[g] & order_free);
+        }
+    }
+    printf("test_device_meta: mode %2d, %d leaders: CAS %.1lf ms (%lu retries), locked %.1lf ms (%lu waits)\n", M,
+        CAS_LEADERS, ms[0], races[0].load(), ms[1], races[1].load());
+    for (int locked = 0; locked < 2; locked++) {
+        if (errors[locked] || words_wrong[locked])
+            printf("mode %d, %s: %lu candidate or slot errors, %lu words differ from the sequential updates\n", M,
+                locked ? "locked" : "CAS", errors[locked], words_wrong[locked]);
+        /* the model is only worth something if the loops did race */
+        CHECK(races[locked].load() > 0);
+        CHECK(published[locked] > 0);
+        CHECK_EQ(errors[locked], 0);
+        CHECK_EQ(words_wrong[locked], 0);
+    }
+}
+
+int main() {
+    std::mt19937_64 rng(12);
+    compare<0>(rng);
+    compare<MODE_FILTER>(rng);
+    compare<MODE_STREAM>(rng);
+    compare<MODE_FILTER | MODE_STREAM>(rng);
+    cas_model<0>(rng);
+    cas_model<MODE_STREAM>(rng);
+    cas_model<MODE_FILTER | MODE_STREAM>(rng);
+    return check_exit("test_device_meta");
+}
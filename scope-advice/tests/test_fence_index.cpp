@@ -0,0 +1,84 @@
+/* host_pipeline.h fence index: getPrevSync/getNextSync against the linear walk over
+ * fence_meta they replaced, on random grids (block sizes that are not a multiple of
+ * the warp size included), fence densities and 1 to 100 epochs, the index being built
+ * in parts as the workers do. Past EPOCH_MASK_BITS epochs the lookups leave the index
+ * for fence_meta. Every fence id from 0 to the epoch count is looked up. */
+
+#include <random>
+#include "check.h"
+#include "../host_pipeline.h"
+
+#define TRIALS 200
+/* threads looked up per trial at most, all of them in smaller grids */
+#define TIDS 2048
+
+launch_t *make_launch(std::mt19937_64 &rng, int epochs, uint64_t block_dim, uint64_t blocks, double density) {
+    launch_t *l = new launch_t();
+    l->epochs = epochs;
+    l->dim.blockDim = block_dim;
+    l->dim.warpsPerBlock = roundUp(block_dim, WARP_SIZE);
+    l->dim.gridDim = blocks * block_dim;
+    l->dim.warpsInGrid = blocks * l->dim.warpsPerBlock;
+    uint64_t words = (uint64_t)l->dim.warpsInGrid * epochs;
+    l->staged_fence_meta = (uint32_t *)malloc(sizeof(uint32_t) * words);
+    std::bernoulli_distribution fired(density);
+    for (uint64_t w = 0; w < words; w++) {
+        uint32_t mask = 0;
+        for (int lane = 0; lane < WARP_SIZE; lane++)
+            mask |= (uint32_t)fired(rng) << lane;
+        l->staged_fence_meta[w] = mask;
+    }
+    l->fence_index_warps = blocks * l->dim.warpsPerBlock;
+    l->fence_index = (epoch_mask_t *)calloc(l->fence_index_warps * WARP_SIZE, sizeof(epoch_mask_t));
+    for (int part = 0; part < num_threads; part++)
+        build_fence_index(l, part);
+    return l;
+}
+
+void free_launch(launch_t *l) {
+    free(l->staged_fence_meta);
+    free(l->fence_index);
+    delete l;
+}
+
+uint64_t compare(launch_t *l, uint64_t tid) {
+    uint64_t wrong = 0;
+    for (int fence_id = 0; fence_id <= l->epochs; fence_id++) {
+        int prev = getPrevSync(l, fence_id, tid), prev_ref = getPrevSyncLinear(l, fence_id, tid);
+        int next = getNextSync(l, fence_id, tid), next_ref = getNextSyncLinear(l, fence_id, tid);
+        if (prev != prev_ref || next != next_ref) {
+            if (wrong++ == 0)
+                printf("tid %lu, fence %d of %d: prev %d (linear %d), next %d (linear %d)\n", tid, fence_id,
+                    l->epochs, prev, prev_ref, next, next_ref);
+        }
+    }
+    return wrong;
+}
+
+int main() {
+    std::mt19937_64 rng(8);
+    const uint64_t block_dims[] = {32, 64, 256, 1024, 1, 33, 100, 500};
+    const double densities[] = {0, 0.01, 0.25, 0.9, 1};
+    uint64_t wrong = 0, lookups = 0;
+    for (int trial = 0; trial < TRIALS; trial++) {
+        /* the widths of the mask at both ends and just past it, then anything */
+        const int edges[] = {EPOCH_MASK_BITS, 1, EPOCH_MASK_BITS - 1, EPOCH_MASK_BITS + 1, 100};
+        int epochs = trial < 5 ? edges[trial] : 1 + rng() % 100;
+        uint64_t block_dim = block_dims[rng() % 8];
+        uint64_t blocks = 1 + rng() % max((uint64_t)1, 8192 / block_dim);
+        num_threads = 1 + rng() % 8;
+        launch_t *l = make_launch(rng, epochs, block_dim, blocks, densities[rng() % 5]);
+        uint64_t threads = l->dim.gridDim;
+        for (uint64_t j = 0; j < min(threads, (uint64_t)TIDS); j++) {
+            uint64_t tid = threads <= TIDS ? j : rng() % threads;
+            wrong += compare(l, tid);
+            lookups += 2 * (epochs + 1);
+        }
+        /* last thread of the grid, in the last (possibly partial) warp */
+        wrong += compare(l, threads - 1);
+        free_launch(l);
+    }
+    printf("test_fence_index: %lu lookups\n", lookups);
+    CHECK_EQ(wrong, 0);
+    return check_exit("test_fence_index");
+}
@@ -0,0 +1,146 @@
+/* job_ring.h: FIFO order and bounds on one thread, then producers and consumers
+ * from 1 to 64 threads, consumers parking as the workers do, with every value
+ * delivered exactly once and in push order per producer. A lost wake-up hangs the
+ * run, which the alarm turns into a failure. Each configuration runs once with
+ * producers pausing, so that consumers park, and once flat out, whose throughput
+ * is printed. */
+
+#include <atomic>
+#include <chrono>
+#include <signal.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "check.h"
+#include "../job_ring.h"
+
+/* values pushed per configuration */
+#define STRESS_VALUES (1 << 18)
+/* seconds before a run is deemed stuck */
+#define STRESS_TIMEOUT 120
+
+job_ring_t ring;
+
+void timeout(int) {
+    const char msg[] = "test_job_ring: timed out, a consumer was never woken\n";
+    if (write(2, msg, sizeof(msg) - 1) < 0)
+        _exit(2);
+    _exit(1);
+}
+
+void single_thread() {
+    ring_init(&ring);
+    int value = -1;
+    CHECK(ring_empty(&ring));
+    CHECK(!ring_pop(&ring, value));
+    /* several laps, filling the ring each time */
+    for (int lap = 0; lap < 3; lap++) {
+        for (int i = 0; i < JOB_RING_SIZE; i++)
+            CHECK(ring_push(&ring, lap * JOB_RING_SIZE + i));
+        CHECK(!ring_push(&ring, -1));
+        CHECK_EQ(ring_depth(&ring), JOB_RING_SIZE);
+        for (int i = 0; i < JOB_RING_SIZE; i++) {
+            CHECK(ring_pop(&ring, value));
+            CHECK_EQ(value, lap * JOB_RING_SIZE + i);
+        }
+        CHECK(!ring_pop(&ring, value));
+        CHECK(ring_empty(&ring));
+        CHECK_EQ(ring_depth(&ring), 0);
+    }
+    /* a half-full ring across the wrap point */
+    for (int i = 0; i < 3 * JOB_RING_SIZE; i++) {
+        CHECK(ring_push(&ring, i));
+        if (i >= JOB_RING_SIZE / 2) {
+            CHECK(ring_pop(&ring, value));
+            CHECK_EQ(value, i - JOB_RING_SIZE / 2);
+        }
+    }
+}
+
+/* 'producers' threads push their share of the values, the values of producer p being
+   p * share + k in order, 'paced' ones pausing now and then so that consumers run dry
+   and park. Consumers pop as the workers do: spin, then park until woken or done */
+void stress(int producers, int consumers, bool paced) {
+    ring_init(&ring);
+    uint64_t share = STRESS_VALUES / producers;
+    std::vector<std::atomic<uint8_t>> seen(share * producers);
+    for (auto &each: seen)
+        each.store(0);
+    std::atomic<int> done(0), disorder(0);
+    std::atomic<uint64_t> parks(0);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int c = 0; c < consumers; c++) {
+        threads.emplace_back([&]() {
+            std::vector<int64_t> last(producers, -1);
+            int value, spins = 0;
+            while (1) {
+                if (ring_pop(&ring, value)) {
+                    spins = 0;
+                    seen[value].fetch_add(1);
+                    int p = value / share;
+                    if (value <= last[p])
+                        disorder.fetch_add(1);
+                    last[p] = value;
+                } else if (done.load() == 1 && ring_empty(&ring)) {
+                    break;
+                } else if (++spins >= JOB_RING_SPINS) {
+                    spins = 0;
+                    parks.fetch_add(1);
+                    ring_park(&ring, done, 1);
+                }
+            }
+        });
+    }
+    std::vector<std::thread> pushers;
+    for (int p = 0; p < producers; p++) {
+        pushers.emplace_back([&, p]() {
+            for (uint64_t k = 0; k < share; k++) {
+                while (!ring_push(&ring, p * share + k))
+                    std::this_thread::yield();
+                ring_wake(&ring, false);
+                if (paced && k % 4096 == 4095)
+                    usleep(200);
+            }
+        });
+    }
+    for (auto &each: pushers)
+        each.join();
+    done.store(1);
+    ring_wake(&ring, true);
+    for (auto &each: threads)
+        each.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!paced)
+        printf("test_job_ring: %2d threads (%2d producers, %2d consumers): %7.2lf Mjobs/s, %lu parks\n",
+            producers + consumers, producers, consumers, share * producers / seconds / 1e6, parks.load());
+
+    uint64_t lost = 0, duplicated = 0;
+    for (auto &each: seen) {
+        lost += each.load() == 0;
+        duplicated += each.load() > 1;
+    }
+    if (lost || duplicated || disorder.load())
+        printf("%d producers, %d consumers: %lu lost, %lu duplicated, %d out of order\n", producers, consumers, lost,
+            duplicated, disorder.load());
+    CHECK_EQ(lost, 0);
+    CHECK_EQ(duplicated, 0);
+    CHECK_EQ(disorder.load(), 0);
+    CHECK(ring_empty(&ring));
+    CHECK_EQ(ring.sleepers.load(), 0);
+}
+
+int main() {
+    signal(SIGALRM, timeout);
+    alarm(STRESS_TIMEOUT);
+    single_thread();
+    /* one producer as the distributor, or as many as consumers for the free rings */
+    for (int threads = 2; threads <= 64; threads *= 2) {
+        for (int paced = 1; paced >= 0; paced--) {
+            stress(1, threads - 1, paced);
+            stress(threads / 2, threads / 2, paced);
+        }
+    }
+    return check_exit("test_job_ring");
+}
@@ -0,0 +1,155 @@
+/* core/utils/segment_ring.hpp: hand-over of segments on one thread, then segments
+ * of the device model (channel_model.h) held as a whole and released out of order,
+ * as in zero-copy mode, over thousands of generations: no segment is written while
+ * held and every record is seen once. Receiving by copies is in test_channel. */
+
+#include <algorithm>
+#include <random>
+#include <signal.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "channel_model.h"
+#include "../core/utils/segment_ring.hpp"
+
+#define RECORDS 400000
+#define WARPS 8
+#define TIMEOUT 120
+
+void timeout(int) {
+    const char msg[] = "test_segment_ring: timed out\n";
+    if (write(2, msg, sizeof(msg) - 1) < 0)
+        _exit(2);
+    _exit(1);
+}
+
+void single_thread() {
+    SegmentRing ring;
+    ring.init(doorbells, seg_gen, SEGMENTS);
+    for (int s = 0; s < SEGMENTS; s++) {
+        CHECK_EQ(seg_gen[s], s);
+        CHECK_EQ(doorbells[s], 0);
+    }
+    int seg = -1;
+    CHECK_EQ(ring.pending(seg), 0);
+    CHECK_EQ(seg, 0);
+
+    /* copied out in two parts, handed over once empty */
+    doorbells[0] = 64;
+    CHECK_EQ(ring.pending(seg), 64);
+    ring.consume(16);
+    CHECK_EQ(ring.pending(seg), 48);
+    CHECK_EQ(seg_gen[0], 0);
+    ring.consume(48);
+    CHECK_EQ(doorbells[0], 0);
+    CHECK_EQ(seg_gen[0], SEGMENTS);
+    CHECK_EQ(ring.pending(seg), 0);
+    CHECK_EQ(seg, 1);
+
+    /* held segments, released in the opposite order */
+    doorbells[1] = 32;
+    doorbells[2] = 8;
+    CHECK_EQ(ring.pending(seg), 32);
+    ring.hold();
+    CHECK_EQ(ring.pending(seg), 8);
+    CHECK_EQ(seg, 2);
+    ring.hold();
+    CHECK_EQ(ring.pending(seg), 0);
+    CHECK_EQ(seg, 3);
+    ring.release(2);
+    CHECK_EQ(seg_gen[2], 2 + SEGMENTS);
+    CHECK_EQ(seg_gen[1], 1);
+    CHECK_EQ(doorbells[1], 32);
+    ring.release(1);
+    CHECK_EQ(seg_gen[1], 1 + SEGMENTS);
+    CHECK_EQ(doorbells[1], 0);
+
+    /* wraparound onto a segment still held: not received again until released */
+    doorbells[3] = 16;
+    CHECK_EQ(ring.pending(seg), 16);
+    ring.consume(16);
+    doorbells[0] = 24;
+    CHECK_EQ(ring.pending(seg), 24);
+    CHECK_EQ(seg, 0);
+    ring.hold();
+    doorbells[1] = 8;
+    ring.consume(ring.pending(seg));
+    doorbells[2] = 8;
+    ring.consume(ring.pending(seg));
+    doorbells[3] = 8;
+    ring.consume(ring.pending(seg));
+    CHECK_EQ(ring.pending(seg), 0);
+    CHECK_EQ(seg, 0);
+    ring.release(0);
+    CHECK_EQ(seg_gen[0], 2 * SEGMENTS);
+    doorbells[0] = 8;
+    CHECK_EQ(ring.pending(seg), 8);
+    for (int s = 1; s < SEGMENTS; s++)
+        CHECK_EQ(seg_gen[s], s + 2 * SEGMENTS);
+}
+
+/* Segments held as a whole and released in random order: contents must not change
+   while held, and every record is seen once */
+void held() {
+    SegmentRing ring;
+    ring.init(doorbells, seg_gen, SEGMENTS);
+    device.init();
+    std::thread dev([&]() { device.run(WARPS, RECORDS); });
+    std::mt19937_64 rng(11);
+    struct held_t {
+        int seg;
+        uint32_t nbytes;
+        std::vector<uint64_t> copy;
+    };
+    std::vector<held_t> holding;
+    std::vector<uint8_t> seen(RECORDS, 0);
+    uint64_t received = 0, overwritten = 0, segments = 0;
+    while (received < RECORDS || !holding.empty()) {
+        int seg;
+        uint32_t nbytes = ring.pending(seg);
+        if (nbytes != 0 && holding.size() < SEGMENTS - 1) {
+            ring.hold();
+            segments++;
+            uint64_t *records = &buff[seg * SEG_SIZE / sizeof(uint64_t)];
+            held_t h = {seg, nbytes, std::vector<uint64_t>(records, records + nbytes / sizeof(uint64_t))};
+            for (uint64_t each: h.copy) {
+                if (each < RECORDS)
+                    seen[each]++;
+                received++;
+            }
+            holding.push_back(h);
+            continue;
+        }
+        if (holding.empty()) {
+            std::this_thread::yield();
+            continue;
+        }
+        /* let the device run ahead a bit before releasing one */
+        std::this_thread::yield();
+        size_t pick = rng() % holding.size();
+        held_t &h = holding[pick];
+        uint64_t *records = &buff[h.seg * SEG_SIZE / sizeof(uint64_t)];
+        overwritten += !std::equal(h.copy.begin(), h.copy.end(), records);
+        ring.release(h.seg);
+        holding.erase(holding.begin() + pick);
+    }
+    dev.join();
+    uint64_t missing = 0, duplicated = 0;
+    for (uint8_t each: seen) {
+        missing += each == 0;
+        duplicated += each > 1;
+    }
+    CHECK_EQ(received, RECORDS);
+    CHECK_EQ(missing, 0);
+    CHECK_EQ(duplicated, 0);
+    CHECK_EQ(overwritten, 0);
+    CHECK_EQ(segments, (RECORDS * sizeof(uint64_t) + SEG_SIZE - 1) / SEG_SIZE);
+}
+
+int main() {
+    signal(SIGALRM, timeout);
+    alarm(TIMEOUT);
+    single_thread();
+    held();
+    return check_exit("test_segment_ring");
+}
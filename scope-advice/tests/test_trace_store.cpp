@@ -0,0 +1,174 @@
+/* trace_store.h summaries: folding the traces of a granule keeps every distinct
+ * (class, epoch, thread) detection looks at, and nothing else, and process_summary
+ * reaches the verdicts process_trace reaches on the raw traces, repeats included.
+ * Granules range from a few keys inline to tables grown several times, and the
+ * summary is also processed in parts, as the scan does for split granules. */
+
+#include <map>
+#include <random>
+#include <set>
+#include <tuple>
+#include "check.h"
+#include "../host_pipeline.h"
+
+#define GRANULES 400
+
+typedef std::tuple<int, uint32_t, uint32_t> access_t;
+
+/* Launch with a random fence index over 'epochs' epochs, verdicts cleared */
+launch_t *make_launch(std::mt19937_64 &rng, int epochs) {
+    launch_t *l = new launch_t();
+    l->epochs = epochs;
+    l->dim.blockDim = 1024;
+    l->dim.warpsPerBlock = WARP_SIZE;
+    uint64_t blocks = (ONE << HSZ_ID) / 1024;
+    l->dim.gridDim = blocks * 1024;
+    l->dim.warpsInGrid = blocks * WARP_SIZE;
+    l->staged_fence_meta = (uint32_t *)malloc(sizeof(uint32_t) * l->dim.warpsInGrid * epochs);
+    for (uint64_t w = 0; w < (uint64_t)l->dim.warpsInGrid * epochs; w++)
+        l->staged_fence_meta[w] = (uint32_t)(rng() & rng());
+    l->fence_index_warps = l->dim.warpsInGrid;
+    l->fence_index = (epoch_mask_t *)calloc(l->fence_index_warps * WARP_SIZE, sizeof(epoch_mask_t));
+    build_fence_index(l, 0);
+    for (int e = -1; e <= epochs; e++)
+        l->fence_map[e] = new fence_info(e, false);
+    return l;
+}
+
+void free_launch(launch_t *l) {
+    for (auto &each: l->fence_map)
+        delete each.second;
+    free(l->staged_fence_meta);
+    free(l->fence_index);
+    delete l;
+}
+
+/* Verdicts of the launch, then cleared */
+std::vector<int> take_verdicts(launch_t *l) {
+    std::vector<int> verdicts;
+    for (int e = -1; e <= l->epochs; e++) {
+        fence_info *f = l->fence_map[e];
+        verdicts.push_back(f->operations.exchange(0));
+        verdicts.push_back(f->not_oversynchronized.exchange(0));
+    }
+    return verdicts;
+}
+
+/* Traces of a granule: 'keys' groups of threads at most, so that the summary ends inline or
+   in a table of about that many keys, and repeats of the traces already there */
+std::vector<uint64_t> make_traces(std::mt19937_64 &rng, int epochs, uint64_t keys) {
+    std::vector<uint64_t> traces;
+    uint64_t n = 1 + rng() % (4 * keys * 8);
+    uint32_t base = rng() % (ONE << HSZ_ID);
+    for (uint64_t j = 0; j < n; j++) {
+        if (!traces.empty() && rng() % 4 == 0) {
+            traces.push_back(traces[rng() % traces.size()]);
+            continue;
+        }
+        uint64_t trace = 0;
+        int op = rng() % 6;
+        setBits(trace, HPOS_LD, 1, op != 3 && op != 5);
+        setBits(trace, HPOS_ST, 1, op >= 3);
+        setBits(trace, HPOS_SCP, HSZ_SCP, rng() % 4);
+        /* threads of a few groups around 'base', the last thread id included */
+        uint32_t tid = rng() % 8 == 0 ? (ONE << HSZ_ID) - 1 - rng() % 64 : (base + rng() % (keys * 32)) % (ONE << HSZ_ID);
+        setBits(trace, HPOS_ID, HSZ_ID, tid);
+        setBits(trace, HPOS_EP, HSZ_EP, rng() % epochs);
+        traces.push_back(trace);
+    }
+    return traces;
+}
+
+/* What detection looks at in a trace, threads only where the rule needs them */
+access_t access_of(uint64_t trace) {
+    int cls = trace_class(trace);
+    uint32_t epoch = getBits(trace, HPOS_EP, HSZ_EP), tid = getBits(trace, HPOS_ID, HSZ_ID);
+    bool threaded = cls == TRACE_WEAK_LD || cls == TRACE_STORE;
+    return access_t(cls, epoch, threaded ? tid : 0);
+}
+
+std::set<access_t> summary_accesses(granule_summary_t *s) {
+    std::set<access_t> accesses;
+    for (uint32_t mask = s->atomic_epochs; mask; mask &= mask - 1)
+        accesses.insert(access_t(TRACE_ATOMIC, __builtin_ctz(mask), 0));
+    for (uint32_t mask = s->strong_epochs; mask; mask &= mask - 1)
+        accesses.insert(access_t(TRACE_STRONG_LD, __builtin_ctz(mask), 0));
+    summary_entry_t *slots = summary_slots(s);
+    for (uint32_t j = 0; j < s->capacity; j++) {
+        if (slots[j].key == SUMMARY_EMPTY)
+            continue;
+        int cls = key_store(slots[j].key) ? TRACE_STORE : TRACE_WEAK_LD;
+        for (uint32_t lanes = slots[j].lanes; lanes; lanes &= lanes - 1)
+            accesses.insert(access_t(cls, key_epoch(slots[j].key), key_tid(slots[j].key, __builtin_ctz(lanes))));
+    }
+    return accesses;
+}
+
+int main() {
+    std::mt19937_64 rng(21);
+    uint64_t wrong_accesses = 0, wrong_whole = 0, wrong_split = 0, wrong_shape = 0;
+    uint64_t inline_only = 0, tables = 0, grown = 0;
+    trace_arena_t arena;
+    arena.cur = arena.end = NULL;
+    /* one launch per number of epochs, the fence index of a whole grid takes a while to build */
+    std::map<int, launch_t *> launches;
+    for (int g = 0; g < GRANULES; g++) {
+        int epochs = 1 + rng() % 31;
+        if (!launches.count(epochs))
+            launches[epochs] = make_launch(rng, epochs);
+        launch_t *l = launches[epochs];
+        const uint64_t spans[] = {1, 4, SUMMARY_INLINE, 64, 1024};
+        std::vector<uint64_t> traces = make_traces(rng, epochs, spans[g % 5]);
+
+        granule_summary_t *s = summary_create(&arena);
+        std::set<access_t> raw;
+        std::set<std::tuple<bool, uint32_t, uint32_t>> keys;
+        for (uint64_t trace: traces) {
+            int cls = trace_class(trace);
+            if (cls < 0)
+                continue;
+            uint32_t epoch = getBits(trace, HPOS_EP, HSZ_EP), tid = getBits(trace, HPOS_ID, HSZ_ID);
+            summary_add(&arena, s, cls, epoch, tid);
+            raw.insert(access_of(trace));
+            if (cls == TRACE_WEAK_LD || cls == TRACE_STORE)
+                keys.insert(std::make_tuple(cls == TRACE_STORE, epoch, tid >> 5));
+        }
+        wrong_accesses += summary_accesses(s) != raw;
+        /* keys inline until SUMMARY_INLINE, then a power-of-two table at most half full */
+        wrong_shape += s->count != keys.size();
+        if (s->table == NULL) {
+            inline_only++;
+            wrong_shape += s->capacity != SUMMARY_INLINE || s->count > SUMMARY_INLINE;
+        } else {
+            tables++;
+            grown += s->capacity > SUMMARY_TABLE_MIN;
+            wrong_shape += s->count <= SUMMARY_INLINE || (s->capacity & (s->capacity - 1)) != 0 ||
+                2 * s->count > s->capacity;
+        }
+
+        for (uint64_t trace: traces)
+            process_trace(l, trace);
+        std::vector<int> expected = take_verdicts(l);
+        process_summary(l, s, 0, TRACES_ALL);
+        wrong_whole += take_verdicts(l) != expected;
+        /* random parts, the last one open-ended as sched_split leaves it */
+        uint64_t begin = 0;
+        while (begin < s->capacity) {
+            uint64_t end = begin + 1 + rng() % max((uint64_t)s->capacity / 3, (uint64_t)1);
+            process_summary(l, s, begin, end >= s->capacity ? TRACES_ALL : end);
+            begin = end;
+        }
+        wrong_split += take_verdicts(l) != expected;
+    }
+    for (auto &each: launches)
+        free_launch(each.second);
+    arena_release(&arena);
+    printf("test_trace_store: %lu granules inline, %lu with a table (%lu grown past the first one)\n", inline_only,
+        tables, grown);
+    CHECK(inline_only > 0 && tables > 0 && grown > 0);
+    CHECK_EQ(wrong_accesses, 0);
+    CHECK_EQ(wrong_shape, 0);
+    CHECK_EQ(wrong_whole, 0);
+    CHECK_EQ(wrong_split, 0);
+    return check_exit("test_trace_store");
+}
@@ -0,0 +1,110 @@
+/* common.h wire format: every trace field at its limits round-trips through
+ * make_channel/channel_trace along with the type and version, whatever the address,
+ * and channel_pass_valid accepts whole v2 passes only. */
+
+#include <random>
+#include <vector>
+#include "check.h"
+#include "../common.h"
+
+/* fields of a trace, in the order of h_position_t */
+typedef struct {
+    uint64_t ld, st, scope, id, epoch;
+} trace_fields_t;
+
+uint64_t pack(const trace_fields_t &f) {
+    uint64_t trace = 0;
+    setBits(trace, HPOS_LD, 1, f.ld);
+    setBits(trace, HPOS_ST, 1, f.st);
+    setBits(trace, HPOS_SCP, HSZ_SCP, f.scope);
+    setBits(trace, HPOS_ID, HSZ_ID, f.id);
+    setBits(trace, HPOS_EP, HSZ_EP, f.epoch);
+    return trace;
+}
+
+void round_trip(const trace_fields_t &f, uint64_t addr, type_t type) {
+    channel_t c;
+    make_channel(c, addr, pack(f), type);
+    uint64_t trace = channel_trace(c);
+    CHECK_EQ(c.addr, addr);
+    CHECK_EQ(channel_type(c), type);
+    CHECK_EQ(channel_version(c), WIRE_VERSION);
+    CHECK_EQ(trace, pack(f));
+    CHECK_EQ(getBits(trace, HPOS_LD, 1), f.ld);
+    CHECK_EQ(getBits(trace, HPOS_ST, 1), f.st);
+    CHECK_EQ(getBits(trace, HPOS_SCP, HSZ_SCP), f.scope);
+    CHECK_EQ(getBits(trace, HPOS_ID, HSZ_ID), f.id);
+    CHECK_EQ(getBits(trace, HPOS_EP, HSZ_EP), f.epoch);
+}
+
+void layout() {
+    CHECK_EQ(sizeof(channel_t), 16);
+    /* fields follow each other without overlap, the trace ends before version and type */
+    CHECK_EQ(HPOS_ST, HPOS_LD + 1);
+    CHECK_EQ(HPOS_SCP, HPOS_ST + 1);
+    CHECK_EQ(HPOS_ID, HPOS_SCP + HSZ_SCP);
+    CHECK_EQ(HPOS_EP, HPOS_ID + HSZ_ID);
+    CHECK(HPOS_EP + HSZ_EP <= HSZ_TRACE);
+    CHECK((uint32_t)HSZ_TRACE <= (uint32_t)HPOS_VER);
+    CHECK_EQ(HPOS_TYPE, HPOS_VER + HSZ_VER);
+    CHECK_EQ(HPOS_TYPE + HSZ_TYPE, 64);
+    CHECK(WIRE_VERSION < (1 << HSZ_VER));
+}
+
+void limits() {
+    const uint64_t ids[] = {0, 1, (ONE << HSZ_ID) / 2, (ONE << HSZ_ID) - 2, (ONE << HSZ_ID) - 1};
+    const uint64_t epochs[] = {0, 1, (ONE << HSZ_EP) - 2, (ONE << HSZ_EP) - 1};
+    const uint64_t addrs[] = {0, 1, ONE << 32, (ONE << 48) - 1, ~ONE, ~(uint64_t)0};
+    const type_t types[] = {TYPE_INV, TYPE_MEM, TYPE_SYN};
+    for (uint64_t ld = 0; ld < 2; ld++)
+        for (uint64_t st = 0; st < 2; st++)
+            for (uint64_t scope = SCOPE_NONE; scope <= SCOPE_SYS; scope++)
+                for (uint64_t id: ids)
+                    for (uint64_t epoch: epochs)
+                        for (uint64_t addr: addrs)
+                            for (type_t type: types)
+                                round_trip({ld, st, scope, id, epoch}, addr, type);
+    /* every trace bit set */
+    channel_t c;
+    make_channel(c, 0, (ONE << HSZ_TRACE) - 1, TYPE_MEM);
+    CHECK_EQ(channel_trace(c), (ONE << HSZ_TRACE) - 1);
+    CHECK_EQ(channel_type(c), TYPE_MEM);
+    CHECK_EQ(channel_version(c), WIRE_VERSION);
+}
+
+void random_traces() {
+    std::mt19937_64 rng(5);
+    for (int j = 0; j < 1000000; j++) {
+        trace_fields_t f = {rng() & 1, rng() & 1, rng() % 4, rng() % (ONE << HSZ_ID), rng() % (ONE << HSZ_EP)};
+        round_trip(f, rng(), (type_t)(rng() % 3));
+    }
+}
+
+void passes() {
+    std::vector<channel_t> pass(4);
+    for (auto &each: pass)
+        make_channel(each, 7, pack({1, 0, SCOPE_GPU, 3, 2}), TYPE_MEM);
+    make_channel(pass.back(), 0, 0, TYPE_INV);
+    const char *bytes = (const char *)pass.data();
+    uint64_t size = pass.size() * sizeof(channel_t);
+    CHECK(channel_pass_valid(bytes, size));
+    CHECK(channel_pass_valid(bytes, sizeof(channel_t)));
+    CHECK(!channel_pass_valid(bytes, 0));
+    CHECK(!channel_pass_valid(bytes, size - 1));
+    CHECK(!channel_pass_valid(bytes, size + sizeof(channel_t) / 2));
+    /* records of another format version, first or last */
+    setBits(pass.back().info, HPOS_VER, HSZ_VER, WIRE_VERSION + 1);
+    CHECK(!channel_pass_valid(bytes, size));
+    CHECK(channel_pass_valid(bytes, size - sizeof(channel_t)));
+    setBits(pass.back().info, HPOS_VER, HSZ_VER, WIRE_VERSION);
+    setBits(pass.front().info, HPOS_VER, HSZ_VER, 0);
+    CHECK(!channel_pass_valid(bytes, size));
+}
+
+int main() {
+    layout();
+    limits();
+    random_traces();
+    passes();
+    return check_exit("test_wire_format");
+}
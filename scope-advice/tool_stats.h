@@ -0,0 +1,192 @@
+#ifndef TOOL_STATS_H
+#define TOOL_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <time.h>
+
+/* Counters and latency histograms of the hot paths of the host analysis, written
+ * as JSON at the end of the run (STATS_FILE). Each worker owns one thread_stats_t
+ * and is its only writer, so updates are plain increments on a line of its own;
+ * the feeding thread (distributor, or main thread of the host tools) owns the
+ * pipeline_stats_t. Nothing is merged until the threads are gone.
+ *
+ * Histograms have power-of-two buckets: bucket b counts values v with
+ * 2^(b-1) <= v < 2^b, bucket 0 the zeros. Queue depth over time is kept as a
+ * bounded series: once full, every other sample is dropped and the sampling
+ * stride doubles, so the series always spans the whole run. */
+
+#define STATS_BUCKETS 48
+#define STATS_SAMPLES 1024
+
+typedef struct _stats_hist_t {
+    uint64_t count, sum, max;
+    uint64_t buckets[STATS_BUCKETS];
+} stats_hist_t;
+
+typedef struct _stats_series_t {
+    /* samples kept, stride is 2^shift of the values offered */
+    uint32_t n, shift;
+    uint64_t offered;
+    float ms[STATS_SAMPLES];
+    uint32_t value[STATS_SAMPLES];
+} stats_series_t;
+
+/* Per worker. Latencies in microseconds but for backoff_us, the requested sleeps
+   lock_retries: granule lock found taken, each one followed by a backoff sleep
+   fold_batch: packets folded per granule lock taken
+   idle_spins: failed pops on empty queues, parks: times the worker went to sleep on them */
+typedef struct alignas(64) _thread_stats_t {
+    uint64_t lock_retries, summaries, idle_spins, parks, buffers;
+    stats_hist_t backoff_us, fold_batch, park_us, buffer_us, index_us, scan_us;
+} thread_stats_t;
+
+/* Feeding thread
+   free_stalls: polls for a free buffer that found none, i.e., the workers were behind
+   queue_depth: jobs queued (buffers and detection tasks) as each message pass is queued */
+typedef struct _pipeline_stats_t {
+    uint64_t free_stalls;
+    stats_hist_t pass_bytes, queue_depth, staging_us;
+    stats_series_t depth_series;
+    /* time origin of the series */
+    uint64_t origin_ns;
+} pipeline_stats_t;
+
+static uint64_t stats_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void hist_add(stats_hist_t *h, uint64_t v) {
+    int b = v == 0 ? 0 : 64 - __builtin_clzll(v);
+    h->buckets[b < STATS_BUCKETS ? b : STATS_BUCKETS - 1]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+static void hist_merge(stats_hist_t *into, const stats_hist_t *h) {
+    for (int b = 0; b < STATS_BUCKETS; b++)
+        into->buckets[b] += h->buckets[b];
+    into->count += h->count;
+    into->sum += h->sum;
+    if (h->max > into->max)
+        into->max = h->max;
+}
+
+static void series_add(stats_series_t *s, float ms, uint32_t value) {
+    uint64_t k = s->offered++;
+    if (k & ((1ull << s->shift) - 1))
+        return;
+    if (s->n == STATS_SAMPLES) {
+        for (uint32_t j = 0; j < STATS_SAMPLES / 2; j++) {
+            s->ms[j] = s->ms[2 * j];
+            s->value[j] = s->value[2 * j];
+        }
+        s->n = STATS_SAMPLES / 2;
+        s->shift++;
+        /* samples kept are those of every 2^shift-th value */
+        if (k & ((1ull << s->shift) - 1))
+            return;
+    }
+    s->ms[s->n] = ms;
+    s->value[s->n++] = value;
+}
+
+static void thread_stats_merge(thread_stats_t *into, const thread_stats_t *t) {
+    into->lock_retries += t->lock_retries;
+    into->summaries += t->summaries;
+    into->idle_spins += t->idle_spins;
+    into->parks += t->parks;
+    into->buffers += t->buffers;
+    hist_merge(&into->backoff_us, &t->backoff_us);
+    hist_merge(&into->fold_batch, &t->fold_batch);
+    hist_merge(&into->park_us, &t->park_us);
+    hist_merge(&into->buffer_us, &t->buffer_us);
+    hist_merge(&into->index_us, &t->index_us);
+    hist_merge(&into->scan_us, &t->scan_us);
+}
+
+/* JSON output. Objects are written member by member, 'sep' being what goes before
+   the member: "" for the first one, "," for the others */
+static void json_string(FILE *f, const std::string &s) {
+    fputc('"', f);
+    for (unsigned char c: s) {
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void json_key(FILE *f, const char *sep, const char *key) {
+    fprintf(f, "%s\n\"%s\": ", sep, key);
+}
+
+static void json_u64(FILE *f, const char *sep, const char *key, uint64_t v) {
+    json_key(f, sep, key);
+    fprintf(f, "%lu", v);
+}
+
+static void json_double(FILE *f, const char *sep, const char *key, double v) {
+    json_key(f, sep, key);
+    fprintf(f, "%lf", v);
+}
+
+/* count, sum, max, mean, and the non-empty buckets as [lowest value, count] */
+static void json_hist(FILE *f, const char *sep, const char *key, const stats_hist_t *h) {
+    json_key(f, sep, key);
+    fprintf(f, "{\"count\": %lu, \"sum\": %lu, \"max\": %lu, \"mean\": %lf, \"buckets\": [", h->count, h->sum,
+        h->max, h->count ? (double)h->sum / h->count : 0.0);
+    const char *comma = "";
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        if (h->buckets[b] == 0)
+            continue;
+        fprintf(f, "%s[%lu, %lu]", comma, b == 0 ? (uint64_t)0 : (uint64_t)1 << (b - 1), h->buckets[b]);
+        comma = ", ";
+    }
+    fprintf(f, "]}");
+}
+
+static void json_series(FILE *f, const char *sep, const char *key, const stats_series_t *s) {
+    json_key(f, sep, key);
+    fprintf(f, "{\"stride\": %lu, \"ms\": [", (uint64_t)1 << s->shift);
+    for (uint32_t j = 0; j < s->n; j++)
+        fprintf(f, "%s%.3f", j ? ", " : "", s->ms[j]);
+    fprintf(f, "], \"value\": [");
+    for (uint32_t j = 0; j < s->n; j++)
+        fprintf(f, "%s%u", j ? ", " : "", s->value[j]);
+    fprintf(f, "]}");
+}
+
+/* Members of a thread_stats_t */
+static void json_thread_stats(FILE *f, const char *sep, const thread_stats_t *t) {
+    json_u64(f, sep, "lock_retries", t->lock_retries);
+    json_u64(f, ",", "summaries", t->summaries);
+    json_u64(f, ",", "idle_spins", t->idle_spins);
+    json_u64(f, ",", "parks", t->parks);
+    json_u64(f, ",", "buffers", t->buffers);
+    json_hist(f, ",", "backoff_us", &t->backoff_us);
+    json_hist(f, ",", "fold_batch", &t->fold_batch);
+    json_hist(f, ",", "park_us", &t->park_us);
+    json_hist(f, ",", "buffer_us", &t->buffer_us);
+    json_hist(f, ",", "index_us", &t->index_us);
+    json_hist(f, ",", "scan_us", &t->scan_us);
+}
+
+/* Members of a pipeline_stats_t */
+static void json_pipeline_stats(FILE *f, const char *sep, const pipeline_stats_t *p) {
+    json_u64(f, sep, "free_stalls", p->free_stalls);
+    json_hist(f, ",", "pass_bytes", &p->pass_bytes);
+    json_hist(f, ",", "queue_depth", &p->queue_depth);
+    json_series(f, ",", "queue_depth_series", &p->depth_series);
+    json_hist(f, ",", "staging_us", &p->staging_us);
+}
+
+#endif /* TOOL_STATS_H */
@@ -0,0 +1,203 @@
+#ifndef TRACE_STORE_H
+#define TRACE_STORE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+#include "cpu_topology.h"
+
+/* Host-side storage for the traces received per GRAN of memory.
+ * Traces are folded into a summary per granule as they come in, keeping only
+ * what detection looks at: the epoch, the class of the access, and, when the
+ * rule depends on the thread (weak loads, stores), the thread. Atomics and
+ * loads at GPU or system scope only need their epochs, one bit each. Other
+ * accesses are keyed by (class, epoch, group of 32 thread ids), with a bit per
+ * thread of the group. Repeated traces fold into what is already there, so no
+ * deduplication pass is needed.
+ *
+ * The summary is not of a fixed size. Weak loads and stores are judged by the
+ * previous or next fence of their own thread, which is only known once the
+ * fence_meta of the kernel is staged, long after ingest: dropping a thread
+ * before that could leave a needed fence reported as over-synchronized. So the
+ * storage of a granule is bounded by the distinct (class, epoch, thread) it
+ * sees, at most 2 x epochs x threads of the grid bits, rather than by the
+ * packets, and it stays within the 128B header for up to SUMMARY_INLINE keys.
+ *
+ * Past SUMMARY_INLINE keys they move to an open-addressing table. Summaries
+ * and tables are carved out of large per-worker slabs with a bump pointer, so
+ * the ingest path never goes through malloc (and its locks) per granule. Slabs
+ * are returned to the system once the launch they hold traces of is analyzed. */
+
+/* Classes of traces, as far as detection is concerned */
+#define TRACE_ATOMIC 0
+#define TRACE_STRONG_LD 1
+#define TRACE_WEAK_LD 2
+#define TRACE_STORE 3
+
+/* widths of the epoch and thread id of a trace a key can hold */
+#define SUMMARY_EPOCH_BITS 5
+#define SUMMARY_ID_BITS 23
+#define SUMMARY_GROUP_BITS (SUMMARY_ID_BITS - 5)
+#define SUMMARY_EMPTY UINT32_MAX
+/* keys held inline, keeps a summary at 128B, i.e., two cache lines */
+#define SUMMARY_INLINE 13
+/* slots of the first table, doubled whenever it gets half full */
+#define SUMMARY_TABLE_MIN 32
+/* Slab handed out to a worker when its current one runs dry */
+#define SLAB_SIZE (4l << 20)
+
+/* key: store bit, epoch, thread id / 32. lanes: thread id % 32 of the threads seen */
+typedef struct _summary_entry_t {
+    uint32_t key;
+    uint32_t lanes;
+} summary_entry_t;
+
+/* Stored (as a pointer) in access_map for each granule that received a packet
+   atomic_epochs, strong_epochs: epochs with atomics, and with loads at GPU or system scope
+   count: keys held, capacity: slots of 'table', or SUMMARY_INLINE while it is NULL */
+typedef struct _granule_summary_t {
+    uint32_t atomic_epochs, strong_epochs;
+    uint32_t count, capacity;
+    summary_entry_t *table;
+    summary_entry_t inline_entries[SUMMARY_INLINE];
+} granule_summary_t;
+static_assert(sizeof(granule_summary_t) == 128, "granule summary should span two cache lines");
+
+/* Bump allocator, one per worker thread. Not thread-safe by design */
+typedef struct _trace_arena_t {
+    char *cur, *end;
+    std::vector<char*> slabs;
+} trace_arena_t;
+
+static void *arena_alloc(trace_arena_t *arena, size_t bytes) {
+    /* keep every allocation 16B aligned */
+    bytes = (bytes + 15) & ~((size_t)15);
+    if (arena->cur == NULL || arena->cur + bytes > arena->end) {
+        /* first touched by the worker, so the slab lives on its node */
+        char *slab = (char *)huge_alloc(SLAB_SIZE);
+        arena->slabs.push_back(slab);
+        arena->cur = slab;
+        arena->end = slab + SLAB_SIZE;
+    }
+    void *ptr = arena->cur;
+    arena->cur += bytes;
+    return ptr;
+}
+
+static void arena_release(trace_arena_t *arena) {
+    for (auto slab : arena->slabs)
+        huge_free(slab, SLAB_SIZE);
+    arena->slabs.clear();
+    arena->cur = arena->end = NULL;
+}
+
+static granule_summary_t *summary_create(trace_arena_t *arena) {
+    granule_summary_t *summary = (granule_summary_t *)arena_alloc(arena, sizeof(granule_summary_t));
+    summary->atomic_epochs = summary->strong_epochs = 0;
+    summary->count = 0;
+    summary->capacity = SUMMARY_INLINE;
+    summary->table = NULL;
+    for (int i = 0; i < SUMMARY_INLINE; i++)
+        summary->inline_entries[i].key = SUMMARY_EMPTY;
+    return summary;
+}
+
+static uint32_t summary_key(bool store, uint32_t epoch, uint32_t tid) {
+    return ((uint32_t)store << (SUMMARY_EPOCH_BITS + SUMMARY_GROUP_BITS)) | (epoch << SUMMARY_GROUP_BITS) | (tid >> 5);
+}
+
+static bool key_store(uint32_t key) {
+    return (key >> (SUMMARY_EPOCH_BITS + SUMMARY_GROUP_BITS)) & 1;
+}
+
+static uint32_t key_epoch(uint32_t key) {
+    return (key >> SUMMARY_GROUP_BITS) & ((1u << SUMMARY_EPOCH_BITS) - 1);
+}
+
+/* thread id of 'lane' in the group of 'key' */
+static uint32_t key_tid(uint32_t key, int lane) {
+    return ((key & ((1u << SUMMARY_GROUP_BITS) - 1)) << 5) | lane;
+}
+
+/* Slots of the summary, some of them may be SUMMARY_EMPTY */
+static summary_entry_t *summary_slots(granule_summary_t *summary) {
+    return summary->table != NULL ? summary->table : summary->inline_entries;
+}
+
+/* Slot of 'key' in a table of 'capacity' slots (a power of two), or the empty one it goes to */
+static summary_entry_t *table_probe(summary_entry_t *table, uint32_t capacity, uint32_t key) {
+    uint32_t at = (key * 2654435761u) & (capacity - 1);
+    while (table[at].key != key && table[at].key != SUMMARY_EMPTY)
+        at = (at + 1) & (capacity - 1);
+    return &table[at];
+}
+
+/* Move the keys to a table of 'capacity' slots. The old table stays in the arena until it is released */
+static void summary_rehash(trace_arena_t *arena, granule_summary_t *summary, uint32_t capacity) {
+    summary_entry_t *table = (summary_entry_t *)arena_alloc(arena, capacity * sizeof(summary_entry_t));
+    for (uint32_t i = 0; i < capacity; i++)
+        table[i].key = SUMMARY_EMPTY;
+    summary_entry_t *old = summary_slots(summary);
+    for (uint32_t i = 0; i < summary->capacity; i++) {
+        if (old[i].key != SUMMARY_EMPTY)
+            *table_probe(table, capacity, old[i].key) = old[i];
+    }
+    summary->table = table;
+    summary->capacity = capacity;
+}
+
+/* Fold one trace of class 'cls' in. Caller must hold the granule lock */
+static void summary_add(trace_arena_t *arena, granule_summary_t *summary, int cls, uint32_t epoch, uint32_t tid) {
+    if (cls == TRACE_ATOMIC) {
+        summary->atomic_epochs |= 1u << epoch;
+        return;
+    }
+    if (cls == TRACE_STRONG_LD) {
+        summary->strong_epochs |= 1u << epoch;
+        return;
+    }
+    uint32_t key = summary_key(cls == TRACE_STORE, epoch, tid);
+    uint32_t lane = 1u << (tid & 31);
+    summary_entry_t *entry;
+    if (summary->table == NULL) {
+        /* inline keys are packed at the front */
+        for (uint32_t i = 0; i < summary->count; i++) {
+            if (summary->inline_entries[i].key == key) {
+                summary->inline_entries[i].lanes |= lane;
+                return;
+            }
+        }
+        if (summary->count < SUMMARY_INLINE) {
+            entry = &summary->inline_entries[summary->count++];
+            entry->key = key;
+            entry->lanes = lane;
+            return;
+        }
+        summary_rehash(arena, summary, SUMMARY_TABLE_MIN);
+    }
+    entry = table_probe(summary->table, summary->capacity, key);
+    if (entry->key == key) {
+        entry->lanes |= lane;
+        return;
+    }
+    if (2 * (summary->count + 1) > summary->capacity) {
+        summary_rehash(arena, summary, 2 * summary->capacity);
+        entry = table_probe(summary->table, summary->capacity, key);
+    }
+    entry->key = key;
+    entry->lanes = lane;
+    summary->count++;
+}
+
+/* Threads recorded under the keys, i.e., distinct traces left to check */
+static uint64_t summary_threads(granule_summary_t *summary) {
+    uint64_t threads = 0;
+    summary_entry_t *slots = summary_slots(summary);
+    for (uint32_t i = 0; i < summary->capacity; i++) {
+        if (slots[i].key != SUMMARY_EMPTY)
+            threads += __builtin_popcount(slots[i].lanes);
+    }
+    return threads;
+}
+
+#endif /* TRACE_STORE_H */
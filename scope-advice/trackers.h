@@ -21,7 +21,7 @@ struct _fence_info_t {
     std::string get_comment(int next) {
         std::string output;
         int cur = operations.load();
-        if (DO_FILTER) {
+        if (DO_FILTER(tool_mode)) {
             /* This flag loses information that helps getting the exact Variant.
                Use it for faster analysis without exact variant info.
                Problem is differentiating between Variant 1 and 3.  */
@@ -54,19 +54,10 @@ struct _fence_info_t {
 };
 
 typedef struct _fence_info_t fence_info;
-std::unordered_map<int, fence_info*> fence_map;
 
-/* Keeping track of memory allocations by the kernel */
-struct range_t {
-    uint64_t base, bound;
-
-    range_t(uint64_t _addr, uint64_t _bound) {
-        base = _addr;
-        bound = _bound;
-    }
-};
-typedef struct range_t allocation;
-std::vector<allocation> allocation_records;
+/* Keeping track of live memory allocations of the application */
+#include "alloc_registry.h"
+alloc_registry_t allocation_records;
 
 #include <chrono>
 struct duration_t {
@@ -91,15 +82,26 @@ struct duration_t {
     }
 };
 typedef struct duration_t duration;
-duration instrumentation, setup, kernel, message, detection;
+/* message and detection add up the times of every launch. pipeline spans from the
+   first traced kernel to the end of the last analysis, only its begin/terminate are used */
+duration instrumentation, setup, kernel, message, staging, detection, pipeline;
+/* launches run uninstrumented since their kernel was resolved, the time their instrumented runs
+   would have taken (mean of the traced launches of the kernel), and packets not processed because
+   the kernel got resolved while they were in flight */
+int launches_uninstrumented = 0;
+double early_saved_ms = 0;
+std::atomic<uint64_t> drained_packets(0);
+/* time each worker spent on channel buffers, and packets in them */
+duration worker_busy[MAX_THREADS];
+uint64_t worker_packets[MAX_THREADS];
 
 double getChannelCommunicationInMillis() {
-    return (double)std::chrono::duration_cast<std::chrono::microseconds>(detection.begin - message.begin).count() / 1000;
+    return message.getMillis();
 }
 
 double getE2EInMillis() {
-    if (DO_ANALYZE) {
-        double part = (double)std::chrono::duration_cast<std::chrono::microseconds>(detection.terminate - kernel.begin).count() / 1000;
+    if (DO_ANALYZE(tool_mode)) {
+        double part = (double)std::chrono::duration_cast<std::chrono::microseconds>(pipeline.terminate - pipeline.begin).count() / 1000;
         return (part + instrumentation.getMillis() + setup.getMillis());
     } else {
         // Time accesses to measure NVBit overheads
@@ -107,9 +109,12 @@ double getE2EInMillis() {
     }
 }
 
-/* Memory overhead trackers. Currently only double values.
-   TODO: Consider binding them to range_t? */
+/* Memory overhead trackers. Currently only double values. */
 double app_mem = 0, meta_mem = 0, fence_mem = 0, samp_mem = 0;
+/* host memory holding staged device metadata */
+double staged_mem = 0;
+/* pinned host memory the metadata is staged into, reused across launches */
+double pinned_mem = 0;
 
 void printTrackers() {
     printf("========== TIMING ==========\n");
@@ -117,8 +122,30 @@ void printTrackers() {
     printf("Setup time: %lf ms\n", setup.getMillis());
     printf("Kernel time: %lf ms\n", kernel.getMillis());
     printf("Channel process (communication channel): %lf ms\n", getChannelCommunicationInMillis());
+    printf("Metadata staging: %lf ms (%lf MB, %lf MB pinned)\n", staging.getMillis(), staged_mem / (1024 * 1024),
+        pinned_mem / (1024 * 1024));
     printf("Detection time: %lf ms\n", detection.getMillis());
     printf("E2E time: %lf ms\n", getE2EInMillis());
+    if (DO_ANALYZE(tool_mode))
+        printf("Early termination: %d launches uninstrumented, %lu packets drained, %lf ms saved (est.)\n",
+            launches_uninstrumented, drained_packets.load(), early_saved_ms);
+    for (int n = 0; n < topology.nodes; n++) {
+        int workers = 0;
+        uint64_t packets = 0;
+        double busy = 0;
+        for (int w = 0; w < num_threads; w++) {
+            if (worker_node[w] != n)
+                continue;
+            workers++;
+            packets += worker_packets[w];
+            busy += worker_busy[w].getMillis();
+        }
+        if (workers == 0)
+            continue;
+        /* rate of the node with all its workers busy */
+        printf("Node %d: %d workers, %lu packets in %lf ms busy, %lf Mpackets/s\n", topology.id[n], workers,
+            packets, busy, busy > 0 ? packets * workers / busy / 1000 : 0.0);
+    }
 
     printf("========== MEMORY ==========\n");
     printf("App: %lf MB\n", app_mem / (1024 * 1024));
@@ -127,3 +154,28 @@ void printTrackers() {
     printf("Metadata (Sampling): %lf MB\n", samp_mem / (1024 * 1024));
     printf("Overhead: %lf x\n", (meta_mem + samp_mem + fence_mem) / app_mem);
 }
+
+/* Same as printTrackers, as the "timing" and "memory" members of the stats file. Sizes in MB */
+void jsonTrackers(FILE *f, const char *sep) {
+    json_key(f, sep, "timing");
+    json_double(f, "{", "instrumentation_ms", instrumentation.getMillis());
+    json_double(f, ",", "setup_ms", setup.getMillis());
+    json_double(f, ",", "kernel_ms", kernel.getMillis());
+    json_double(f, ",", "channel_ms", getChannelCommunicationInMillis());
+    json_double(f, ",", "staging_ms", staging.getMillis());
+    json_double(f, ",", "staged_mb", staged_mem / (1024 * 1024));
+    json_double(f, ",", "pinned_mb", pinned_mem / (1024 * 1024));
+    json_double(f, ",", "detection_ms", detection.getMillis());
+    json_double(f, ",", "e2e_ms", getE2EInMillis());
+    json_u64(f, ",", "launches_uninstrumented", launches_uninstrumented);
+    json_u64(f, ",", "drained_packets", drained_packets.load());
+    json_double(f, ",", "early_saved_ms", early_saved_ms);
+    fprintf(f, "}");
+    json_key(f, ",", "memory");
+    json_double(f, "{", "app_mb", app_mem / (1024 * 1024));
+    json_double(f, ",", "metadata_mb", meta_mem / (1024 * 1024));
+    json_double(f, ",", "fence_mb", fence_mem / (1024 * 1024));
+    json_double(f, ",", "sampling_mb", samp_mem / (1024 * 1024));
+    json_double(f, ",", "overhead", app_mem > 0 ? (meta_mem + samp_mem + fence_mem) / app_mem : 0.0);
+    fprintf(f, "}");
+}
@@ -1,3 +1,3 @@
 #!/bin/bash
 
-LD_PRELOAD=../../scope-advice/scope-advice.so ./og > run.out
+STATS_FILE=stats.json LD_PRELOAD=../../scope-advice/scope-advice.so ./og > run.out
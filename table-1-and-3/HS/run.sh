@@ -1,3 +1,3 @@
 #!/bin/bash
 
-LD_PRELOAD=../../scope-advice/scope-advice.so ./hashtable > run.out
+STATS_FILE=stats.json LD_PRELOAD=../../scope-advice/scope-advice.so ./hashtable > run.out
@@ -1,4 +1,4 @@
 #/bin/bash
 
-LD_PRELOAD=../../scope-advice/scope-advice.so KERNELID=Recurrence9 INSTANCE=2 ./og 80000000 > run.out
+STATS_FILE=stats.json LD_PRELOAD=../../scope-advice/scope-advice.so KERNELID=Recurrence9 INSTANCE=2 ./og 80000000 > run.out
 
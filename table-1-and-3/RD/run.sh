@@ -8,4 +8,4 @@ then
     cd ../table-1-and-3/RD
 fi
 
-LD_PRELOAD=../../scope-advice/scope-advice.so ./og < ../../data/red > run.out
+STATS_FILE=stats.json LD_PRELOAD=../../scope-advice/scope-advice.so ./og < ../../data/red > run.out
@@ -1,11 +1,11 @@
 #!/bin/bash
 
-# Build scope-advice with the correct configuration
+# Build scope-advice, SA_MODE selects the configuration of the tables
 cd ../scope-advice
-git checkout .
-git apply patch/scope-advice.patch
-make -B
+make
 cd ../table-1-and-3
+export SA_MODE=scope-advice
+export NUM_THREADS=12 NUM_BUFFERS=768
 
 # Ensure that the run file in root directory is done before running this script
 for dir in */
@@ -1,12 +1,26 @@
 #!/bin/bash
-OUT="run.out"
+STATS="stats.json"
 FEN="fence.out"
 MEM="mem.out"
 
 # This script expects a folder which is being processed
 
-# Separate fence data
-cat $1/$OUT | grep 'Fence@' > $1/$FEN
+# Separate fence data and memory metadata from the stats file the tool wrote,
+# in the format of its printed output
+python3 - $1/$STATS $1/$FEN $1/$MEM << 'EOF'
+import json, sys
 
-# and memory metadata
-tail -n 5 $1/$OUT > $1/$MEM
+stats = json.load(open(sys.argv[1]))
+with open(sys.argv[2], 'w') as fence:
+    for kernel in stats.get('suggestions', []):
+        for f in kernel['fences']:
+            fence.write('Fence@: %x | Epoch: %d | Info: %s | Type: %s\n' % (f['addr'], f['epoch'], f['info'], f['type']))
+
+mem = stats['memory']
+with open(sys.argv[3], 'w') as out:
+    out.write('App: %f MB\n' % mem['app_mb'])
+    out.write('Metadata (Stream + Agg): %f MB\n' % mem['metadata_mb'])
+    out.write('Metadata (Fen): %f MB\n' % mem['fence_mb'])
+    out.write('Metadata (Sampling): %f MB\n' % mem['sampling_mb'])
+    out.write('Overhead: %f x\n' % mem['overhead'])
+EOF